@@ -48,7 +48,6 @@ int main(int argc, char** argv){
         omp_set_num_threads(NUM_THREADS);
         riff::ApplicationConfiguration ac;
         riff::Application app(CHNAME, NUM_THREADS, new DemoAggregator());
-        usleep(5000000);
 #pragma omp parallel for
         for(size_t i = 0; i < ITERATIONS; i++){
             int threadId = omp_get_thread_num();
@@ -11,14 +11,17 @@
 
 #define CHNAME "ipc:///tmp/demo.ipc"
 
+#ifndef ITERATIONS
 #define ITERATIONS 1000000000
+#endif
+#ifndef NUM_THREADS
 #define NUM_THREADS 2
+#endif
 #define STARTX 16031.099125085183
 
 int main(int argc, char** argv){
     omp_set_num_threads(NUM_THREADS);
     riff::Application app(CHNAME, NUM_THREADS);
-    usleep(5000000);
     double x = STARTX;
     ulong start = riff::getCurrentTimeNs();
 #pragma omp parallel for
@@ -29,6 +32,21 @@ int main(int argc, char** argv){
         app.end(threadId);
     }
     ulong instrumentedDuration = riff::getCurrentTimeNs() - start;
+
+    // Same loop, but each thread looks up its data only once.
+    x = STARTX;
+    start = riff::getCurrentTimeNs();
+#pragma omp parallel
+    {
+        riff::Application::ThreadHandle handle = app.getThreadHandle(omp_get_thread_num());
+#pragma omp for
+        for(size_t i = 0; i < ITERATIONS; i++){
+            handle.begin();
+            x = std::sin(x);
+            handle.end();
+        }
+    }
+    ulong handleDuration = riff::getCurrentTimeNs() - start;
     app.terminate();
     std::cout << "dummy1: " << x << std::endl; // Needed to avoid compiler optimizations which could remove processing of variable x.
     std::cout << "Maximum throughput (iterations/sec): " << app.getTotalTasks()/(app.getExecutionTime()/1000.0) << std::endl;
@@ -42,9 +60,10 @@ int main(int argc, char** argv){
             x = std::sin(x);;
         }
         nonInstrumentedDuration = riff::getCurrentTimeNs() - start;
-    }while(nonInstrumentedDuration > instrumentedDuration);
+    }while(nonInstrumentedDuration > instrumentedDuration || nonInstrumentedDuration > handleDuration);
 
     std::cout << "dummy2: " << x << std::endl; // Needed to avoid compiler optimizations which could remove processing of variable x.
     std::cout << "begin-end pair overhead (ms): " << ((instrumentedDuration - nonInstrumentedDuration) / (double) ITERATIONS) / 1000000.0 << std::endl;
+    std::cout << "begin-end pair overhead with ThreadHandle (ms): " << ((handleDuration - nonInstrumentedDuration) / (double) ITERATIONS) / 1000000.0 << std::endl;
     return 0;
 }
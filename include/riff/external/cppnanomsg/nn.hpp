@@ -184,6 +184,11 @@ namespace nn
             return rc;
         }
 
+        inline uint64_t get_statistic (int stat)
+        {
+            return nn_get_statistic (s, stat);
+        }
+
     private:
 
         int s;
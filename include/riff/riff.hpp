@@ -10,22 +10,103 @@
 #ifndef RIFF_HPP_
 #define RIFF_HPP_
 
-#include <riff/archdata.hpp>
 #include <riff/external/cppnanomsg/nn.hpp>
+#include <riff/external/nanomsg/src/bus.h>
 #include <riff/external/nanomsg/src/pair.h>
+#include <riff/external/nanomsg/src/survey.h>
 
 #include <pthread.h>
 #include <string.h>
 #include <algorithm>
 #include <atomic>
+#include <cmath>
+#include <deque>
+#include <future>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <memory>
+#include <new>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #define RIFF_MAX_CUSTOM_FIELDS 8
 
+#ifndef LEVEL1_DCACHE_LINESIZE
+#define LEVEL1_DCACHE_LINESIZE 64
+#endif
+
+// Version of the encoding of the messages exchanged by the applications and
+// the monitors. Only changed by incompatible changes: the fields added later
+// are skipped by the older versions.
+#define RIFF_WIRE_VERSION 1
+
+// Maximum number of stalled threads reported in a sample.
+#define RIFF_MAX_STALLED_THREADS 16
+
+// Maximum length of the name of a region (see Application::region()).
+#define RIFF_MAX_REGION_NAME_LENGTH 31
+
+#ifndef RIFF_MAX_NAMED_METRICS
+// Maximum number of named metrics (see Application::counter()).
+#define RIFF_MAX_NAMED_METRICS 4096
+#endif
+
+// Maximum length of the name of a named metric.
+#define RIFF_MAX_NAMED_METRIC_NAME_LENGTH 47
+
+// Each thread allocates the values of the named metrics in chunks of this
+// size, when it first updates one of their metrics.
+#define RIFF_NAMED_METRICS_CHUNK_SIZE 64
+
+#define RIFF_NAMED_METRICS_CHUNKS \
+  ((RIFF_MAX_NAMED_METRICS + RIFF_NAMED_METRICS_CHUNK_SIZE - 1) / \
+   RIFF_NAMED_METRICS_CHUNK_SIZE)
+
+// Number of phases (see Application::setPhaseId()) whose statistics are
+// kept by the application and by the monitor.
+#define RIFF_MAX_PHASE_HISTORY 64
+
+// Number of threads which can publish their counters in the shared memory
+// segment (see ApplicationConfiguration::sharedMemory). The slots of exited
+// threads are reused only when all the others are in use.
+#define RIFF_SHARED_MEMORY_SLOTS 256
+
+// Changed each time the layout of the shared memory segment changes.
+#define RIFF_SHARED_MEMORY_VERSION 1
+
+// Maximum lengths of the name and of the labels of an application (see
+// ApplicationConfiguration::name).
+#define RIFF_MAX_APPLICATION_NAME_LENGTH 63
+#define RIFF_MAX_APPLICATION_LABELS_LENGTH 255
+
+// Number of regions whose data each thread can look up without locking.
+// Must be a power of two.
+#define RIFF_THREAD_DATA_CACHE_SIZE 4
+
+#ifndef RIFF_LATENCY_HISTOGRAM_PRECISION
+// Number of significant bits of the latencies counted in the latency
+// histograms. Latency percentiles are overestimated by at most a fraction
+// 2^-RIFF_LATENCY_HISTOGRAM_PRECISION of their value.
+#define RIFF_LATENCY_HISTOGRAM_PRECISION 5
+#endif
+
+// Latencies of 2^(RIFF_LATENCY_HISTOGRAM_MAX_EXPONENT + 1) clock ticks (about
+// 73 minutes with a nanosecond clock, 24 minutes with a 3GHz TSC) or longer
+// are all counted in the last bucket of the histograms.
+#define RIFF_LATENCY_HISTOGRAM_MAX_EXPONENT 41
+
+#define RIFF_LATENCY_HISTOGRAM_BUCKETS                 \
+  ((RIFF_LATENCY_HISTOGRAM_MAX_EXPONENT -              \
+    RIFF_LATENCY_HISTOGRAM_PRECISION + 2)              \
+   << RIFF_LATENCY_HISTOGRAM_PRECISION)
+
+// Number of events counted for each thread when
+// ApplicationConfiguration::perfCounters is set (see PerformanceCounters).
+#define RIFF_PERF_EVENTS 8
+
 #ifndef RIFF_DEFAULT_SAMPLING_LENGTH
 // Never skips any begin() call.
 #define RIFF_DEFAULT_SAMPLING_LENGTH 1
@@ -77,13 +158,192 @@ typedef struct ApplicationConfiguration {
   // [default = 5.0]
   double consistencyThreshold;
 
+  // Maximum time (milliseconds) the support thread waits, when a sample is
+  // requested, for threads which did not store anything since the previous
+  // request. After this deadline, a partial sample is returned, and the
+  // threads which did not contribute to it are reported as stalled (see
+  // Monitor::getStalledThreads()). If 0, the sample is returned immediately.
+  // [default = 10.0]
+  double consolidationDeadlineMs;
+
+  // Maximum percentage ([0, 100]) of the time of a thread spent in the
+  // begin()/end() calls. If greater than 0, each thread chooses the
+  // sampling length which keeps the instrumentation within this budget,
+  // according to the average time between two begin() calls, and
+  // samplingLengthMs is ignored.
+  // [default = 0.0]
+  double maxOverheadPercentage;
+
+  // When maxOverheadPercentage is used, minimum number of begin()/end()
+  // pairs each thread records between two samples requested by the monitor,
+  // so that the samples are statistically meaningful. Takes precedence over
+  // maxOverheadPercentage. If 0, there is no minimum.
+  // [default = 10]
+  unsigned int minSamplesPerWindow;
+
+  // When maxOverheadPercentage is used, weight ([0, 1]) of the last
+  // sampling period in the moving averages of the time between two begin()
+  // calls and between two samples. Lower values make the sampling length
+  // more stable but slower to adapt.
+  // [default = 0.25]
+  double samplingSmoothing;
+
+  // If true, the number of begin()/end() pairs skipped after each recorded
+  // one is random (geometrically distributed), with an average equal to the
+  // sampling length, rather than always equal to it. This avoids measuring
+  // always the same kind of task when the tasks follow a periodic pattern
+  // (e.g. a slow task every N) whose period is a multiple of the sampling
+  // length. Only used if the sampling is adaptive (see ApplicationPolicy).
+  // [default = false]
+  bool randomSampling;
+
+  // If true, each thread opens perf_event counters of hardware (cycles,
+  // instructions, cache and branch misses) and software (context switches
+  // and page faults) events when it first uses a region. They are only read
+  // by the support thread when consolidating a sample, so begin()/end() are
+  // not affected (see Monitor::getPerformanceCounters()). If the hardware
+  // events are not available (e.g. inside virtual machines without a
+  // virtual PMU), only the software ones are counted.
+  // [default = false]
+  bool perfCounters;
+
+  // If true, the support thread reads from the operating system how the
+  // threads have been scheduled (see Monitor::getSchedulingStatistics())
+  // when consolidating a sample. begin()/end() are not affected.
+  // [default = false]
+  bool schedulingStatistics;
+
+  // If true, the threads of the default region also publish their counters
+  // in a shared memory segment (/dev/shm/riff-<pid>), which a SharedMonitor
+  // running on the same machine reads directly, without involving the
+  // support thread. Must be set before the threads start, and by at most
+  // one application per process.
+  // [default = false]
+  bool sharedMemory;
+
+  // If not 0, the support thread consolidates a sample every pushIntervalMs
+  // milliseconds and sends it to the monitor without waiting for a request,
+  // so that the samples are evenly spaced. The monitor must then get them
+  // with Monitor::nextSample() instead of Monitor::getSample(). Not
+  // supported by the applications answering a SurveyMonitor.
+  // [default = 0]
+  double pushIntervalMs;
+
+  // Maximum number of pushed samples waiting to be sent when the monitor is
+  // slower than pushIntervalMs. When full, the oldest one is dropped (see
+  // Monitor::getDroppedSamples()).
+  // [default = 16]
+  unsigned int pushQueueLength;
+
+  // If not 0, the support thread also cuts the activity of the application
+  // (without its named regions) into windows of timeSeriesIntervalMs
+  // milliseconds, and sends the ones cut since the previous sample together
+  // with each sample (see Monitor::getTimeSeries()). The tasks are counted
+  // in the window in which their thread published them, i.e. at the end of
+  // each sampling period: samplingLengthMs should not be longer than
+  // timeSeriesIntervalMs.
+  // [default = 0]
+  double timeSeriesIntervalMs;
+
+  // Number of windows kept by the application until they are sent. If the
+  // monitor gets the samples less often than every timeSeriesLength
+  // windows, the oldest ones are overwritten (see
+  // Monitor::getOverwrittenWindows()).
+  // [default = 1024]
+  unsigned int timeSeriesLength;
+
+  // Maximum time (milliseconds) terminate() waits for the monitor to
+  // receive the termination of the application (i.e. for its
+  // acknowledgement). The monitor receives it with its next
+  // getSample()/nextSample() call: if it does not call them within this
+  // time, the termination is lost. If negative, terminate() waits forever.
+  // If no monitor is attached, terminate() does not wait. The applications
+  // answering a SurveyMonitor send their totals as the answer to the next
+  // survey: they wait for it at most this time.
+  // [default = 10000.0]
+  double terminationTimeoutMs;
+
+  // Name and labels (e.g. "rank=3,job=42") of the application, sent to the
+  // monitor when the application starts (see MultiMonitor). At most
+  // RIFF_MAX_APPLICATION_NAME_LENGTH and RIFF_MAX_APPLICATION_LABELS_LENGTH
+  // characters.
+  // [default = ""]
+  std::string name;
+  std::string labels;
+
   ApplicationConfiguration() {
     samplingLengthMs = 10.0;
     adjustThroughput = true;
     consistencyThreshold = 5.0;
+    consolidationDeadlineMs = 10.0;
+    maxOverheadPercentage = 0.0;
+    minSamplesPerWindow = 10;
+    samplingSmoothing = 0.25;
+    randomSampling = false;
+    perfCounters = false;
+    schedulingStatistics = false;
+    sharedMemory = false;
+    pushIntervalMs = 0;
+    pushQueueLength = 16;
+    timeSeriesIntervalMs = 0;
+    timeSeriesLength = 1024;
+    terminationTimeoutMs = 10000.0;
   }
 } ApplicationConfiguration;
 
+// Clocks which can be used to take the timestamps (see setClockSource()).
+typedef enum ClockSource {
+  // The one specified by the RIFF_CLOCK_SOURCE environment variable ("tsc",
+  // "monotonic" or "monotonic_coarse"). If not set, the TSC if it is
+  // invariant, CLOCK_MONOTONIC otherwise.
+  CLOCK_SOURCE_DEFAULT = 0,
+  // The timestamp counter of the CPU. It must be invariant (i.e. it ticks at
+  // a constant rate, and the same on all the cores). Its frequency is
+  // calibrated against CLOCK_MONOTONIC when the clock is initialized. If the
+  // RIFF_CLOCK_CALIBRATION_FILE environment variable is set, the calibration
+  // is cached in that file and reused by the following runs on the same CPU
+  // model.
+  CLOCK_SOURCE_TSC,
+  // clock_gettime(CLOCK_MONOTONIC).
+  CLOCK_SOURCE_MONOTONIC,
+  // clock_gettime(CLOCK_MONOTONIC_COARSE). Cheaper, but with the resolution
+  // of the timer interrupt (usually some milliseconds).
+  CLOCK_SOURCE_MONOTONIC_COARSE
+} ClockSource;
+
+/**
+ * Sets the clock used to take the timestamps. Must be called before
+ * creating any Application and before any other function reading the clock.
+ * If not called, the clock is initialized with CLOCK_SOURCE_DEFAULT.
+ * @param source The clock.
+ */
+void setClockSource(ClockSource source);
+
+/**
+ * Returns the clock used to take the timestamps. Never CLOCK_SOURCE_DEFAULT.
+ * @return The clock used to take the timestamps.
+ */
+ClockSource getClockSource();
+
+/**
+ * Returns the current value of the clock, in clock ticks. Begin()/end() only
+ * store ticks, which are converted to nanoseconds when the samples are
+ * consolidated. The clock must have been initialized (e.g. by creating an
+ * Application).
+ * @return The current value of the clock, in clock ticks.
+ */
+unsigned long long getCurrentTicks();
+
+/**
+ * Returns the duration of a clock tick.
+ * @return The duration of a clock tick (nanoseconds).
+ */
+double getNsPerTick();
+
+/**
+ * Returns the current value of the clock, in nanoseconds.
+ * @return The current value of the clock, in nanoseconds.
+ */
 unsigned long long getCurrentTimeNs();
 
 typedef enum MessageType {
@@ -91,7 +351,12 @@ typedef enum MessageType {
   MESSAGE_TYPE_SAMPLE_REQ,
   MESSAGE_TYPE_SAMPLE_RES,
   MESSAGE_TYPE_STOP,
-  MESSAGE_TYPE_STOPACK
+  MESSAGE_TYPE_STOPACK,
+  // Asks the application to send MESSAGE_TYPE_START again.
+  MESSAGE_TYPE_INFO_REQ,
+  // Sent by a monitor when it attaches to the application, which sends
+  // MESSAGE_TYPE_START again and discards what it sampled so far.
+  MESSAGE_TYPE_ATTACH
 } MessageType;
 
 /*!
@@ -324,21 +589,389 @@ inline std::istream& operator>>(std::istream& is, ApplicationSample& sample) {
   return is;
 }
 
-typedef union Payload {
-  pid_t pid;
+/*!
+ * \struct LatencyPercentiles
+ * \brief Percentiles of the latency of the tasks computed in a sample.
+ *
+ * Computed from per-thread latency histograms, so each value is an upper
+ * bound of the actual one (see RIFF_LATENCY_HISTOGRAM_PRECISION). All the
+ * values are 0 if no tasks have been computed.
+ */
+typedef struct LatencyPercentiles {
+  // Percentiles of the latency (nanoseconds).
+  double p50;
+  double p90;
+  double p99;
+  double p999;
+
+  // The maximum latency (nanoseconds).
+  double max;
+
+  LatencyPercentiles() : p50(0), p90(0), p99(0), p999(0), max(0) { ; }
+} LatencyPercentiles;
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const LatencyPercentiles& obj) {
+  os << "[";
+  os << "P50: " << obj.p50 << " ";
+  os << "P90: " << obj.p90 << " ";
+  os << "P99: " << obj.p99 << " ";
+  os << "P99.9: " << obj.p999 << " ";
+  os << "Max: " << obj.max << " ";
+  os << "]";
+  return os;
+}
+
+/*!
+ * \struct SamplingStatistics
+ * \brief How begin()/end() calls have been sampled in a sample.
+ */
+typedef struct SamplingStatistics {
+  // Average number of tasks per recorded begin()/end() pair (1 if no call
+  // has been skipped).
+  double samplingLength;
+
+  // Estimated percentage ([0, 100]) of the time of the threads spent in the
+  // begin()/end() calls, from their costs measured by the application.
+  double overheadPercentage;
+
+  SamplingStatistics() : samplingLength(0), overheadPercentage(0) { ; }
+} SamplingStatistics;
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const SamplingStatistics& obj) {
+  os << "[";
+  os << "SamplingLength: " << obj.samplingLength << " ";
+  os << "Overhead: " << obj.overheadPercentage << " ";
+  os << "]";
+  return os;
+}
+
+/*!
+ * \struct PerformanceCounters
+ * \brief The events counted by the threads which contributed to a sample
+ * (see ApplicationConfiguration::perfCounters). Since they are counted per
+ * thread, they include what the threads did outside of the region.
+ */
+typedef struct PerformanceCounters {
+  // False if the hardware (respectively software) events could not be
+  // counted by any thread. Events not available are 0.
+  bool hardware;
+  bool software;
+
+  // Hardware events.
+  double cycles;
+  double instructions;
+  double cacheReferences;
+  double cacheMisses;
+  double branches;
+  double branchMisses;
+
+  // Software events.
+  double contextSwitches;
+  double pageFaults;
+
+  // Instructions per cycle, and fractions ([0, 1]) of the cache references
+  // and of the branches which missed (0 if not available).
+  double ipc;
+  double cacheMissRate;
+  double branchMissRate;
+
+  PerformanceCounters()
+      : hardware(false),
+        software(false),
+        cycles(0),
+        instructions(0),
+        cacheReferences(0),
+        cacheMisses(0),
+        branches(0),
+        branchMisses(0),
+        contextSwitches(0),
+        pageFaults(0),
+        ipc(0),
+        cacheMissRate(0),
+        branchMissRate(0) {
+    ;
+  }
+} PerformanceCounters;
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const PerformanceCounters& obj) {
+  os << "[";
+  if (obj.hardware) {
+    os << "IPC: " << obj.ipc << " ";
+    os << "CacheMissRate: " << obj.cacheMissRate << " ";
+    os << "BranchMissRate: " << obj.branchMissRate << " ";
+  }
+  if (obj.software) {
+    os << "ContextSwitches: " << obj.contextSwitches << " ";
+    os << "PageFaults: " << obj.pageFaults << " ";
+  }
+  os << "]";
+  return os;
+}
+
+/*!
+ * \struct SchedulingStatistics
+ * \brief How the operating system scheduled the threads in a sample (see
+ * ApplicationConfiguration::schedulingStatistics). Unlike
+ * ApplicationSample::loadPercentage, which is based on the wall clock time,
+ * they tell whether the threads were actually running.
+ */
+typedef struct SchedulingStatistics {
+  // False if they could not be read (e.g. on kernels without schedstat).
+  bool available;
+
+  // Average fractions ([0, 1]) of the time the threads spent running on a
+  // CPU, runnable but waiting for a CPU, and blocked (e.g. sleeping or
+  // waiting for I/O).
+  double onCpuFraction;
+  double runnableFraction;
+  double blockedFraction;
+
+  // Total CPU time of the threads (milliseconds).
+  double cpuTimeMs;
+
+  // Total voluntary and involuntary context switches of the threads.
+  double voluntaryContextSwitches;
+  double involuntaryContextSwitches;
+
+  SchedulingStatistics()
+      : available(false),
+        onCpuFraction(0),
+        runnableFraction(0),
+        blockedFraction(0),
+        cpuTimeMs(0),
+        voluntaryContextSwitches(0),
+        involuntaryContextSwitches(0) {
+    ;
+  }
+} SchedulingStatistics;
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const SchedulingStatistics& obj) {
+  os << "[";
+  os << "OnCpu: " << obj.onCpuFraction << " ";
+  os << "Runnable: " << obj.runnableFraction << " ";
+  os << "Blocked: " << obj.blockedFraction << " ";
+  os << "CpuTimeMs: " << obj.cpuTimeMs << " ";
+  os << "VoluntarySwitches: " << obj.voluntaryContextSwitches << " ";
+  os << "InvoluntarySwitches: " << obj.involuntaryContextSwitches << " ";
+  os << "]";
+  return os;
+}
+
+/*!
+ * \struct StalledThread
+ * \brief A thread which did not contribute to a sample.
+ */
+typedef struct StalledThread {
+  // The identifier of the thread.
+  unsigned int threadId;
+
+  // Time elapsed since the last begin()/end() call of the thread
+  // (milliseconds).
+  double stallTimeMs;
+} StalledThread;
+
+/*!
+ * \enum NamedMetricType
+ * \brief The type of a named metric.
+ */
+typedef enum NamedMetricType {
+  // See Application::counter().
+  NAMED_METRIC_COUNTER = 0,
+  // See Application::gauge().
+  NAMED_METRIC_GAUGE
+} NamedMetricType;
+
+/*!
+ * \struct NamedMetric
+ * \brief A named metric, as received by the Monitor.
+ */
+typedef struct NamedMetric {
+  std::string name;
+  NamedMetricType type;
+  // For a counter, the amount added to it in the last sample. For a gauge,
+  // the sum of the last values set by the threads.
+  double value;
+} NamedMetric;
+
+// A named metric, sent to the monitor in the first sample after its
+// registration. Its index is its position in the registration order.
+typedef struct NamedMetricInfo {
+  char name[RIFF_MAX_NAMED_METRIC_NAME_LENGTH + 1];
+  NamedMetricType type;
+} NamedMetricInfo;
+
+// The value of a named metric which changed since the previous sample. For
+// counters, it is the total added by all the threads since the beginning.
+typedef struct NamedMetricUpdate {
+  unsigned int index;
+  double value;
+} NamedMetricUpdate;
+
+/*!
+ * \struct PhaseStatistics
+ * \brief The statistics of a phase (see Application::setPhaseId()), over
+ * all the threads, since the phase started.
+ */
+typedef struct PhaseStatistics {
+  // The identifier of the phase.
+  unsigned int phaseId;
+
+  // Time elapsed from the first thread starting the phase to the last task
+  // computed in it (milliseconds).
+  double durationMs;
+
+  // Number of tasks computed in the phase.
+  double numTasks;
+
+  // Tasks computed per second in the phase.
+  double throughput;
+
+  // Average latency of the tasks (nanoseconds).
+  double latency;
+
+  // Percentage ([0, 100]) of the time the threads spent computing tasks.
+  double loadPercentage;
+
+  PhaseStatistics()
+      : phaseId(0),
+        durationMs(0),
+        numTasks(0),
+        throughput(0),
+        latency(0),
+        loadPercentage(0) {
+    ;
+  }
+} PhaseStatistics;
+
+inline std::ostream& operator<<(std::ostream& os, const PhaseStatistics& obj) {
+  os << "[";
+  os << "PhaseId: " << obj.phaseId << " ";
+  os << "DurationMs: " << obj.durationMs << " ";
+  os << "NumTasks: " << obj.numTasks << " ";
+  os << "Throughput: " << obj.throughput << " ";
+  os << "Latency: " << obj.latency << " ";
+  os << "Load: " << obj.loadPercentage << " ";
+  os << "]";
+  return os;
+}
+
+/*!
+ * \struct TimeSeriesWindow
+ * \brief A window of the time series of an application (see
+ * ApplicationConfiguration::timeSeriesIntervalMs).
+ */
+typedef struct TimeSeriesWindow {
+  // Position of the window in the time series (0 for the first one).
+  unsigned long long index;
+
+  // Start of the window, since the application started the time series,
+  // and its length (milliseconds). The windows are shorter when a sample
+  // is consolidated, and longer when the support thread is late.
+  double startMs;
+  double durationMs;
+
+  // The tasks published by the threads in the window. The custom fields
+  // are not used.
+  ApplicationSample sample;
+
+  TimeSeriesWindow() : index(0), startMs(0), durationMs(0) { ; }
+} TimeSeriesWindow;
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const TimeSeriesWindow& obj) {
+  os << "[";
+  os << "Index: " << obj.index << " ";
+  os << "StartMs: " << obj.startMs << " ";
+  os << "DurationMs: " << obj.durationMs << " ";
+  os << "Sample: " << obj.sample << " ";
+  os << "]";
+  return os;
+}
+
+/*!
+ * \struct RegionSample
+ * \brief The sample of a named region (see Application::region()).
+ */
+typedef struct RegionSample {
+  // The name of the region.
+  char name[RIFF_MAX_REGION_NAME_LENGTH + 1];
+
+  // The sample of the region.
   ApplicationSample sample;
-  struct {
-    ulong time;
-    unsigned long long totalTasks;
-  } summary;
-  Payload() { ; }
-} Payload;
 
+  // Same as the corresponding Monitor getters, for the threads of the
+  // region. Only the first min(numStalled, RIFF_MAX_STALLED_THREADS)
+  // stalled threads are valid.
+  unsigned int contributingThreads;
+  unsigned int activeThreads;
+  unsigned int numStalled;
+  StalledThread stalled[RIFF_MAX_STALLED_THREADS];
+  LatencyPercentiles latencyPercentiles;
+  SamplingStatistics samplingStatistics;
+  PerformanceCounters performanceCounters;
+  SchedulingStatistics schedulingStatistics;
+} RegionSample;
+
+// A message exchanged by the applications and the monitors. It is encoded
+// field by field (see RIFF_WIRE_VERSION), so that the applications and the
+// monitors do not need to be built with the same settings (e.g.
+// RIFF_MAX_CUSTOM_FIELDS).
 typedef struct Message {
   MessageType type;
-  Payload payload;
+  // The application which sent the message, or to which it is sent (0 for
+  // all of them, see MultiMonitor).
+  pid_t pid;
+  // See ApplicationConfiguration::name (MESSAGE_TYPE_START).
+  std::string name;
+  std::string labels;
+  // MESSAGE_TYPE_STOP.
+  ulong executionTime;
+  unsigned long long totalTasks;
+  // The sample of the default region (its name is not used), and of the
+  // other ones (MESSAGE_TYPE_SAMPLE_RES).
+  RegionSample sample;
+  std::vector<RegionSample> regions;
   unsigned int phaseId;
   unsigned int totalThreads;
+  // Number of fields of the metric schema of the application, and the
+  // serialized metrics (see MetricSchema) of the application and then of
+  // each region.
+  unsigned int numMetricFields;
+  std::vector<double> metricValues;
+  // The named metrics registered since the previous sample, the index of
+  // the first one (in registration order), and the ones which changed.
+  std::vector<NamedMetricInfo> newNamedMetrics;
+  unsigned int firstNewNamedMetric;
+  std::vector<NamedMetricUpdate> namedMetricUpdates;
+  // The phases updated since the previous sample.
+  std::vector<PhaseStatistics> phases;
+  // Samples dropped by the application just before this one (see
+  // ApplicationConfiguration::pushQueueLength).
+  unsigned int droppedSamples;
+  // The windows of the time series cut since the previous sample, the index
+  // of the first one, and the ones overwritten before being sent.
+  unsigned long long firstWindow;
+  std::vector<TimeSeriesWindow> windows;
+  unsigned long long overwrittenWindows;
+
+  Message()
+      : type(MESSAGE_TYPE_START),
+        pid(0),
+        executionTime(0),
+        totalTasks(0),
+        phaseId(0),
+        totalThreads(0),
+        numMetricFields(0),
+        firstNewNamedMetric(0),
+        droppedSamples(0),
+        firstWindow(0),
+        overwrittenWindows(0) {
+    ;
+  }
 } Message;
 
 class Aggregator {
@@ -357,71 +990,1302 @@ class Aggregator {
                            const std::vector<double>& customValues) = 0;
 };
 
+/*!
+ * \enum MetricReduction
+ * \brief How the values stored in a Metric are reduced.
+ */
+typedef enum MetricReduction {
+  METRIC_SUM = 0,
+  METRIC_MIN,
+  METRIC_MAX,
+  // The last stored value. When merging the values of several threads, the
+  // one of the last merged thread.
+  METRIC_LAST,
+  METRIC_MEAN
+} MetricReduction;
+
+/**
+ * A field of a metric schema (see ApplicationPolicy). The values stored by
+ * a thread are reduced as soon as they are stored, and the reductions of
+ * the threads are merged when a sample is consolidated, so that no value
+ * stored within a sample is lost.
+ * A metric schema is a struct of Metric fields with a member
+ *
+ *   template <typename Visitor> void visit(Visitor& v) { v(a); v(b); ... }
+ *
+ * calling v on each of its fields, always in the same order.
+ */
+template <MetricReduction Reduction>
+class Metric {
+ private:
+  double _value;
+  double _count;
+
+  inline void reduce(double value) {
+    switch (Reduction) {
+      case METRIC_SUM:
+      case METRIC_MEAN: {
+        _value += value;
+      } break;
+      case METRIC_MIN: {
+        _value = (_count && _value < value) ? _value : value;
+      } break;
+      case METRIC_MAX: {
+        _value = (_count && _value > value) ? _value : value;
+      } break;
+      case METRIC_LAST: {
+        _value = value;
+      } break;
+    }
+  }
+
+ public:
+  Metric() : _value(0), _count(0) { ; }
+
+  /**
+   * Stores a value.
+   * @param value The value.
+   */
+  inline void store(double value) {
+    reduce(value);
+    ++_count;
+  }
+
+  /**
+   * Adds the values stored in another metric, as if they had been stored
+   * after the ones of this metric.
+   * @param other The other metric.
+   */
+  inline void merge(const Metric& other) {
+    if (other._count) {
+      reduce(other._value);
+      _count += other._count;
+    }
+  }
+
+  /**
+   * Returns the reduction of the stored values.
+   * @return The reduction of the stored values (0 if no values have been
+   * stored).
+   */
+  inline double get() const {
+    if (Reduction == METRIC_MEAN) {
+      return _count ? _value / _count : 0;
+    }
+    return _value;
+  }
+
+  /**
+   * Returns the number of stored values.
+   * @return The number of stored values.
+   */
+  inline double getCount() const { return _count; }
+
+  /**
+   * Sets the reduction and the number of stored values (used by the
+   * Monitor to rebuild the metrics it receives).
+   * @param value The reduction of the stored values.
+   * @param count The number of stored values.
+   */
+  inline void set(double value, double count) {
+    _value = (Reduction == METRIC_MEAN) ? value * count : value;
+    _count = count;
+  }
+};
+
+/**
+ * The schema of applications without metrics.
+ */
+struct NoMetrics {
+  template <typename Visitor>
+  void visit(Visitor&) {
+    ;
+  }
+};
+
+// A metric schema without its type, used where the type of the metrics is
+// not known (i.e. in ThreadData and in ApplicationBase). Each field is
+// serialized as two doubles: its reduction and the number of stored values.
+typedef struct MetricSchema {
+  // Size of the metrics (bytes).
+  size_t size;
+  size_t numFields;
+  // Constructs the metrics in (uninitialized) memory.
+  void (*init)(void* metrics);
+  // Merges the metrics 'src' into 'dst' (see Metric::merge()).
+  void (*merge)(void* dst, const void* src);
+  // Writes the 2 * numFields values of the metrics.
+  void (*serialize)(const void* metrics, double* values);
+  // Sets the metrics from 2 * numFields values.
+  void (*deserialize)(void* metrics, const double* values);
+} MetricSchema;
+
+template <typename Metrics>
+class MetricSchemaOf {
+ private:
+  struct Counter {
+    size_t numFields;
+    template <MetricReduction R>
+    void operator()(Metric<R>&) {
+      ++numFields;
+    }
+  };
+
+  // Merges the field of 'src' at the same offset of the visited field of
+  // 'dst'.
+  struct Merger {
+    const char* dst;
+    const char* src;
+    template <MetricReduction R>
+    void operator()(Metric<R>& m) {
+      m.merge(*reinterpret_cast<const Metric<R>*>(
+          src + (reinterpret_cast<const char*>(&m) - dst)));
+    }
+  };
+
+  struct Serializer {
+    double* values;
+    template <MetricReduction R>
+    void operator()(Metric<R>& m) {
+      *values++ = m.get();
+      *values++ = m.getCount();
+    }
+  };
+
+  struct Deserializer {
+    const double* values;
+    template <MetricReduction R>
+    void operator()(Metric<R>& m) {
+      m.set(values[0], values[1]);
+      values += 2;
+    }
+  };
+
+  static void init(void* metrics) { new (metrics) Metrics(); }
+
+  static void merge(void* dst, const void* src) {
+    Merger merger = {static_cast<const char*>(dst),
+                     static_cast<const char*>(src)};
+    static_cast<Metrics*>(dst)->visit(merger);
+  }
+
+  static void serialize(const void* metrics, double* values) {
+    Serializer serializer = {values};
+    // visit() is not const, but the serializer does not modify the fields.
+    const_cast<Metrics*>(static_cast<const Metrics*>(metrics))
+        ->visit(serializer);
+  }
+
+  static void deserialize(void* metrics, const double* values) {
+    Deserializer deserializer = {values};
+    static_cast<Metrics*>(metrics)->visit(deserializer);
+  }
+
+  static size_t countFields() {
+    Metrics metrics;
+    Counter counter = {0};
+    metrics.visit(counter);
+    return counter.numFields;
+  }
+
+ public:
+  static_assert(std::is_trivially_destructible<Metrics>::value,
+                "Metrics must be trivially destructible.");
+
+  static const MetricSchema* get() {
+    static const MetricSchema schema = {sizeof(Metrics), countFields(), init,
+                                        merge, serialize, deserialize};
+    return &schema;
+  }
+};
+
+// Returns the schema of a metrics struct (NULL for NoMetrics).
+template <typename Metrics>
+inline const MetricSchema* getMetricSchema() {
+  return MetricSchemaOf<Metrics>::get();
+}
+
+template <>
+inline const MetricSchema* getMetricSchema<NoMetrics>() {
+  return NULL;
+}
+
+// State of the metrics handed off by a thread to the support thread (see
+// ThreadData).
+typedef enum MetricsState {
+  // Nothing handed off (or already merged by the support thread).
+  METRICS_EMPTY = 0,
+  // Handed off and not yet merged.
+  METRICS_FULL,
+  // Being merged by the support thread.
+  METRICS_READING
+} MetricsState;
+
+// Cumulative counters of a thread. They are updated by the thread itself
+// and periodically published (see ThreadData) so that the support thread
+// can compute a sample as the difference between two successive snapshots.
+typedef struct ThreadSnapshot {
+  // Estimated time spent in the computation (clock ticks).
+  double latency;
+  // Estimated time spent outside the computation (clock ticks).
+  double idleTime;
+  // Estimated number of computed tasks.
+  double numTasks;
+  // Number of recorded (i.e. not skipped) begin()/end() pairs.
+  double recordedPairs;
+  // Timestamp of the first begin() call.
+  unsigned long long startTime;
+  // Timestamp of the last update of these counters (0 if never updated).
+  unsigned long long timestamp;
+  // Last values stored through storeCustomValue.
+  double customFields[RIFF_MAX_CUSTOM_FIELDS];
+  // The phase of the thread (see Application::setPhaseId()), when the
+  // thread started it and the counters at that time.
+  unsigned int phaseId;
+  unsigned long long phaseStartTime;
+  double phaseStartLatency;
+  double phaseStartIdleTime;
+  double phaseStartTasks;
+
+  ThreadSnapshot()
+      : latency(0),
+        idleTime(0),
+        numTasks(0),
+        recordedPairs(0),
+        startTime(0),
+        timestamp(0),
+        phaseId(0),
+        phaseStartTime(0),
+        phaseStartLatency(0),
+        phaseStartIdleTime(0),
+        phaseStartTasks(0) {
+    for (size_t i = 0; i < RIFF_MAX_CUSTOM_FIELDS; i++) {
+      customFields[i] = 0;
+    }
+  }
+} ThreadSnapshot;
+
+// The counters of a phase accumulated by the support thread (clock ticks).
+typedef struct PhaseRecord {
+  unsigned int phaseId;
+  double numTasks;
+  double latency;
+  double idleTime;
+  unsigned long long start;
+  unsigned long long end;
+} PhaseRecord;
+
+typedef enum SharedSlotState {
+  SHARED_SLOT_FREE = 0,
+  SHARED_SLOT_USED,
+  // The thread exited, its last counters can still be read.
+  SHARED_SLOT_EXITED
+} SharedSlotState;
+
+// The counters of a thread in the shared memory segment. Only written by
+// the thread, and read by other processes with the same sequence lock used
+// for ThreadData::published. Only lock-free atomics are used, so that they
+// work across processes.
+typedef struct SharedThreadSlot {
+  std::atomic<unsigned long> seq
+      __attribute__((aligned(LEVEL1_DCACHE_LINESIZE)));
+  ThreadSnapshot published;
+  // Incremented (under the sequence lock) each time the slot is assigned to
+  // a thread, so that readers never compute a sample as the difference
+  // between the counters of two different threads.
+  std::atomic<unsigned long> generation;
+  // A SharedSlotState.
+  std::atomic<unsigned int> state;
+
+  inline void publish(const ThreadSnapshot& snapshot) {
+    unsigned long s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    published = snapshot;
+    seq.store(s + 2, std::memory_order_release);
+  }
+
+  // Clears the counters for a new thread.
+  inline void reset() {
+    unsigned long s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    published = ThreadSnapshot();
+    generation.store(generation.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+    seq.store(s + 2, std::memory_order_release);
+  }
+
+  // Reads the last published counters and the generation of the slot.
+  inline void read(ThreadSnapshot& snapshot, unsigned long& gen) const {
+    unsigned long s1, s2;
+    do {
+      s1 = seq.load(std::memory_order_acquire);
+      snapshot = published;
+      gen = generation.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      s2 = seq.load(std::memory_order_relaxed);
+    } while ((s1 & 1) || s1 != s2);
+  }
+} SharedThreadSlot;
+
+// The shared memory segment of an application.
+typedef struct SharedSegment {
+  unsigned int magic;
+  unsigned int version;
+  pid_t pid;
+  // To convert the timestamps of the threads.
+  double nsPerTick;
+  // See ApplicationConfiguration::consistencyThreshold.
+  std::atomic<double> consistencyThreshold;
+  std::atomic<unsigned int> phaseId;
+  // Set when the application terminates.
+  std::atomic<bool> terminated;
+  // Threads which found no free slot.
+  std::atomic<unsigned int> droppedThreads;
+  SharedThreadSlot slots[RIFF_SHARED_MEMORY_SLOTS];
+} SharedSegment;
+
+// Returns the bucket of the latency histograms (see ThreadData) counting a
+// latency (clock ticks). Latencies smaller than
+// 2^RIFF_LATENCY_HISTOGRAM_PRECISION have their own bucket. Each power of
+// two above is split in 2^RIFF_LATENCY_HISTOGRAM_PRECISION buckets of the
+// same width.
+inline size_t getLatencyBucket(unsigned long long latency) {
+  if (latency < (1ULL << RIFF_LATENCY_HISTOGRAM_PRECISION)) {
+    return latency;
+  }
+  unsigned int exponent = 63 - __builtin_clzll(latency);
+  if (exponent > RIFF_LATENCY_HISTOGRAM_MAX_EXPONENT) {
+    return RIFF_LATENCY_HISTOGRAM_BUCKETS - 1;
+  }
+  unsigned int shift = exponent - RIFF_LATENCY_HISTOGRAM_PRECISION;
+  return ((shift + 1) << RIFF_LATENCY_HISTOGRAM_PRECISION) +
+         (latency >> shift) - (1ULL << RIFF_LATENCY_HISTOGRAM_PRECISION);
+}
+
+// Returns the highest latency (clock ticks) counted in a bucket of the
+// latency histograms.
+unsigned long long getLatencyBucketMax(size_t bucket);
+
 typedef struct ThreadData {
-  ApplicationSample sample __attribute__((aligned(LEVEL1_DCACHE_LINESIZE)));
-  ApplicationSample consolidatedSample;
+  // Counters updated by the thread.
+  ThreadSnapshot current __attribute__((aligned(LEVEL1_DCACHE_LINESIZE)));
   unsigned long long rcvStart;
   unsigned long long computeStart;
-  unsigned long long idleTime;
   unsigned long long firstBegin;
   unsigned long long lastEnd;
-  unsigned long long sampleStartTime;
   unsigned long long totalTasks;
-  std::atomic<bool>* consolidate;
+  // Start time and number of tasks of the window used to compute the
+  // sampling length. A new window is started at each new epoch.
+  unsigned long long windowStart;
+  double windowTasks;
+  unsigned long long epoch;
   ulong samplingLength;
   ulong currentSample;
+  // Length of the current sampling period, i.e. number of begin()/end()
+  // pairs represented by the recorded one. Equal to samplingLength unless
+  // ApplicationConfiguration::randomSampling is set.
+  ulong periodLength;
+  // State of the random generator used to choose periodLength.
+  unsigned long long randomState;
+  // Used when ApplicationConfiguration::maxOverheadPercentage is set: start
+  // time and number of tasks at the beginning of the current sampling
+  // period, and moving averages of the time between two tasks and between
+  // two epochs (clock ticks, 0 if not known yet).
+  unsigned long long periodStart;
+  double periodTasks;
+  double taskInterval;
+  double epochInterval;
+  // Metrics (see ApplicationPolicy) stored by the thread since it last
+  // handed them off, and the ones handed off to the support thread. Both
+  // follow this struct in memory (NULL if the application has no metrics).
+  void* metrics;
+  void* handedOffMetrics;
+  const MetricSchema* metricSchema;
+  // Values of the named metrics (see Application::counter()), in chunks of
+  // RIFF_NAMED_METRICS_CHUNK_SIZE. Only written by the thread, read by the
+  // support thread without locking.
+  std::atomic<std::atomic<double>*> namedValues[RIFF_NAMED_METRICS_CHUNKS];
+
+  // Number of tasks computed with each latency (see getLatencyBucket()).
+  // Only written by the thread, read by the support thread without locking.
+  std::atomic<unsigned long long>
+      latencyHistogram[RIFF_LATENCY_HISTOGRAM_BUCKETS]
+      __attribute__((aligned(LEVEL1_DCACHE_LINESIZE)));
+
+  // Last published counters, protected by a sequence lock (odd values of seq
+  // mean that the thread is writing them). They are only written by the
+  // thread and read by the support thread, which never waits for the thread.
+  std::atomic<unsigned long> seq
+      __attribute__((aligned(LEVEL1_DCACHE_LINESIZE)));
+  ThreadSnapshot published;
+  // Timestamp of the last sampled begin()/end() call, used to detect
+  // stalled threads.
+  std::atomic<unsigned long long> lastActivity;
+  // Set when a thread which registered itself terminates.
+  std::atomic<bool> exited;
+  // File descriptors of the perf_event groups of the thread (hardware and
+  // software events, -1 if not opened) and the events of their members, in
+  // order (see ApplicationConfiguration::perfCounters).
+  int perfGroups[2];
+  unsigned int perfGroupEvents[2][RIFF_PERF_EVENTS];
+  unsigned int perfGroupSizes[2];
+  // The slot of the thread in the shared memory segment (NULL if none,
+  // see ApplicationConfiguration::sharedMemory).
+  SharedThreadSlot* sharedSlot;
+  // Kernel identifier and CPU time clock of the thread.
+  pid_t tid;
+  clockid_t cpuClock;
+  // A MetricsState. handedOffMetrics is only accessed by the thread when
+  // METRICS_EMPTY, and by the support thread when METRICS_READING.
+  std::atomic<int> metricsState;
+
+  // Only accessed by the support thread: the last counters it consumed.
+  ThreadSnapshot lastRead __attribute__((aligned(LEVEL1_DCACHE_LINESIZE)));
+  // The last counters added to the time series of the application.
+  ThreadSnapshot lastWindowRead;
+  unsigned long long lastReadHistogram[RIFF_LATENCY_HISTOGRAM_BUCKETS];
+  double lastReadPerfEvents[RIFF_PERF_EVENTS];
+  // Scheduling counters of the thread (see readScheduling())
+  // at the last read, and when they were read (nanoseconds, 0 if never).
+  double lastReadScheduling[4];
+  unsigned long long lastReadSchedulingTime;
+  unsigned int threadId;
+  // Number of owners of this data (the application and, for threads which
+  // registered themselves, the thread). The last one frees it.
+  std::atomic<unsigned int> refs;
   char padding[LEVEL1_DCACHE_LINESIZE];
 
   ThreadData()
       : rcvStart(0),
         computeStart(0),
-        idleTime(0),
         firstBegin(0),
         lastEnd(0),
-        sampleStartTime(0),
         totalTasks(0),
+        windowStart(0),
+        windowTasks(0),
+        epoch(0),
         samplingLength(RIFF_DEFAULT_SAMPLING_LENGTH),
-        currentSample(0) {
+        currentSample(0),
+        periodLength(RIFF_DEFAULT_SAMPLING_LENGTH),
+        randomState(1),
+        periodStart(0),
+        periodTasks(0),
+        taskInterval(0),
+        epochInterval(0),
+        metrics(NULL),
+        handedOffMetrics(NULL),
+        metricSchema(NULL),
+        seq(0),
+        lastActivity(0),
+        exited(false),
+        sharedSlot(NULL),
+        metricsState(METRICS_EMPTY),
+        threadId(0),
+        refs(1) {
+    for (size_t i = 0; i < RIFF_LATENCY_HISTOGRAM_BUCKETS; i++) {
+      latencyHistogram[i].store(0, std::memory_order_relaxed);
+      lastReadHistogram[i] = 0;
+    }
+    for (size_t i = 0; i < RIFF_NAMED_METRICS_CHUNKS; i++) {
+      namedValues[i].store(NULL, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < 2; i++) {
+      perfGroups[i] = -1;
+      perfGroupSizes[i] = 0;
+    }
+    for (size_t i = 0; i < RIFF_PERF_EVENTS; i++) {
+      lastReadPerfEvents[i] = 0;
+    }
+    tid = 0;
+    cpuClock = 0;
+    for (size_t i = 0; i < 4; i++) {
+      lastReadScheduling[i] = 0;
+    }
+    lastReadSchedulingTime = 0;
     memset(&padding, 0, sizeof(padding));
-    consolidate = new std::atomic<bool>(false);
   }
 
   ThreadData(ThreadData const&) = delete;
   ThreadData& operator=(ThreadData const&) = delete;
+
+  // Publishes the current counters. Only called by the owner thread.
+  // If CustomFields is false, the custom values are not published.
+  template <bool CustomFields = true>
+  inline void publish(unsigned long long now) {
+    current.timestamp = now;
+    unsigned long s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (CustomFields) {
+      published = current;
+    } else {
+      published.latency = current.latency;
+      published.idleTime = current.idleTime;
+      published.numTasks = current.numTasks;
+      published.recordedPairs = current.recordedPairs;
+      published.startTime = current.startTime;
+      published.timestamp = current.timestamp;
+      published.phaseId = current.phaseId;
+      published.phaseStartTime = current.phaseStartTime;
+      published.phaseStartLatency = current.phaseStartLatency;
+      published.phaseStartIdleTime = current.phaseStartIdleTime;
+      published.phaseStartTasks = current.phaseStartTasks;
+    }
+    seq.store(s + 2, std::memory_order_release);
+    if (sharedSlot) {
+      sharedSlot->publish(published);
+    }
+  }
+
+  // Allocates the data of a thread, with room for the metrics of the
+  // schema (if any). Must be called by the thread itself, so that the memory
+  // is first touched (and thus allocated) on the NUMA node where the thread
+  // is running.
+  static ThreadData* allocate(unsigned int threadId, unsigned int refs,
+                              const MetricSchema* metricSchema = NULL);
+
+  // Hands off the metrics stored since the last hand off to the support
+  // thread, merging them with the ones it did not merge yet. Only called by
+  // the owner thread. Returns false (and does nothing) if the support thread
+  // is merging the handed off metrics.
+  bool handOffMetrics();
+
+  // Drops one owner, freeing the data if it was the last one.
+  void release();
+
+  // Leaves the slot in the shared memory segment (if any), keeping its last
+  // counters readable. Only called by the owner thread, or when the data is
+  // freed.
+  void leaveSharedSlot();
+
+  // Allocates a chunk of values of the named metrics. Only called by the
+  // owner thread.
+  std::atomic<double>* allocateNamedValues(size_t chunk);
+
+  // Returns the value of a named metric. Only called by the owner thread.
+  inline std::atomic<double>& getNamedValue(size_t index) {
+    size_t chunk = index / RIFF_NAMED_METRICS_CHUNK_SIZE;
+    std::atomic<double>* values =
+        namedValues[chunk].load(std::memory_order_relaxed);
+    if (!values) {
+      values = allocateNamedValues(chunk);
+    }
+    return values[index % RIFF_NAMED_METRICS_CHUNK_SIZE];
+  }
+
+  // Opens the perf_event groups of the calling thread.
+  void openPerfEvents();
+
+  // Adds the events counted since the last call to 'counters'. Only called
+  // by the support thread.
+  void addPerfEvents(PerformanceCounters& counters);
+
+  // Reads the CPU time, the time spent waiting in a run queue
+  // (nanoseconds) and the voluntary and involuntary context switches of the
+  // thread. Returns false if they are not available.
+  bool readScheduling(double values[4]) const;
+
+  // Reads the scheduling counters, so that the next call to
+  // addScheduling() computes them from now.
+  void initScheduling();
+
+  // Adds how the thread has been scheduled since the last call to
+  // 'statistics' (the fractions are summed). Returns false if not
+  // available. Only called by the support thread.
+  bool addScheduling(SchedulingStatistics& statistics);
+
+  // Adds the values of the named metrics to 'values', up to its size.
+  void addNamedValues(std::vector<double>& values) const;
+
+  // Returns the number of named metrics for which this thread allocated
+  // room (a multiple of RIFF_NAMED_METRICS_CHUNK_SIZE).
+  size_t getNumNamedValues() const;
+
+  // Reads the last published counters. Never blocks the owner thread.
+  inline void read(ThreadSnapshot& snapshot) const {
+    unsigned long s1, s2;
+    do {
+      s1 = seq.load(std::memory_order_acquire);
+      snapshot = published;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      s2 = seq.load(std::memory_order_relaxed);
+    } while ((s1 & 1) || s1 != s2);
+  }
 } ThreadData;
 
+// Per-thread cache of the data registered by the thread in the last
+// regions it used (see Region::getThreadData()). A region uses the entry
+// at index (region identifier % RIFF_THREAD_DATA_CACHE_SIZE).
+typedef struct ThreadDataCache {
+  unsigned long long regionId;
+  ThreadData* data;
+} ThreadDataCache;
+
+extern thread_local ThreadDataCache
+    threadDataCache[RIFF_THREAD_DATA_CACHE_SIZE];
+
 void* applicationSupportThread(void*);
 
-class Application {
-  friend void waitSampleStore(Application* application);
-  friend bool keepWaitingSample(Application* application, size_t threadId,
-                                size_t updatedSamples);
-  friend void* applicationSupportThread(void*);
+/**
+ * Compile-time choices of a BasicApplication. Each of them removes some
+ * work from the begin()/end() calls.
+ * @tparam AdaptiveSampling If true, the number of begin()/end() calls
+ *         skipped between two samples is adapted at runtime according to
+ *         ApplicationConfiguration::samplingLengthMs. If false, it is always
+ *         SamplingLength and samplingLengthMs is ignored.
+ * @tparam SamplingLength The initial sampling length (the fixed one if
+ *         AdaptiveSampling is false). 1 means that no calls are skipped.
+ * @tparam MultiThread If false, begin()/end() are called by one thread only
+ *         (identified by 0 or by no identifier at all), and threads are
+ *         never registered.
+ * @tparam CustomFields If false, storeCustomValue() cannot be used and
+ *         custom values are never published.
+ * @tparam Metrics The metric schema of the application (see Metric), whose
+ *         fields are accessed through metrics() and received by the monitor
+ *         through Monitor::getMetrics(). NoMetrics if the application has
+ *         no metrics.
+ */
+template <bool AdaptiveSampling = true,
+          ulong SamplingLength = RIFF_DEFAULT_SAMPLING_LENGTH,
+          bool MultiThread = true, bool CustomFields = true,
+          typename Metrics = NoMetrics>
+struct ApplicationPolicy {
+  static const bool adaptiveSampling = AdaptiveSampling;
+  static const ulong samplingLength = SamplingLength;
+  static const bool multiThread = MultiThread;
+  static const bool customFields = CustomFields;
+  static const bool hasMetrics = !std::is_same<Metrics, NoMetrics>::value;
+  typedef Metrics metrics;
+
+  static_assert(SamplingLength > 0, "SamplingLength must be at least 1.");
+};
 
- private:
-  ApplicationConfiguration _configuration;
-  nn::socket* _channel;
-  nn::socket& _channelRef;
-  int _chid;
-  bool _started;
-  Aggregator* _aggregator;
-  pthread_mutex_t _mutex;
-  pthread_t _supportTid;
-  bool _supportStop;
-  std::vector<ThreadData>* _threadData;
-  ulong _executionTime;
-  unsigned long long _totalTasks;
-  unsigned int _phaseId;
-  unsigned int _totalThreads;
-  bool _inconsistentSample;
+typedef ApplicationPolicy<> DefaultApplicationPolicy;
 
-  // We are sure it is called by at most one thread.
-  void notifyStart();
+class ApplicationBase;
 
-  ulong updateSamplingLength(unsigned long long numTasks,
-                             unsigned long long sampleTime);
+template <typename Policy>
+class BasicApplication;
 
-  // We do not use abs because they are both unsigned
+template <typename Policy>
+class BasicRegion;
+
+template <typename Policy>
+class BasicCounter;
+
+template <typename Policy>
+class BasicGauge;
+
+/**
+ * A handle to the data of a thread in a region. Obtaining a handle once
+ * per thread and calling begin()/end() on it avoids looking up the data of
+ * the thread at each call.
+ */
+template <typename Policy>
+class BasicThreadHandle {
+  friend class BasicRegion<Policy>;
+
+ private:
+  BasicApplication<Policy>* _application;
+  ThreadData* _data;
+
+  BasicThreadHandle(BasicApplication<Policy>* application, ThreadData* data)
+      : _application(application), _data(data) {
+    ;
+  }
+
+ public:
+  BasicThreadHandle() : _application(NULL), _data(NULL) { ; }
+
+  /**
+   * Same as Application::begin(), for the thread owning this handle.
+   */
+  inline void begin() { _application->begin(*_data); }
+
+  /**
+   * Same as Application::end(), for the thread owning this handle.
+   */
+  inline void end(unsigned int weight = 1) {
+    _application->end(*_data, weight);
+  }
+
+  /**
+   * Same as Application::next(), for the thread owning this handle.
+   */
+  inline void next(unsigned int weight = 1) {
+    _application->next(*_data, weight);
+  }
+
+  /**
+   * Same as Application::endBatch(), for the thread owning this handle.
+   */
+  inline void endBatch(unsigned int numTasks, unsigned long long elapsedNs) {
+    _application->endBatch(*_data, numTasks, elapsedNs);
+  }
+
+  /**
+   * Same as Application::storeCustomValue(), for the thread owning this
+   * handle.
+   */
+  void storeCustomValue(size_t index, double value) {
+    static_assert(Policy::customFields,
+                  "Custom fields are disabled by the application policy.");
+    if (index < RIFF_MAX_CUSTOM_FIELDS) {
+      _data->current.customFields[index] = value;
+    } else {
+      throw std::runtime_error(
+          "Custom value index out of bound. Please "
+          "increase RIFF_MAX_CUSTOM_FIELDS macro value.");
+    }
+  }
+
+  /**
+   * Same as Application::metrics(), for the thread owning this handle.
+   */
+  inline typename Policy::metrics& metrics() {
+    static_assert(Policy::hasMetrics,
+                  "The application policy has no metric schema.");
+    return *static_cast<typename Policy::metrics*>(_data->metrics);
+  }
+};
+
+/**
+ * The part of a region which does not depend on the application policy.
+ */
+class RegionBase {
+  friend class ApplicationBase;
+
+ protected:
+  ApplicationBase* _application;
+  std::string _name;
+  // Unique identifier of this object.
+  unsigned long long _id;
+  // One block per thread, allocated by the thread itself when it first
+  // uses this object. Threads identified by the user have a fixed slot in
+  // _threadData, the others register themselves in _registeredThreadData.
+  std::atomic<ThreadData*>* _threadData;
+  size_t _numThreads;
+  // Sampling length of the threads when they start.
+  ulong _samplingLength;
+  std::vector<ThreadData*> _registeredThreadData;
+  unsigned int _nextThreadId;
+  // Totals of the registered threads which terminated.
+  unsigned long long _exitedTasks;
+  unsigned long long _exitedFirstBegin;
+  unsigned long long _exitedLastEnd;
+  std::vector<double> _exitedNamedValues;
+  // The metrics of the threads merged by the support thread (doubles, to
+  // be suitably aligned for them). Empty if the application has no metrics.
+  std::vector<double> _metrics;
+  pthread_mutex_t _mutex;
+
+  RegionBase(ApplicationBase* application, const std::string& name,
+             size_t numThreads, ulong samplingLength);
+
+  // Opens the counters of a new thread and sets its sampling state.
+  void initThreadData(ThreadData* tData);
+
+  ThreadData* allocateThreadData(unsigned int threadId);
+
+  // Registers the calling thread, if not yet registered.
+  ThreadData* registerThread();
+
+  // Returns all the threads which called begin() at least once.
+  std::vector<ThreadData*> getStartedThreads();
+
+  // Removes a registered thread which terminated.
+  void removeExitedThread(ThreadData* tData);
+
+  // Removes all the registered threads which terminated, with the counters
+  // they published since the last sample.
+  void removeExitedThreads();
+
+  // Adds the values of the named metrics of the threads to 'values' (up
+  // to its size). The counters of the removed threads are included, the
+  // gauges are not. Removes the terminated threads which never called
+  // begin() (the others are removed by ApplicationBase::consolidate()).
+  void addNamedValues(const std::vector<NamedMetricInfo>& metrics,
+                      std::vector<double>& values);
+
+  // Adds the tasks computed by the threads of this region to totalTasks,
+  // and updates firstBegin and lastEnd with their first begin() and last
+  // end() calls.
+  void addTotals(unsigned long long& totalTasks,
+                 unsigned long long& firstBegin,
+                 unsigned long long& lastEnd);
+
+  // Throws if threadId is not in the range specified in the constructor.
+  inline void checkThreadId(unsigned int threadId) const {
+    if (threadId >= _numThreads) {
+      throw std::runtime_error(
+          "Wrong threadId specified (greater than number of threads).");
+    }
+  }
+
+  inline ThreadData& getThreadData(unsigned int threadId) {
+    checkThreadId(threadId);
+    ThreadData* tData = _threadData[threadId].load(std::memory_order_relaxed);
+    if (!tData) {
+      tData = allocateThreadData(threadId);
+    }
+    return *tData;
+  }
+
+  inline ThreadData& getRegisteredThreadData() {
+    const ThreadDataCache& cache =
+        threadDataCache[_id & (RIFF_THREAD_DATA_CACHE_SIZE - 1)];
+    if (cache.regionId == _id) {
+      return *cache.data;
+    }
+    return *registerThread();
+  }
+
+ public:
+  virtual ~RegionBase();
+
+  RegionBase(const RegionBase& r) = delete;
+  RegionBase& operator=(RegionBase const& x) = delete;
+
+  /**
+   * Returns the name of this region.
+   * @return The name of this region (empty for the default region of the
+   * application).
+   */
+  const std::string& getName() const;
+};
+
+/**
+ * An instrumented region of an application (see Application::region()).
+ * Each region keeps its own threads and is sampled independently from the
+ * others, while sharing the support thread and the channel of the
+ * application.
+ */
+template <typename Policy>
+class BasicRegion : public RegionBase {
+  friend class BasicApplication<Policy>;
+  friend class BasicCounter<Policy>;
+  friend class BasicGauge<Policy>;
+
+ private:
+  BasicRegion(BasicApplication<Policy>* application, const std::string& name,
+              size_t numThreads)
+      : RegionBase(application, name, numThreads, Policy::samplingLength) {
+    ;
+  }
+
+  inline BasicApplication<Policy>* getApplication() {
+    return static_cast<BasicApplication<Policy>*>(_application);
+  }
+
+  // Data of a thread calling begin()/end() without identifier.
+  inline ThreadData& getThreadData() {
+    if (Policy::multiThread) {
+      return getRegisteredThreadData();
+    } else {
+      return RegionBase::getThreadData(0);
+    }
+  }
+
+  using RegionBase::getThreadData;
+
+ public:
+  typedef BasicThreadHandle<Policy> ThreadHandle;
+
+  /**
+   * Same as Application::getThreadHandle(), for this region.
+   */
+  ThreadHandle getThreadHandle() {
+    return ThreadHandle(getApplication(), &getThreadData());
+  }
+
+  /**
+   * Same as Application::getThreadHandle(threadId), for this region.
+   */
+  ThreadHandle getThreadHandle(unsigned int threadId) {
+    return ThreadHandle(getApplication(), &getThreadData(threadId));
+  }
+
+  /**
+   * Same as Application::begin(), for this region.
+   */
+  inline void begin() { getApplication()->begin(getThreadData()); }
+
+  /**
+   * Same as Application::begin(threadId), for this region.
+   */
+  inline void begin(unsigned int threadId) {
+    getApplication()->begin(getThreadData(threadId));
+  }
+
+  /**
+   * Same as Application::storeCustomValue(), for this region.
+   */
+  void storeCustomValue(size_t index, double value) {
+    getThreadHandle().storeCustomValue(index, value);
+  }
+
+  /**
+   * Same as Application::storeCustomValue(), for this region.
+   */
+  void storeCustomValue(size_t index, double value, unsigned int threadId) {
+    getThreadHandle(threadId).storeCustomValue(index, value);
+  }
+
+  /**
+   * Same as Application::metrics(), for this region.
+   */
+  inline typename Policy::metrics& metrics() {
+    return getThreadHandle().metrics();
+  }
+
+  /**
+   * Same as Application::metrics(threadId), for this region.
+   */
+  inline typename Policy::metrics& metrics(unsigned int threadId) {
+    return getThreadHandle(threadId).metrics();
+  }
+
+  /**
+   * Same as Application::end(), for this region.
+   */
+  inline void end() { getApplication()->end(getThreadData(), 1); }
+
+  /**
+   * Same as Application::end(threadId, weight), for this region.
+   */
+  inline void end(unsigned int threadId, unsigned int weight = 1) {
+    getApplication()->end(getThreadData(threadId), weight);
+  }
+
+  /**
+   * Same as Application::next(), for this region.
+   */
+  inline void next() { getApplication()->next(getThreadData(), 1); }
+
+  /**
+   * Same as Application::next(threadId, weight), for this region.
+   */
+  inline void next(unsigned int threadId, unsigned int weight = 1) {
+    getApplication()->next(getThreadData(threadId), weight);
+  }
+
+  /**
+   * Same as Application::endBatch(numTasks, elapsedNs), for this region.
+   */
+  inline void endBatch(unsigned int numTasks, unsigned long long elapsedNs) {
+    getApplication()->endBatch(getThreadData(), numTasks, elapsedNs);
+  }
+
+  /**
+   * Same as Application::endBatch(threadId, numTasks, elapsedNs), for this
+   * region.
+   */
+  inline void endBatch(unsigned int threadId, unsigned int numTasks,
+                       unsigned long long elapsedNs) {
+    getApplication()->endBatch(getThreadData(threadId), numTasks, elapsedNs);
+  }
+};
+
+/**
+ * A counter registered at runtime (see Application::counter()). Each thread
+ * adds to its own value, and the monitor receives the sum of the values of
+ * all the threads.
+ */
+template <typename Policy>
+class BasicCounter {
+  friend class BasicApplication<Policy>;
+
+ private:
+  BasicRegion<Policy>* _region;
+  size_t _index;
+
+  BasicCounter(BasicRegion<Policy>* region, size_t index)
+      : _region(region), _index(index) {
+    ;
+  }
+
+  static inline void add(ThreadData& tData, size_t index, double value) {
+    // Single writer, so we do not need an atomic increment.
+    std::atomic<double>& v = tData.getNamedValue(index);
+    v.store(v.load(std::memory_order_relaxed) + value,
+            std::memory_order_relaxed);
+  }
+
+ public:
+  BasicCounter() : _region(NULL), _index(0) { ; }
+
+  /**
+   * Adds a value to this counter, for the calling thread (registering it if
+   * needed, see Application::begin()).
+   * @param value The value.
+   */
+  inline void add(double value = 1) {
+    add(_region->getThreadData(), _index, value);
+  }
+
+  /**
+   * Adds a value to this counter, for a thread with an identifier.
+   * @param value The value.
+   * @param threadId A number univocally identifying the calling thread, in
+   *        the range [0, n[, where n is the number of threads specified
+   *        in the constructor of the application.
+   */
+  inline void add(double value, unsigned int threadId) {
+    add(_region->getThreadData(threadId), _index, value);
+  }
+};
+
+/**
+ * A gauge registered at runtime (see Application::gauge()). Each thread
+ * sets its own value, and the monitor receives the sum of the last values
+ * set by the threads which did not terminate.
+ */
+template <typename Policy>
+class BasicGauge {
+  friend class BasicApplication<Policy>;
+
+ private:
+  BasicRegion<Policy>* _region;
+  size_t _index;
+
+  BasicGauge(BasicRegion<Policy>* region, size_t index)
+      : _region(region), _index(index) {
+    ;
+  }
+
+ public:
+  BasicGauge() : _region(NULL), _index(0) { ; }
+
+  /**
+   * Sets the value of this gauge, for the calling thread (registering it if
+   * needed, see Application::begin()).
+   * @param value The value.
+   */
+  inline void set(double value) {
+    _region->getThreadData().getNamedValue(_index).store(
+        value, std::memory_order_relaxed);
+  }
+
+  /**
+   * Sets the value of this gauge, for a thread with an identifier.
+   * @param value The value.
+   * @param threadId A number univocally identifying the calling thread, in
+   *        the range [0, n[, where n is the number of threads specified
+   *        in the constructor of the application.
+   */
+  inline void set(double value, unsigned int threadId) {
+    _region->getThreadData(threadId).getNamedValue(_index).store(
+        value, std::memory_order_relaxed);
+  }
+};
+
+/**
+ * The part of an application which does not depend on its policy: the
+ * support thread, the regions and the consolidation of the samples.
+ */
+class ApplicationBase {
+  friend void* applicationSupportThread(void*);
+  friend class RegionBase;
+
+ protected:
+  ApplicationConfiguration _configuration;
+  nn::socket* _channel;
+  nn::socket& _channelRef;
+  int _chid;
+  // True if the socket is an NN_RESPONDENT one (see SurveyMonitor).
+  bool _respondent;
+  bool _started;
+  Aggregator* _aggregator;
+  pthread_mutex_t _mutex;
+  // Signaled when the application starts or terminates (with _mutex).
+  pthread_cond_t _supportCond;
+  pthread_t _supportTid;
+  bool _supportStop;
+  size_t _numThreads;
+  // Region instrumented by the begin()/end() calls of this object.
+  RegionBase* _defaultRegion;
+  // Named regions, created by region().
+  std::map<std::string, RegionBase*> _regions;
+  ulong _executionTime;
+  unsigned long long _totalTasks;
+  // Read by the threads at each recorded begin() call.
+  std::atomic<unsigned int> _phaseId;
+  unsigned int _totalThreads;
+  bool _inconsistentSample;
+  // Incremented by the support thread each time a sample is consolidated.
+  std::atomic<unsigned long long> _epoch;
+  // Used to convert the durations given by the user to clock ticks.
+  double _ticksPerNs;
+  // Costs of a begin()/end() pair (clock ticks), measured by the
+  // constructor: the one paid by all the pairs, and the additional one paid
+  // by the recorded pairs.
+  double _skippedPairCost;
+  double _recordedPairCost;
+  // The metric schema of the policy (NULL if it has no metrics).
+  const MetricSchema* _metricSchema;
+  // Only accessed by the support thread, reused across the samples: the
+  // serialized metrics of all the regions, and the custom values of the
+  // threads of a region.
+  std::vector<double> _metricValues;
+  std::vector<double> _customValues[RIFF_MAX_CUSTOM_FIELDS];
+  // The named metrics, in registration order (protected by _mutex).
+  std::vector<NamedMetricInfo> _namedMetrics;
+  std::map<std::string, size_t> _namedMetricIndexes;
+  // Only accessed by the support thread: the named metrics already sent to
+  // the monitor with their last sent values, and the ones to send.
+  size_t _sentNamedMetrics;
+  std::vector<double> _sentNamedValues;
+  std::vector<NamedMetricInfo> _newNamedMetrics;
+  std::vector<NamedMetricInfo> _allNamedMetrics;
+  std::vector<double> _namedValues;
+  std::vector<NamedMetricUpdate> _namedMetricUpdates;
+  // Only accessed by the support thread: the last RIFF_MAX_PHASE_HISTORY
+  // phases (a ring, the oldest at _nextPhaseRecord when full), the ones
+  // updated since the previous sample, and their statistics.
+  std::vector<PhaseRecord> _phaseHistory;
+  size_t _nextPhaseRecord;
+  std::vector<unsigned int> _updatedPhases;
+  std::vector<PhaseStatistics> _updatedPhaseStatistics;
+  // The shared memory segment (NULL if not used, see
+  // ApplicationConfiguration::sharedMemory).
+  SharedSegment* _sharedSegment;
+  // Only accessed by the support thread: the samples of the named regions,
+  // the pushed samples not sent yet, the oldest first (see
+  // ApplicationConfiguration::pushIntervalMs), and the size of the last
+  // encoded sample (the expected size of the next one).
+  std::vector<RegionSample> _regionSamples;
+  std::deque<Message> _pushQueue;
+  size_t _sampleSize;
+  // Only accessed by the support thread: the last windows of the time series
+  // (a ring, see ApplicationConfiguration::timeSeriesIntervalMs), the number
+  // of windows cut and sent so far, when the time series and the current
+  // window started (clock ticks) and when the current window ends
+  // (CLOCK_MONOTONIC, nanoseconds).
+  std::vector<TimeSeriesWindow> _timeSeries;
+  unsigned long long _nextWindow;
+  unsigned long long _sentWindows;
+  unsigned long long _timeSeriesStart;
+  unsigned long long _windowStart;
+  unsigned long long _windowEnd;
+  // Written by terminate() to wake up the support thread (an eventfd), and
+  // when terminate() stops waiting for the monitor (CLOCK_MONOTONIC,
+  // nanoseconds, 0 if never).
+  int _stopFd;
+  unsigned long long _stopDeadline;
+
+  ApplicationBase(const std::string& channelName, size_t numThreads,
+                  Aggregator* aggregator);
+
+  ApplicationBase(nn::socket& socket, unsigned int chid, size_t numThreads,
+                  Aggregator* aggregator);
+
+  // Creates the default region and starts the support thread. Must be
+  // called at the end of the constructor of the most derived class.
+  void start();
+
+  // Sends the MESSAGE_TYPE_START message, unless no monitor is attached.
+  // Called once by checkStart(), and by the support thread for each
+  // MESSAGE_TYPE_INFO_REQ and MESSAGE_TYPE_ATTACH.
+  void notifyStart();
+
+  // Called periodically by the support thread when answering the requests
+  // of the monitor: if no monitor is connected, removes the registered
+  // threads which terminated (a monitor attaching later does not get what
+  // they computed before, see attachMonitor()). Otherwise, the next sample
+  // removes them.
+  void reapExitedThreads();
+
+  // Called by the support thread when a monitor attaches: the next sample
+  // covers the time since then, and has all the named metrics.
+  void attachMonitor();
+
+  // Sends the MESSAGE_TYPE_STOP message, with the totals computed by
+  // terminate(), waiting until the deadline (CLOCK_MONOTONIC, nanoseconds,
+  // 0 if never) for the socket to be writable. Returns false if it expired.
+  bool notifyStop(unsigned long long deadline);
+
+  // Calls notifyStart() if nobody did it yet.
+  void checkStart();
+
+  // Returns true if a message received from the monitor is sent to this
+  // application.
+  static bool isForThisApplication(const Message& msg);
+
+  // Consolidates the sample of a region. Threads which did not publish
+  // anything since the previous sample are waited until the deadline. If
+  // the application has metrics, the serialized metrics of the region are
+  // written to metricValues.
+  void consolidate(RegionBase& region, unsigned long long deadline,
+                   RegionSample& result, double* metricValues);
+
+  ulong updateSamplingLength(double numTasks,
+                             unsigned long long sampleTime);
+
+  // Returns the sampling length which keeps the overhead of a thread within
+  // ApplicationConfiguration::maxOverheadPercentage. Called at the end of
+  // each sampling period, before the thread starts a new window.
+  ulong controlSamplingLength(ThreadData& tData, unsigned long long now);
+
+  // Returns the region with the specified name, creating it with
+  // createRegion() if it does not exist.
+  RegionBase& getRegion(const std::string& name);
+
+  // Returns the index of the named metric with the specified name,
+  // registering it if it does not exist.
+  size_t getNamedMetric(const std::string& name, NamedMetricType type);
+
+  // Computes the named metrics to send to the monitor with the next sample
+  // (_newNamedMetrics and _namedMetricUpdates).
+  void collectNamedMetrics();
+
+  // Adds the counters of a thread since the snapshot 'last' to the
+  // statistics of its phases.
+  void addPhaseCounters(const ThreadSnapshot& snapshot,
+                        const ThreadSnapshot& last);
+
+  // Adds counters to the statistics of a phase.
+  void addPhaseCounters(unsigned int phaseId, double numTasks,
+                        double latency, double idleTime,
+                        unsigned long long start, unsigned long long end);
+
+  // Computes the statistics of the phases to send to the monitor with the
+  // next sample (_updatedPhaseStatistics).
+  void collectPhaseStatistics();
+
+  // Starts the time series (see ApplicationConfiguration::
+  // timeSeriesIntervalMs). Called by the support thread before the first
+  // sample.
+  void startTimeSeries();
+
+  // Ends the current window of the time series, with the counters of the
+  // threads of the default region (read after the previous window).
+  void cutWindow(const std::vector<ThreadData*>& threads,
+                 const std::vector<ThreadSnapshot>& snapshots);
+
+  // Ends the current window if its time elapsed. Returns when the next one
+  // ends (CLOCK_MONOTONIC, nanoseconds).
+  unsigned long long cutWindows();
+
+  // Consolidates a sample of all the regions.
+  void prepareSample(Message& msg);
+
+  // Executed by the support thread: sends a sample for each request of the
+  // monitor, or pushes them (see ApplicationConfiguration::pushIntervalMs),
+  // until the application terminates.
+  void replySamples();
+  void pushSamples();
+
+  // Drops the oldest pushed sample. What the monitor only receives once
+  // (the new named metrics and the updated phases) is sent again with the
+  // next sample.
+  void dropOldestSample();
+
+  virtual RegionBase* createRegion(const std::string& name,
+                                   size_t numThreads) = 0;
+
+  // We do not use abs because they are both unsigned
   // if we do abs(x - y) and x is smaller than y, the temporary
   // result (before applying abs) cannot be negative so it will wrap
   // and assume a huge value.
@@ -435,33 +2299,10 @@ class Application {
   }
 
  public:
-  /**
-   * Constructs this object.
-   * @param channelName The name of the channel.
-   * @param numThreads The number of threads which will concurrently use
-   *        this library.
-   * @param aggregator An aggregator object to aggregate custom values
-   *        stored by multiple threads.
-   */
-  Application(const std::string& channelName, size_t numThreads = 1,
-              Aggregator* aggregator = NULL);
+  virtual ~ApplicationBase();
 
-  /**
-   * Constructs this object.
-   * @param socket The nanomsg socket.
-   * @param chid The channel identifier.
-   * @param numThreads The number of threads which will concurrently use
-   *        this library.
-   * @param aggregator An aggregator object to aggregate custom values
-   *        stored by multiple threads.
-   */
-  Application(nn::socket& socket, unsigned int chid, size_t numThreads = 1,
-              Aggregator* aggregator = NULL);
-
-  ~Application();
-
-  Application(const Application& a) = delete;
-  Application& operator=(Application const& x) = delete;
+  ApplicationBase(const ApplicationBase& a) = delete;
+  ApplicationBase& operator=(ApplicationBase const& x) = delete;
 
   /**
    * Sets the application configuration.
@@ -471,48 +2312,235 @@ class Application {
   void setConfiguration(const ApplicationConfiguration& configuration);
 
   /**
-   * This function must be called at each loop iteration when the computation
-   * part of the loop begins.
-   * @param threadId Must be specified when is called by multiple threads
-   *        (e.g. inside a parallel loop). It must be a number univocally
-   *        identifying the thread calling this function and in
-   *        the range [0, n[, where n is the number of threads specified
-   *        in the constructor.
+   * Sets the number of threads contributing to this phase
+   * @param totalThreads The number of threads contributing to this phase.
+   * ATTENTION: This may be different from the number of threads you specified
+   * in the constructor. Indeed, you may have one thread calling the
+   * begin()/end() calls but more threads contributing to the computation.
+   * Consider for example this case:
+   *
+   * |---------------------------------------------|
+   * | for(uint i = 0; i < 100; i++){              |
+   * |     instr.begin();                          |
+   * |     #pragma omp parallel for num_threads(4) |
+   * |     for(uint j = 0; j < 100; j++){          |
+   * |         // ...compute...                    |
+   * |     }                                       |
+   * |     instr.end();                            |
+   * | }                                           |
+   * |---------------------------------------------|
+   *
+   * In this case, begin() and end() are called by one thread only (so you
+   * specify 1 in the constructor). However, the computation is executed
+   * by 4 threads, so you should specify 4 as second argument of the
+   * setPhaseId(...) call.
    */
-  inline void begin(unsigned int threadId = 0) {
-    ThreadData& tData = _threadData->at(threadId);
+  void setTotalThreads(unsigned int totalThreads);
 
-    // Equivalent to
-    // tData.currentSample = (tData.currentSample + 1) % tData.samplingLength;
-    // but faster.
-    tData.currentSample = (tData.currentSample + 1) >= tData.samplingLength
-                              ? 0
-                              : tData.currentSample + 1;
+  /**
+   * Notify the start of a new phase. Each thread starts the new phase at
+   * its next recorded begin() call (i.e. within one sampling period), and
+   * restarts its adaptive sampling from the initial sampling length, since
+   * the cost of the tasks may be very different in the new phase. The
+   * statistics of the last RIFF_MAX_PHASE_HISTORY phases are sent to the
+   * monitor (see Monitor::getPhaseStatistics()).
+   * @param phaseId A unique identifier for the phase.
+   * @param totalThreads The number of threads contributing to this phase
+   * (see setTotalThreads documentation).
+   */
+  void setPhaseId(unsigned int phaseId, unsigned int totalThreads = 0);
 
-    // Skip
-    if (tData.currentSample > 1) {
-      return;
+  /**
+   * This function must only be called once, when the parallel part
+   * of the application terminates. The termination is sent to the monitor
+   * without waiting for its next request, and the acknowledgement of the
+   * monitor is waited at most for
+   * ApplicationConfiguration::terminationTimeoutMs.
+   * NOTE: It is not thread safe!
+   */
+  void terminate();
+
+  /**
+   * Returns the execution time of the application (milliseconds).
+   * MUST be called after terminate().
+   * @return The execution time of the application (milliseconds).
+   * The time is from the first call of begin() to the last call of end().
+   */
+  ulong getExecutionTime();
+
+  /**
+   * Returns the total number of tasks computed by the application.
+   * MUST be called after terminate().
+   * @return The total number of tasks computed by the application.
+   * Is computed as the sum of tasks executed from the first call
+   * of begin() to the last call of end().
+   */
+  unsigned long long getTotalTasks();
+
+  /**
+   * Sets all the subsequent samples as inconsistent (i.e. latency and
+   * loadPercentage may be erroneous.
+   * For example, consider an application composed by two pipelined
+   * threads, i.e. a sender (S) and a receiver (R).
+   * If we instrument only the receiver R, we would have a correct
+   * throughput measurement but an inconsistency latency and loadPercentage
+   * measurement. Indeed, to correctly measure latency we would need
+   * to instrument both S and R, but this would require storing individual
+   * latencies for each message sent from S to R. This is not possible at
+   * the moment. So we provide the possibility to notify this situation
+   * by explicitly marking the latency and loadPercentage as inconsistent.
+   **/
+  void markInconsistentSamples();
+};
+
+/**
+ * An instrumented application. The decisions which do not change during
+ * the execution (see ApplicationPolicy) are taken at compile time, so that
+ * begin()/end() only do the work needed by the chosen policy. Application
+ * uses the DefaultApplicationPolicy.
+ */
+template <typename Policy>
+class BasicApplication : public ApplicationBase {
+  friend class BasicThreadHandle<Policy>;
+  friend class BasicRegion<Policy>;
+
+ private:
+  static inline size_t checkNumThreads(size_t numThreads) {
+    if (!Policy::multiThread && numThreads != 1) {
+      throw std::runtime_error(
+          "Only one thread can be used with a single thread policy.");
     }
+    return numThreads;
+  }
 
-    /********* Only executed once (at startup). - BEGIN *********/
-    if (!_started) {
-      pthread_mutex_lock(&_mutex);
-      // This awful double check is done to avoid locking the flag
-      // every time (this code is executed at most once).
-      if (!_started) {
-        notifyStart();
-        _started = true;
+  inline BasicRegion<Policy>& getDefaultRegion() {
+    return static_cast<BasicRegion<Policy>&>(*_defaultRegion);
+  }
+
+  RegionBase* createRegion(const std::string& name, size_t numThreads) {
+    return new BasicRegion<Policy>(this, name, numThreads);
+  }
+
+  // Returns the number of begin()/end() pairs represented by the recorded
+  // one in the current sampling period.
+  inline ulong getSamplingLength(const ThreadData& tData) const {
+    return Policy::adaptiveSampling ? tData.periodLength
+                                    : Policy::samplingLength;
+  }
+
+  // Returns the length of a new sampling period. When the sampling is
+  // random, it is 2 plus a geometrically distributed number of skipped
+  // pairs, so that its average is samplingLength and the recorded pair (the
+  // first one of the period) is never followed by a recorded begin().
+  inline ulong getNextPeriodLength(ThreadData& tData) {
+    if (!_configuration.randomSampling || tData.samplingLength <= 2) {
+      return tData.samplingLength;
+    }
+    // xorshift64*
+    unsigned long long& x = tData.randomState;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    // Uniform in ]0, 1].
+    double u = ((x * 2685821657736338717ULL >> 11) + 1) /
+               9007199254740992.0;
+    return 2 + (ulong)(std::log(u) /
+                       std::log(1.0 - 1.0 / (tData.samplingLength - 1)));
+  }
+
+  // Advances the sampling of a begin() call. Returns true if the call must
+  // be skipped.
+  inline bool skipBegin(ThreadData& tData) {
+    if (Policy::adaptiveSampling) {
+      if (++tData.currentSample >= tData.periodLength) {
+        tData.currentSample = 0;
+        tData.periodLength = getNextPeriodLength(tData);
+      }
+      return tData.currentSample > 1;
+    } else if (Policy::samplingLength > 1) {
+      // Equivalent to
+      // tData.currentSample = (tData.currentSample + 1) % samplingLength;
+      // but faster.
+      tData.currentSample = (tData.currentSample + 1) >= Policy::samplingLength
+                                ? 0
+                                : tData.currentSample + 1;
+      return tData.currentSample > 1;
+    }
+    return false;
+  }
+
+  // Publishes the counters of a thread, handing off its metrics first, so
+  // that the metrics of a sample are stored by the same tasks counted in it.
+  inline void publish(ThreadData& tData, unsigned long long now) {
+    if (Policy::hasMetrics) {
+      tData.handOffMetrics();
+    }
+    tData.publish<Policy::customFields>(now);
+  }
+
+  // Returns true if an end() call must be skipped.
+  inline bool skipEnd(const ThreadData& tData) const {
+    // We only store samples if tData.currentSample == 0
+    return (Policy::adaptiveSampling || Policy::samplingLength > 1) &&
+           tData.currentSample;
+  }
+
+  inline void begin(ThreadData& tData) {
+    if (!skipBegin(tData)) {
+      begin(tData, getCurrentTicks());
+    }
+  }
+
+  inline void end(ThreadData& tData, unsigned int weight) {
+    if (!skipEnd(tData)) {
+      end(tData, weight, getCurrentTicks());
+    }
+  }
+
+  inline void next(ThreadData& tData, unsigned int weight) {
+    // Must be checked before skipBegin() advances the sampling.
+    bool recordEnd = !skipEnd(tData);
+    bool recordBegin = !skipBegin(tData);
+    if (recordEnd || recordBegin) {
+      unsigned long long now = getCurrentTicks();
+      if (recordEnd) {
+        end(tData, weight, now);
+      }
+      if (recordBegin) {
+        begin(tData, now);
       }
-      pthread_mutex_unlock(&_mutex);
     }
-    unsigned long long now = getCurrentTimeNs();
+  }
+
+  inline void endBatch(ThreadData& tData, unsigned int numTasks,
+                       unsigned long long elapsedNs) {
+    if (!numTasks || skipBegin(tData)) {
+      return;
+    }
+    unsigned long long now = getCurrentTicks();
+    unsigned long long elapsed = elapsedNs * _ticksPerNs;
+    // The batch cannot start before the end of the previous one.
+    begin(tData, now - std::min(elapsed, now - tData.rcvStart));
+    if (!skipEnd(tData)) {
+      end(tData, numTasks, now, true);
+    }
+  }
+
+  // A begin() call which has not been skipped, at time 'now'.
+  inline void begin(ThreadData& tData, unsigned long long now) {
+    ulong samplingLength = getSamplingLength(tData);
+    /********* Only executed once (at startup). - BEGIN *********/
     if (!tData.firstBegin) {
+      checkStart();
       tData.firstBegin = now;
-    }
-    if (!tData.sampleStartTime) {
-      tData.sampleStartTime = now;
+      tData.windowStart = now;
+      tData.current.startTime = now;
+      tData.current.phaseId = _phaseId.load(std::memory_order_relaxed);
+      tData.current.phaseStartTime = now;
+      publish(tData, now);
     }
     /********* Only executed once (at startup). - END *********/
+    tData.lastActivity.store(now, std::memory_order_relaxed);
 
     if (tData.computeStart) {
       // To collect a sample, we need to execute begin two
@@ -531,76 +2559,329 @@ class Application {
       // The only exception is for samplingLength == 1, since
       // in this case currentSample is always 0 and we execute
       // both sections.
-      if (tData.currentSample == 1 || tData.samplingLength == 1) {
-        tData.idleTime += ((now - tData.rcvStart) * tData.samplingLength);
-        unsigned long long sampleTime = now - tData.sampleStartTime;
-        unsigned long long sampleTimeEstimated =
-            (tData.sample.latency + tData.idleTime);
-        ulong oldSamplingLength = tData.samplingLength,
-              newSamplingLength = tData.samplingLength;
-
-        tData.sample.throughput =
-            tData.sample.numTasks /
-            (sampleTime / 1000000000.0);  // From tasks/ns to tasks/sec
-        tData.sample.loadPercentage =
-            (tData.sample.latency / sampleTime) * 100.0;
-
-        if (_configuration.samplingLengthMs) {
-          newSamplingLength =
-              updateSamplingLength(tData.sample.numTasks, sampleTime);
-          /*
-          We commented this since it could impair too much the reactiveness of
-          the adaptive sampling.
-          if(newSamplingLength > 10*oldSamplingLength){
-              // To avoid setting too quickly a too long sampling length.
-              newSamplingLength = 10*oldSamplingLength;
-          }
-          */
+      if (tData.currentSample == 1 || samplingLength == 1) {
+        tData.current.idleTime += ((now - tData.rcvStart) * samplingLength);
+        ++tData.current.recordedPairs;
+        if (Policy::adaptiveSampling) {
+          updateSampling(tData, now);
+        } else {
+          checkPhase(tData, now);
+          publish(tData, now);
         }
+      }
+    }
+    tData.computeStart = now;
+  }
 
-        if (*tData.consolidate) {
-          tData.consolidatedSample = tData.sample;
-          // Consistency check
-          // If the gap between real total time and the one estimated with
-          // latency and idle time is greater than a threshold, idleTime and
-          // latency are not reliable.
-          if (((absDiff(sampleTime, sampleTimeEstimated) / (double)sampleTime) *
-               100.0) > _configuration.consistencyThreshold) {
-            if (!_configuration.samplingLengthMs) {
-#if defined RIFF_DEFAULT_SAMPLING_LENGTH && RIFF_DEFAULT_SAMPLING_LENGTH == 1
-              // If not adaptive sampling and if sampling length == 1
-              throw std::runtime_error(
-                  "FATAL ERROR: it is not possible to have inconsistency if "
-                  "sampling is not applied.");
-#endif
-            }
-            tData.consolidatedSample.inconsistent = true;
-          }
-          tData.sample = ApplicationSample();
-          tData.idleTime = 0;
-          tData.sampleStartTime = now;
-          *(tData.consolidate) = false;
-        }
+  // Starts a new phase on the thread if setPhaseId() has been called since
+  // it last checked. The counters published so far belong to the previous
+  // phase. Returns true if the phase changed.
+  inline bool checkPhase(ThreadData& tData, unsigned long long now) {
+    unsigned int phaseId = _phaseId.load(std::memory_order_relaxed);
+    if (phaseId == tData.current.phaseId) {
+      return false;
+    }
+    ThreadSnapshot& current = tData.current;
+    current.phaseId = phaseId;
+    current.phaseStartTime = now;
+    current.phaseStartLatency = current.latency;
+    current.phaseStartIdleTime = current.idleTime;
+    current.phaseStartTasks = current.numTasks;
+    return true;
+  }
+
+  inline void updateSampling(ThreadData& tData, unsigned long long now) {
+    ulong oldSamplingLength = tData.samplingLength,
+          newSamplingLength = tData.samplingLength;
+
+    if (checkPhase(tData, now)) {
+      // What we learnt about the tasks of the previous phase does not hold
+      // anymore.
+      newSamplingLength = Policy::samplingLength;
+      tData.windowStart = now;
+      tData.windowTasks = 0;
+      tData.periodStart = now;
+      tData.periodTasks = tData.current.numTasks;
+      tData.taskInterval = 0;
+    } else if (_configuration.maxOverheadPercentage) {
+      newSamplingLength = controlSamplingLength(tData, now);
+    } else if (_configuration.samplingLengthMs) {
+      newSamplingLength = updateSamplingLength(tData.windowTasks,
+                                               now - tData.windowStart);
+      /*
+      We commented this since it could impair too much the reactiveness of
+      the adaptive sampling.
+      if(newSamplingLength > 10*oldSamplingLength){
+          // To avoid setting too quickly a too long sampling length.
+          newSamplingLength = 10*oldSamplingLength;
+      }
+      */
+    }
+
+    publish(tData, now);
+
+    // If the support thread consolidated a sample since the last
+    // time we checked, we start a new window.
+    unsigned long long epoch = _epoch.load(std::memory_order_relaxed);
+    if (epoch != tData.epoch) {
+      tData.epoch = epoch;
+      tData.windowStart = now;
+      tData.windowTasks = 0;
+    }
+
+    tData.samplingLength = newSamplingLength;
+
+    // We need to manage the corner case where sample was one and
+    // now is greater than one. In this case currentSample is 0
+    // and end() would be executed on the new sample length.
+    // We need than to force currentSample to 1 to let the
+    // counting work.
+    if (oldSamplingLength == 1 && tData.samplingLength > 1) {
+      tData.currentSample = 1;
+      tData.periodLength = getNextPeriodLength(tData);
+    }
+    // If I reduce the samplingLength to 1, the only
+    // possible value for currentSample would be 0,
+    // so we set it to 0.
+    if (oldSamplingLength > 1 && tData.samplingLength == 1) {
+      tData.currentSample = 0;
+      tData.periodLength = 1;
+    }
+  }
+
+  // An end() call which has not been skipped, at time 'now'. If 'batch' is
+  // true, the 'weight' tasks have been computed one after the other since
+  // the begin() call, and thus share its time.
+  inline void end(ThreadData& tData, unsigned int weight,
+                  unsigned long long now, bool batch = false) {
+    ulong samplingLength = getSamplingLength(tData);
+    tData.lastActivity.store(now, std::memory_order_relaxed);
+    tData.rcvStart = now;
+
+    // If we perform sampling, we assume that all the other samples
+    // different from the one recorded had the same latency.
+    unsigned long long newLatency = tData.rcvStart - tData.computeStart;
+    if (batch) {
+      newLatency /= weight;
+    }
+    tData.current.latency += ((double)newLatency * samplingLength * weight);
+    tData.current.numTasks += samplingLength * weight;
+    // Single writer, so we do not need an atomic increment.
+    std::atomic<unsigned long long>& bucket =
+        tData.latencyHistogram[getLatencyBucket(newLatency)];
+    bucket.store(bucket.load(std::memory_order_relaxed) +
+                     samplingLength * weight,
+                 std::memory_order_relaxed);
+    if (Policy::adaptiveSampling) {
+      // The sampling length is a number of calls, and a batch is one call.
+      tData.windowTasks += samplingLength * (batch ? 1 : weight);
+    }
+    tData.totalTasks += samplingLength * weight;
+    tData.lastEnd = now;
+  }
+
+  // Calls begin()/end() on the data of a thread, as the loop of the
+  // application would. Returns the time taken (clock ticks) and adds the
+  // number of recorded pairs to 'recordedPairs'.
+  unsigned long long timePairs(ThreadData& tData, size_t iterations,
+                               unsigned long long& recordedPairs) {
+    unsigned long long recorded = tData.current.recordedPairs;
+    unsigned long long start = getCurrentTicks();
+    for (size_t i = 0; i < iterations; i++) {
+      begin(tData);
+      // The code of the application runs in between, so the data of the
+      // thread is in memory and the calls cannot be merged.
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      end(tData, 1);
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+    unsigned long long elapsed = getCurrentTicks() - start;
+    recordedPairs += tData.current.recordedPairs - recorded;
+    return elapsed;
+  }
+
+  // Measures _skippedPairCost and _recordedPairCost on the data of a thread
+  // which does not belong to any region, first skipping all the pairs and
+  // then recording all of them.
+  void measurePairCosts() {
+    const size_t iterations = 10000;
+    ThreadData* tData = ThreadData::allocate(0, 1, _metricSchema);
+    // Not to start the application.
+    tData->firstBegin = 1;
+    tData->samplingLength = std::numeric_limits<ulong>::max();
+    tData->periodLength = tData->samplingLength;
+    unsigned long long skippedRecorded = 0, recorded = 0;
+    double skippedTime = timePairs(*tData, iterations, skippedRecorded);
+    if (!Policy::adaptiveSampling) {
+      // The sampling length is fixed, so the cost of the recorded pairs is
+      // spread over all of them.
+      _skippedPairCost = skippedTime / iterations;
+      tData->release();
+      return;
+    }
+    tData->samplingLength = 1;
+    tData->periodLength = 1;
+    tData->currentSample = 0;
+    tData->computeStart = 0;
+    double recordedTime = timePairs(*tData, iterations, recorded);
+    tData->release();
+    if (recorded > skippedRecorded) {
+      _recordedPairCost = std::max(recordedTime - skippedTime, 0.0) /
+                          (recorded - skippedRecorded);
+    }
+    _skippedPairCost =
+        std::max(skippedTime - skippedRecorded * _recordedPairCost, 0.0) /
+        iterations;
+  }
+
+ public:
+  typedef BasicThreadHandle<Policy> ThreadHandle;
+  typedef BasicRegion<Policy> Region;
+  typedef BasicCounter<Policy> Counter;
+  typedef BasicGauge<Policy> Gauge;
+
+  /**
+   * Constructs this object.
+   * @param channelName The name of the channel.
+   * @param numThreads The number of threads which will concurrently use
+   *        this library by specifying their identifier (threads calling
+   *        begin() without identifier are not included). Must be 1 if
+   *        the policy is not multi thread.
+   * @param aggregator An aggregator object to aggregate custom values
+   *        stored by multiple threads.
+   */
+  BasicApplication(const std::string& channelName, size_t numThreads = 1,
+                   Aggregator* aggregator = NULL)
+      : ApplicationBase(channelName, checkNumThreads(numThreads),
+                        aggregator) {
+    _metricSchema = getMetricSchema<typename Policy::metrics>();
+    measurePairCosts();
+    start();
+  }
+
+  /**
+   * Constructs this object.
+   * @param socket The nanomsg socket.
+   * @param chid The channel identifier.
+   * @param numThreads The number of threads which will concurrently use
+   *        this library by specifying their identifier (threads calling
+   *        begin() without identifier are not included). Must be 1 if
+   *        the policy is not multi thread.
+   * @param aggregator An aggregator object to aggregate custom values
+   *        stored by multiple threads.
+   */
+  BasicApplication(nn::socket& socket, unsigned int chid,
+                   size_t numThreads = 1, Aggregator* aggregator = NULL)
+      : ApplicationBase(socket, chid, checkNumThreads(numThreads),
+                        aggregator) {
+    _metricSchema = getMetricSchema<typename Policy::metrics>();
+    measurePairCosts();
+    start();
+  }
+
+  /**
+   * Returns a named region of this application, creating it if it does
+   * not exist. Each region is instrumented with its own begin()/end()
+   * calls (e.g. app.region("ingest").begin()) and is sampled independently
+   * from the others. The samples of all the regions are sent to the
+   * monitor together with the one of the application (see
+   * Monitor::getRegionSamples()). Calls on this object are equivalent to
+   * calls on an unnamed region.
+   * Since looking up a region by name is not cheap, the returned reference
+   * should be stored and reused. It is valid until this object is
+   * destroyed.
+   * @param name The name of the region (not empty and at most
+   *        RIFF_MAX_REGION_NAME_LENGTH characters).
+   * @return The region. As for this object, threads can use it with or
+   *         without an identifier, in the range [0, n[, where n is the
+   *         number of threads specified in the constructor.
+   */
+  Region& region(const std::string& name) {
+    return static_cast<Region&>(getRegion(name));
+  }
+
+  /**
+   * Returns a named counter, registering it if it does not exist. Unlike
+   * storeCustomValue(), counters can be registered at any time (e.g. by
+   * plugins loaded after this object has been created). Registering is not
+   * cheap, while adding to a counter only updates a value of the calling
+   * thread. The name is sent to the monitor once, and then only the values
+   * which changed (see Monitor::getNamedMetrics()).
+   * @param name The name of the counter (not empty and at most
+   *        RIFF_MAX_NAMED_METRIC_NAME_LENGTH characters). Must not be the
+   *        name of a gauge.
+   * @return The counter. Valid until this object is destroyed.
+   */
+  Counter counter(const std::string& name) {
+    return Counter(&getDefaultRegion(),
+                   getNamedMetric(name, NAMED_METRIC_COUNTER));
+  }
+
+  /**
+   * Returns a named gauge, registering it if it does not exist (see
+   * counter()).
+   * @param name The name of the gauge (not empty and at most
+   *        RIFF_MAX_NAMED_METRIC_NAME_LENGTH characters). Must not be the
+   *        name of a counter.
+   * @return The gauge. Valid until this object is destroyed.
+   */
+  Gauge gauge(const std::string& name) {
+    return Gauge(&getDefaultRegion(),
+                 getNamedMetric(name, NAMED_METRIC_GAUGE));
+  }
+
+  /**
+   * Returns the handle of the calling thread, registering it if needed
+   * (see begin()).
+   * @return The handle of the calling thread.
+   */
+  ThreadHandle getThreadHandle() {
+    return getDefaultRegion().getThreadHandle();
+  }
+
+  /**
+   * Returns the handle of a thread. MUST be called by the thread
+   * identified by threadId.
+   * @param threadId A number univocally identifying the calling thread, in
+   *        the range [0, n[, where n is the number of threads specified
+   *        in the constructor.
+   * @return The handle of the thread.
+   */
+  ThreadHandle getThreadHandle(unsigned int threadId) {
+    return getDefaultRegion().getThreadHandle(threadId);
+  }
+
+  /**
+   * This function must be called at each loop iteration when the computation
+   * part of the loop begins.
+   * The first time it is called by a thread, the thread is registered.
+   * When a registered thread terminates, it is removed from the threads
+   * contributing to the samples. This can be used by any number of threads,
+   * created and destroyed at any time (e.g. by an elastic thread pool).
+   * If the policy is not multi thread, this is the same as begin(0).
+   */
+  inline void begin() { getDefaultRegion().begin(); }
 
-        tData.samplingLength = newSamplingLength;
+  /**
+   * This function must be called at each loop iteration when the computation
+   * part of the loop begins.
+   * @param threadId A number univocally identifying the thread calling this
+   *        function and in the range [0, n[, where n is the number of threads
+   *        specified in the constructor.
+   */
+  inline void begin(unsigned int threadId) {
+    getDefaultRegion().begin(threadId);
+  }
 
-        // We need to manage the corner case where sample was one and
-        // now is greater than one. In this case currentSample is 0
-        // and end() would be executed on the new sample length.
-        // We need than to force currentSample to 1 to let the
-        // counting work.
-        if (oldSamplingLength == 1 && tData.samplingLength > 1) {
-          tData.currentSample = 1;
-        }
-        // If I reduce the samplingLength to 1, the only
-        // possible value for currentSample would be 0,
-        // so we set it to 0.
-        if (oldSamplingLength > 1 && tData.samplingLength == 1) {
-          tData.currentSample = 0;
-        }
-      }
-    }
-    tData.computeStart = now;
+  /**
+   * This function stores a custom value in the sample of the calling
+   * thread, registering it if needed (see begin()). It should be called
+   * after 'end()'.
+   * @param index The index of the value [0, RIFF_MAX_CUSTOM_FIELDS[
+   * @param value The value.
+   */
+  void storeCustomValue(size_t index, double value) {
+    getDefaultRegion().storeCustomValue(index, value);
   }
 
   /**
@@ -608,116 +2889,120 @@ class Application {
    * after 'end()'.
    * @param index The index of the value [0, RIFF_MAX_CUSTOM_FIELDS[
    * @param value The value.
-   * @param threadId Must be specified when is called by multiple threads
-   *        (e.g. inside a parallel loop). It must be a number univocally
-   *        identifying the thread calling this function and in
-   *        the range [0, n[, where n is the number of threads specified
-   *        in the constructor.
+   * @param threadId A number univocally identifying the thread calling this
+   *        function and in the range [0, n[, where n is the number of threads
+   *        specified in the constructor.
    */
-  void storeCustomValue(size_t index, double value, unsigned int threadId = 0);
+  void storeCustomValue(size_t index, double value, unsigned int threadId) {
+    getDefaultRegion().storeCustomValue(index, value, threadId);
+  }
 
   /**
-   * This function must be called at each loop iteration when the computation
-   * part of the loop ends.
-   * @param threadId Must be specified when is called by multiple threads
-   *        (e.g. inside a parallel loop). It must be a number univocally
-   *        identifying the thread calling this function and in
+   * Returns the metrics of the calling thread, registering it if needed
+   * (see begin()). The values stored in its fields (e.g.
+   * app.metrics().bytes.store(n)) are reduced by the thread itself, and
+   * merged with the ones of the other threads in each sample, which
+   * contains all the values stored since the previous one.
+   * @return The metrics of the calling thread.
+   */
+  inline typename Policy::metrics& metrics() {
+    return getDefaultRegion().metrics();
+  }
+
+  /**
+   * Same as metrics(), for a thread with an identifier.
+   * @param threadId A number univocally identifying the calling thread, in
    *        the range [0, n[, where n is the number of threads specified
    *        in the constructor.
+   * @return The metrics of the thread.
    */
-  inline void end(unsigned int threadId = 0, unsigned int weight = 1) {
-    ThreadData& tData = _threadData->at(threadId);
-    // Skip
-    if (tData.currentSample) {
-      return;
-    }
-    // We only store samples if tData.currentSample == 0
-    unsigned long long now = getCurrentTimeNs();
-    tData.rcvStart = now;
-
-    // If we perform sampling, we assume that all the other samples
-    // different from the one recorded had the same latency.
-    double newLatency = (tData.rcvStart - tData.computeStart);
-    tData.sample.latency += (newLatency * tData.samplingLength * weight);
-    tData.sample.numTasks += tData.samplingLength * weight;
-    tData.totalTasks += tData.samplingLength * weight;
-    tData.lastEnd = now;
+  inline typename Policy::metrics& metrics(unsigned int threadId) {
+    return getDefaultRegion().metrics(threadId);
   }
 
   /**
-   * Sets the number of threads contributing to this phase
-   * @param totalThreads The number of threads contributing to this phase.
-   * ATTENTION: This may be different from the number of threads you specified
-   * in the constructor. Indeed, you may have one thread calling the
-   * begin()/end() calls but more threads contributing to the computation.
-   * Consider for example this case:
-   *
-   * |---------------------------------------------|
-   * | for(uint i = 0; i < 100; i++){              |
-   * |     instr.begin();                          |
-   * |     #pragma omp parallel for num_threads(4) |
-   * |     for(uint j = 0; j < 100; j++){          |
-   * |         // ...compute...                    |
-   * |     }                                       |
-   * |     instr.end();                            |
-   * | }                                           |
-   * |---------------------------------------------|
-   *
-   * In this case, begin() and end() are called by one thread only (so you
-   * specify 1 in the constructor). However, the computation is executed
-   * by 4 threads, so you should specify 4 as second argument of the
-   * setPhaseId(...) call.
+   * This function must be called at each loop iteration when the computation
+   * part of the loop ends, by threads calling begin() without identifier.
    */
-  void setTotalThreads(unsigned int totalThreads);
+  inline void end() { getDefaultRegion().end(); }
 
   /**
-   * Notify the start of a new phase.
-   * @param phaseId A unique identifier for the phase.
-   * @param totalThreads The number of threads contributing to this phase
-   * (see setTotalThreads documentation).
+   * This function must be called at each loop iteration when the computation
+   * part of the loop ends.
+   * @param threadId A number univocally identifying the thread calling this
+   *        function and in the range [0, n[, where n is the number of threads
+   *        specified in the constructor.
+   * @param weight The number of tasks computed since the corresponding
+   *        begin() call.
    */
-  void setPhaseId(unsigned int phaseId, unsigned int totalThreads = 0);
+  inline void end(unsigned int threadId, unsigned int weight = 1) {
+    getDefaultRegion().end(threadId, weight);
+  }
 
   /**
-   * This function must only be called once, when the parallel part
-   * of the application terminates.
-   * NOTE: It is not thread safe!
+   * Same as calling end() and then begin(), but reads the clock only once.
+   * Can be used between two iterations of a loop, when nothing happens
+   * between the end of an iteration and the beginning of the next one
+   * (i.e. begin() must be called before the first iteration, and end()
+   * after the last one).
    */
-  void terminate();
+  inline void next() { getDefaultRegion().next(); }
 
   /**
-   * Returns the execution time of the application (milliseconds).
-   * MUST be called after terminate().
-   * @return The execution time of the application (milliseconds).
-   * The time is from the first call of begin() to the last call of end().
+   * Same as calling end(threadId, weight) and then begin(threadId), but
+   * reads the clock only once (see next()).
+   * @param threadId A number univocally identifying the thread calling this
+   *        function and in the range [0, n[, where n is the number of threads
+   *        specified in the constructor.
+   * @param weight The number of tasks computed since the corresponding
+   *        begin() call.
    */
-  ulong getExecutionTime();
+  inline void next(unsigned int threadId, unsigned int weight = 1) {
+    getDefaultRegion().next(threadId, weight);
+  }
 
   /**
-   * Returns the total number of tasks computed by the application.
-   * MUST be called after terminate().
-   * @return The total number of tasks computed by the application.
-   * Is computed as the sum of tasks executed from the first call
-   * of begin() to the last call of end().
+   * Records a batch of tasks which has just been computed one after the
+   * other and timed by the caller, by threads calling begin() without
+   * identifier. The time elapsed since the end of the previous batch (or
+   * end() call) is accounted as idle time, and each task of the batch is
+   * accounted with a latency of elapsedNs / numTasks. Reads the clock only
+   * once. Must not be called between begin() and end().
+   * @param numTasks The number of tasks in the batch.
+   * @param elapsedNs The time spent computing the batch (nanoseconds).
    */
-  unsigned long long getTotalTasks();
+  inline void endBatch(unsigned int numTasks, unsigned long long elapsedNs) {
+    getDefaultRegion().endBatch(numTasks, elapsedNs);
+  }
 
   /**
-   * Sets all the subsequent samples as inconsistent (i.e. latency and
-   * loadPercentage may be erroneous.
-   * For example, consider an application composed by two pipelined
-   * threads, i.e. a sender (S) and a receiver (R).
-   * If we instrument only the receiver R, we would have a correct
-   * throughput measurement but an inconsistency latency and loadPercentage
-   * measurement. Indeed, to correctly measure latency we would need
-   * to instrument both S and R, but this would require storing individual
-   * latencies for each message sent from S to R. This is not possible at
-   * the moment. So we provide the possibility to notify this situation
-   * by explicitly marking the latency and loadPercentage as inconsistent.
-   **/
-  void markInconsistentSamples();
+   * Same as endBatch(numTasks, elapsedNs), for a thread with an identifier.
+   * @param threadId A number univocally identifying the thread calling this
+   *        function and in the range [0, n[, where n is the number of threads
+   *        specified in the constructor.
+   * @param numTasks The number of tasks in the batch.
+   * @param elapsedNs The time spent computing the batch (nanoseconds).
+   */
+  inline void endBatch(unsigned int threadId, unsigned int numTasks,
+                       unsigned long long elapsedNs) {
+    getDefaultRegion().endBatch(threadId, numTasks, elapsedNs);
+  }
 };
 
+typedef BasicApplication<DefaultApplicationPolicy> Application;
+typedef BasicRegion<DefaultApplicationPolicy> Region;
+typedef BasicThreadHandle<DefaultApplicationPolicy> ThreadHandle;
+
+// Result of Monitor::tryGetSample() and Monitor::tryNextSample().
+typedef enum SampleStatus {
+  // A sample has been received.
+  SAMPLE_STATUS_RECEIVED = 0,
+  // The application terminated: there are no more samples.
+  SAMPLE_STATUS_TERMINATED,
+  // Nothing has been received before the timeout.
+  SAMPLE_STATUS_TIMEOUT
+} SampleStatus;
+
 class Monitor {
  private:
   nn::socket* _channel;
@@ -727,6 +3012,47 @@ class Monitor {
   unsigned long long _totalTasks;
   unsigned int _lastPhaseId;
   unsigned int _lastTotalThreads;
+  unsigned int _lastContributingThreads;
+  unsigned int _lastActiveThreads;
+  std::vector<StalledThread> _lastStalledThreads;
+  LatencyPercentiles _lastLatencyPercentiles;
+  SamplingStatistics _lastSamplingStatistics;
+  PerformanceCounters _lastPerformanceCounters;
+  SchedulingStatistics _lastSchedulingStatistics;
+  std::vector<RegionSample> _lastRegions;
+  unsigned int _lastNumMetricFields;
+  std::vector<double> _lastMetrics;
+  std::vector<NamedMetric> _namedMetrics;
+  // Last received values of the named metrics (for counters, the total).
+  std::vector<double> _namedMetricTotals;
+  // The last RIFF_MAX_PHASE_HISTORY phases received (a ring, the oldest at
+  // _nextPhase when full).
+  std::vector<PhaseStatistics> _phases;
+  size_t _nextPhase;
+  unsigned long long _droppedSamples;
+  std::vector<TimeSeriesWindow> _lastWindows;
+  unsigned long long _overwrittenWindows;
+  // True if a sample has been requested and not received yet (see
+  // tryGetSample()).
+  bool _requestPending;
+  // True if the last message received is the termination of the
+  // application (which may still be receiving the acknowledgement).
+  bool _stopAcked;
+
+  // Returns the serialized metrics of the application (index 0) or of a
+  // region (index 1 + the index of the region), checking that they have been
+  // serialized with a schema with the same number of fields.
+  const double* getMetricValues(size_t index,
+                                const MetricSchema* schema) const;
+
+  // Acknowledges the termination of an application.
+  void acknowledgeStop(const Message& stop);
+
+  // Receives the next sample (or the termination) sent by the application,
+  // waiting for it until the deadline (CLOCK_MONOTONIC, nanoseconds, 0 if
+  // never).
+  SampleStatus receiveSample(ApplicationSample& sample,
+                             unsigned long long deadline);
 
  public:
   /**
@@ -752,7 +3078,10 @@ class Monitor {
   Monitor& operator=(Monitor const& x) = delete;
 
   /**
-   * Waits for an application to start.
+   * Attaches to an application, waiting for it to start if needed. The
+   * first sample then covers the time since the monitor attached. The
+   * application does not need a monitor to run: it can be attached and
+   * detached (i.e. destroyed) at any time.
    * @return The pid (process identifier) of the monitored application.
    **/
   pid_t waitStart();
@@ -766,6 +3095,88 @@ class Monitor {
    **/
   bool getSample(ApplicationSample& sample);
 
+  /**
+   * Returns the next sample pushed by the application (see
+   * ApplicationConfiguration::pushIntervalMs), waiting for it if needed.
+   * The samples are returned in order, the ones dropped by the application
+   * excluded (see getDroppedSamples()).
+   * @param sample The returned sample.
+   * @return True if the sample has been succesfully stored,
+   * False if the application terminated and thus there are
+   * no samples to be stored.
+   **/
+  bool nextSample(ApplicationSample& sample);
+
+  /**
+   * Like getSample(), but waits at most timeoutMs milliseconds. If the
+   * sample is not received in time, it is returned by the next call instead
+   * of requesting a new one.
+   * @param sample The returned sample.
+   * @param timeoutMs The maximum waiting time (milliseconds). If 0, it
+   * never waits, if negative it waits forever.
+   * @return SAMPLE_STATUS_RECEIVED if the sample has been stored,
+   * SAMPLE_STATUS_TERMINATED if the application terminated, or
+   * SAMPLE_STATUS_TIMEOUT.
+   **/
+  SampleStatus tryGetSample(ApplicationSample& sample, double timeoutMs);
+
+  /**
+   * Like nextSample(), but waits at most timeoutMs milliseconds.
+   * @param sample The returned sample.
+   * @param timeoutMs The maximum waiting time (milliseconds). If 0, it
+   * never waits, if negative it waits forever.
+   * @return SAMPLE_STATUS_RECEIVED if the sample has been stored,
+   * SAMPLE_STATUS_TERMINATED if the application terminated, or
+   * SAMPLE_STATUS_TIMEOUT.
+   **/
+  SampleStatus tryNextSample(ApplicationSample& sample, double timeoutMs);
+
+  /**
+   * Like getSample(), but in another thread. The monitor must not be used
+   * until the returned future is ready.
+   * @param sample The returned sample. Must be valid until the returned
+   * future is ready.
+   * @return The result of getSample().
+   **/
+  std::future<bool> getSampleAsync(ApplicationSample& sample);
+
+  /**
+   * Returns a file descriptor which is readable (e.g. with poll()) when the
+   * application sent something: the sample requested by a tryGetSample()
+   * call which timed out, a pushed sample, or the termination.
+   * tryGetSample()/tryNextSample() then return without waiting. It must
+   * not be read or written.
+   * @return The file descriptor.
+   **/
+  int getFd() const;
+
+  /**
+   * Gets the number of pushed samples dropped by the application so far,
+   * because the monitor did not get them in time (see
+   * ApplicationConfiguration::pushQueueLength).
+   * @return The number of dropped samples.
+   */
+  unsigned long long getDroppedSamples() const;
+
+  /**
+   * Gets the windows of the time series of the application (see
+   * ApplicationConfiguration::timeSeriesIntervalMs) received together with
+   * the last sample, i.e. the ones cut since the previous sample, the
+   * oldest first. Their tasks add up to the ones of the sample, unless some
+   * windows have been overwritten (see getOverwrittenWindows()).
+   * @return The windows received with the last sample.
+   */
+  const std::vector<TimeSeriesWindow>& getTimeSeries() const;
+
+  /**
+   * Gets the number of windows of the time series overwritten by the
+   * application so far, because the monitor did not get the samples often
+   * enough (see ApplicationConfiguration::timeSeriesLength). They are the
+   * gaps between the indexes of the received windows.
+   * @return The number of overwritten windows.
+   */
+  unsigned long long getOverwrittenWindows() const;
+
   /**
    * Gets the identifier of the last recorded phase.
    * @return The identifier of the last recorded phase.
@@ -779,6 +3190,121 @@ class Monitor {
    */
   unsigned int getTotalThreads() const;
 
+  /**
+   * Gets the number of threads which contributed to the last sample.
+   * If smaller than getActiveThreads(), the sample is partial.
+   * @return The number of threads which contributed to the last sample.
+   */
+  unsigned int getContributingThreads() const;
+
+  /**
+   * Gets the number of threads which called begin() at least once.
+   * @return The number of threads which called begin() at least once.
+   */
+  unsigned int getActiveThreads() const;
+
+  /**
+   * Gets the threads which did not contribute to the last sample within
+   * the consolidation deadline (see ApplicationConfiguration), the ones
+   * stalled for the longest time first. At most RIFF_MAX_STALLED_THREADS
+   * threads are reported.
+   * @return The threads which did not contribute to the last sample.
+   */
+  const std::vector<StalledThread>& getStalledThreads() const;
+
+  /**
+   * Gets the percentiles of the latency of the tasks computed in the last
+   * sample. Unlike ApplicationSample::latency, they are computed on the
+   * latencies of the single tasks rather than on their average.
+   * @return The percentiles of the latency in the last sample.
+   */
+  const LatencyPercentiles& getLatencyPercentiles() const;
+
+  /**
+   * Gets how the begin()/end() calls have been sampled in the last sample,
+   * and the resulting overhead.
+   * @return The sampling statistics of the last sample.
+   */
+  const SamplingStatistics& getSamplingStatistics() const;
+
+  /**
+   * Gets the events counted by the threads which contributed to the last
+   * sample (see ApplicationConfiguration::perfCounters).
+   * @return The performance counters of the last sample.
+   */
+  const PerformanceCounters& getPerformanceCounters() const;
+
+  /**
+   * Gets how the operating system scheduled the threads which called
+   * begin() at least once, in the last sample (see
+   * ApplicationConfiguration::schedulingStatistics). Threads which
+   * terminated are not included.
+   * @return The scheduling statistics of the last sample.
+   */
+  const SchedulingStatistics& getSchedulingStatistics() const;
+
+  /**
+   * Gets the samples of the named regions of the application (see
+   * Application::region()), received together with the last sample.
+   * @return The samples of the named regions, sorted by name.
+   */
+  const std::vector<RegionSample>& getRegionSamples() const;
+
+  /**
+   * Gets the metrics of the application (see ApplicationPolicy), received
+   * together with the last sample. They contain the values stored by all
+   * the threads since the previous sample.
+   * @param metrics The returned metrics. Must have the same schema used by
+   *        the application.
+   */
+  template <typename Metrics>
+  void getMetrics(Metrics& metrics) const {
+    static_assert(!std::is_same<Metrics, NoMetrics>::value,
+                  "NoMetrics has no fields.");
+    const MetricSchema* schema = getMetricSchema<Metrics>();
+    schema->deserialize(&metrics, getMetricValues(0, schema));
+  }
+
+  /**
+   * Same as getMetrics(), for a named region.
+   * @param region The index of the region in getRegionSamples().
+   * @param metrics The returned metrics. Must have the same schema used by
+   *        the application.
+   */
+  template <typename Metrics>
+  void getRegionMetrics(size_t region, Metrics& metrics) const {
+    static_assert(!std::is_same<Metrics, NoMetrics>::value,
+                  "NoMetrics has no fields.");
+    const MetricSchema* schema = getMetricSchema<Metrics>();
+    schema->deserialize(&metrics, getMetricValues(1 + region, schema));
+  }
+
+  /**
+   * Gets the named metrics of the application (see Application::counter()
+   * and Application::gauge()), updated with the last sample.
+   * @return The named metrics, in registration order.
+   */
+  const std::vector<NamedMetric>& getNamedMetrics() const;
+
+  /**
+   * Gets the value of a named metric (see getNamedMetrics()).
+   * @param name The name of the metric.
+   * @return The value of the metric in the last sample.
+   */
+  double getNamedMetric(const std::string& name) const;
+
+  /**
+   * Gets the statistics of a phase (see Application::setPhaseId()), as
+   * received with the last sample in which the phase was updated. The
+   * statistics of a phase are final once all the threads started the next
+   * one. Only the last RIFF_MAX_PHASE_HISTORY phases are kept.
+   * @param phaseId The identifier of the phase.
+   * @param statistics The returned statistics.
+   * @return False if the phase is unknown (or too old).
+   */
+  bool getPhaseStatistics(unsigned int phaseId,
+                          PhaseStatistics& statistics) const;
+
   /**
    * Returns the execution time of the application (milliseconds).
    * @return The execution time of the application (milliseconds).
@@ -795,6 +3321,228 @@ class Monitor {
   unsigned long long getTotalTasks();
 };
 
+/*!
+ * \class SharedMonitor
+ * \brief Reads the samples of an application running on the same machine
+ * from its shared memory segment (see ApplicationConfiguration::sharedMemory).
+ *
+ * Reading a sample does not involve the application in any way (no
+ * messages, no support thread), so it can be done at high frequency. Only
+ * the default region is available, and the custom fields are not
+ * aggregated. The Monitor of the application is still needed to receive
+ * its start and termination.
+ */
+class SharedMonitor {
+ private:
+  const SharedSegment* _segment;
+  // The counters and the generation of each slot at the last read.
+  std::vector<ThreadSnapshot> _lastRead;
+  std::vector<unsigned long> _generations;
+  bool _terminated;
+
+ public:
+  /**
+   * Attaches to the shared memory segment of an application.
+   * @param pid The pid of the application (see Monitor::waitStart()).
+   * Throws an exception if the application has no shared memory segment or
+   * it has been created by a different version of riff.
+   **/
+  explicit SharedMonitor(pid_t pid);
+
+  ~SharedMonitor();
+
+  SharedMonitor(const SharedMonitor& m) = delete;
+  SharedMonitor& operator=(SharedMonitor const& x) = delete;
+
+  /**
+   * Computes the sample since the previous call (or since the start of the
+   * threads, for the first one) from the last published counters.
+   * @param sample The returned sample.
+   * @return False if the application terminated before the previous call,
+   * and thus there are no more samples.
+   **/
+  bool getSample(ApplicationSample& sample);
+
+  /**
+   * Gets the identifier of the current phase.
+   * @return The identifier of the current phase.
+   */
+  unsigned int getPhaseId() const;
+};
+
+/*!
+ * \struct MonitoredApplication
+ * \brief An application monitored by a MultiMonitor.
+ */
+typedef struct MonitoredApplication {
+  pid_t pid;
+  // See ApplicationConfiguration::name. Empty until received.
+  std::string name;
+  std::string labels;
+  // Only valid once the application terminated (see Monitor).
+  ulong executionTime;
+  unsigned long long totalTasks;
+
+  MonitoredApplication() : pid(0), executionTime(0), totalTasks(0) { ; }
+} MonitoredApplication;
+
+/*!
+ * \struct MultiSample
+ * \brief A sample received by a MultiMonitor.
+ */
+typedef struct MultiSample {
+  // The application which sent it.
+  pid_t pid;
+  ApplicationSample sample;
+  unsigned int phaseId;
+  unsigned int activeThreads;
+  LatencyPercentiles latencyPercentiles;
+} MultiSample;
+
+/*!
+ * \class MultiMonitor
+ * \brief Monitors any number of applications on a single endpoint,
+ * without a thread per application.
+ *
+ * The applications must connect to the endpoint with an NN_BUS socket,
+ * e.g.:
+ *
+ *     nn::socket socket(AF_SP, NN_BUS);
+ *     riff::Application app(socket, socket.connect("ipc:///tmp/riff.ipc"));
+ *
+ * The monitor never blocks: requestSamples() asks a sample to all the
+ * applications, and collect() returns the ones received so far. getFd()
+ * can be used to wait for them with poll()/epoll. The applications which
+ * push their samples (see ApplicationConfiguration::pushIntervalMs) do not
+ * need requestSamples(). Only the sample of the default region and a few
+ * statistics are returned for each application.
+ */
+class MultiMonitor {
+ private:
+  nn::socket _channel;
+  int _chid;
+  std::map<pid_t, MonitoredApplication> _applications;
+
+  // Sends a message to an application (0 for all of them).
+  void send(MessageType type, pid_t pid);
+
+ public:
+  /**
+   * Creates a multi monitor.
+   * @param channelName The name of the channel the applications connect to.
+   **/
+  explicit MultiMonitor(const std::string& channelName);
+
+  ~MultiMonitor();
+
+  MultiMonitor(const MultiMonitor& m) = delete;
+  MultiMonitor& operator=(MultiMonitor const& x) = delete;
+
+  /**
+   * Returns a file descriptor which is readable (e.g. with poll()) when
+   * collect() has something to return. It must not be read or written.
+   * @return The file descriptor.
+   **/
+  int getFd() const;
+
+  /**
+   * Asks a sample to all the applications. Never blocks.
+   **/
+  void requestSamples();
+
+  /**
+   * Processes all the messages received so far, without blocking.
+   * @param samples The samples received, in order.
+   * @param terminated The applications which terminated.
+   **/
+  void collect(std::vector<MultiSample>& samples,
+               std::vector<MonitoredApplication>& terminated);
+
+  /**
+   * Returns the applications which did not terminate yet, by pid. An
+   * application is known once its first message has been received.
+   * @return The running applications.
+   **/
+  const std::map<pid_t, MonitoredApplication>& getApplications() const;
+};
+
+/*!
+ * \struct JobSample
+ * \brief The result of a survey of a SurveyMonitor.
+ */
+typedef struct JobSample {
+  // The samples of the ranks which answered, aggregated: the throughput and
+  // the tasks are summed, the latency and the load are averaged over the
+  // consistent samples.
+  ApplicationSample sample;
+  // The samples of the ranks which answered, one each.
+  std::vector<MultiSample> samples;
+  // The ranks which answered some previous survey but did not answer this
+  // one before the deadline.
+  std::vector<pid_t> missing;
+  // The ranks which terminated since the previous survey.
+  std::vector<MonitoredApplication> terminated;
+} JobSample;
+
+/*!
+ * \class SurveyMonitor
+ * \brief Samples all the ranks of a job (e.g. one process per core on
+ * several nodes) over the same window, and aggregates their samples.
+ *
+ * The ranks must connect to the endpoint with an NN_RESPONDENT socket,
+ * e.g.:
+ *
+ *     nn::socket socket(AF_SP, NN_RESPONDENT);
+ *     riff::Application app(socket, socket.connect("tcp://node0:5555"));
+ *
+ * Each survey asks a sample to all the ranks at once, so that each one
+ * covers the time since the previous survey. The ranks which do not answer
+ * before the deadline are reported as missing, and their late answers are
+ * discarded (with the tasks they sampled). The ranks only answer the
+ * surveys: they do not send anything when they start, and terminate() waits
+ * for the next survey to send their totals. Their name and labels are not
+ * available. Only the sample of the default region and a few statistics are
+ * returned for each rank.
+ */
+class SurveyMonitor {
+ private:
+  nn::socket _channel;
+  int _chid;
+  // The ranks which answered at least a survey, and did not terminate.
+  std::map<pid_t, MonitoredApplication> _applications;
+
+ public:
+  /**
+   * Creates a survey monitor.
+   * @param channelName The name of the channel the ranks connect to.
+   * @param deadlineMs The time (milliseconds) each survey waits for the
+   *        answers. Should be longer than
+   *        ApplicationConfiguration::consolidationDeadlineMs plus the
+   *        network round trip.
+   **/
+  explicit SurveyMonitor(const std::string& channelName,
+                         unsigned int deadlineMs = 100);
+
+  ~SurveyMonitor();
+
+  SurveyMonitor(const SurveyMonitor& m) = delete;
+  SurveyMonitor& operator=(SurveyMonitor const& x) = delete;
+
+  /**
+   * Asks a sample to all the ranks, and waits for their answers until the
+   * deadline.
+   * @param job The samples received.
+   **/
+  void survey(JobSample& job);
+
+  /**
+   * Returns the ranks which answered at least a survey and did not
+   * terminate, by pid.
+   * @return The running ranks.
+   **/
+  const std::map<pid_t, MonitoredApplication>& getApplications() const;
+};
+
 }  // namespace riff
 
 #endif
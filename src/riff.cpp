@@ -10,13 +10,32 @@
 #include <riff/getticks.h>
 #include <riff/external/cppnanomsg/nn.hpp>
 #include <riff/riff.hpp>
+#include "external/nanomsg/src/bus.h"
 #include "external/nanomsg/src/pair.h"
+#include "external/nanomsg/src/survey.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <cmath>
+#include <fstream>
 #include <limits>
+#include <new>
+#include <set>
 #include <stdexcept>
 
 using namespace std;
@@ -40,211 +59,2687 @@ using namespace std;
 
 namespace riff {
 
-unsigned long long getCurrentTimeNs() {
-#ifdef RIFF_NS_PER_TICK
-  return getticks() / RIFF_NS_PER_TICK;
-#else
+// Time spent calibrating the TSC (nanoseconds).
+#define RIFF_TSC_CALIBRATION_TIME 20000000
+// Maximum time (milliseconds) a monitor waits, when destroyed, for the
+// application to receive the acknowledgement of its termination.
+#define RIFF_STOPACK_LINGER_MS 1000
+// Interval (milliseconds) at which a monitor which is attaching asks the
+// application to announce itself, until it does.
+#define RIFF_ATTACH_RETRY_MS 100
+// Interval (milliseconds) at which the support thread of an application
+// answering the requests of the monitor frees the data of the registered
+// threads which terminated, while no monitor is connected.
+#define RIFF_REAP_INTERVAL_MS 200
+
+// The clock used to take the timestamps. They are only written when the
+// clock is initialized, before any timestamp is taken.
+static ClockSource clockSource = CLOCK_SOURCE_MONOTONIC;
+static clockid_t clockId = CLOCK_MONOTONIC;
+static double nsPerTick = 1.0;
+static std::atomic<bool> clockInitialized(false);
+static pthread_mutex_t clockMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long getMonotonicTimeNs(clockid_t id) {
   struct timespec tp;
-  int r = clock_gettime(CLOCK_MONOTONIC, &tp);
+  int r = clock_gettime(id, &tp);
   assert(!r);
-  return tp.tv_sec * 1.0e9 + tp.tv_nsec;
+  UNUSED(r);
+  return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+// Returns the name of the CPU model, or an empty string if it is not known.
+static std::string getCpuModel() {
+  std::string model;
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int regs[12];
+  for (unsigned int i = 0; i < 3; i++) {
+    if (!__get_cpuid(0x80000002 + i, &regs[4 * i], &regs[4 * i + 1],
+                     &regs[4 * i + 2], &regs[4 * i + 3])) {
+      return model;
+    }
+  }
+  model.assign(reinterpret_cast<const char*>(regs), sizeof(regs));
+  model = model.c_str();  // Drops the trailing zeros
 #endif
+  return model;
 }
 
-inline bool keepWaitingSample(Application* application, size_t threadId,
-                              size_t updatedSamples) {
-  if (*application->_threadData->at(threadId).consolidate) {
-    return !application->_supportStop;
+// Returns true if the TSC ticks at a constant rate, also across frequency
+// changes and deep sleep states.
+static bool isTscInvariant() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+    return edx & (1 << 8);
   }
+#endif
   return false;
 }
 
-void* applicationSupportThread(void* data) {
-  Application* application = static_cast<Application*>(data);
+// Reads the TSC and CLOCK_MONOTONIC at (almost) the same time.
+static void readTscAndMonotonic(unsigned long long& ticks,
+                                unsigned long long& ns) {
+  // The read with the shortest gap between the two TSC reads is the most
+  // precise one.
+  unsigned long long bestGap = std::numeric_limits<unsigned long long>::max();
+  for (size_t i = 0; i < 5; i++) {
+    unsigned long long before = getticks();
+    unsigned long long now = getMonotonicTimeNs(CLOCK_MONOTONIC);
+    unsigned long long after = getticks();
+    if (after - before < bestGap) {
+      bestGap = after - before;
+      ticks = before + (after - before) / 2;
+      ns = now;
+    }
+  }
+}
 
-  while (!application->_supportStop) {
-    Message recvdMsg;
-    int res = application->_channelRef.recv(&recvdMsg, sizeof(recvdMsg), 0);
-    if (res == sizeof(recvdMsg)) {
-      assert(recvdMsg.type == MESSAGE_TYPE_SAMPLE_REQ);
-      // Prepare response message.
-      Message msg;
-      msg.type = MESSAGE_TYPE_SAMPLE_RES;
-      msg.payload.sample = ApplicationSample();  // Set sample to all zeros
-
-      // Add the samples of all the threads.
-      size_t updatedSamples = 0, inconsistentSamples = 0;
-      size_t numThreads = application->_threadData->size();
-      std::vector<double> customVec[RIFF_MAX_CUSTOM_FIELDS];
-
-      for (size_t i = 0; i < numThreads; i++) {
-        *(application->_threadData->at(i).consolidate) = true;
-      }
-      unsigned long long consolidationTimestamp = getCurrentTimeNs();
-
-      for (size_t i = 0; i < numThreads; i++) {
-        // If needed, wait for thread to store a sample.
-        while (keepWaitingSample(application, i, updatedSamples)) {
-          // To wait, the idea is that after the consolidation request has been
-          // sent, samples should be stored at most after samplingLengthMs
-          // milliseconds. If that time is already elapsed, we just wait for one
-          // millisecond (to avoid too tight spin loop), otherwise, we wait for
-          // that time to elapse. (it is performed at most once independently
-          // from the number of needed samples)
-          unsigned long long timeFromConsolidation =
-              (getCurrentTimeNs() - consolidationTimestamp) / 1000000.0;
-          if (timeFromConsolidation >
-              application->_configuration.samplingLengthMs) {
-            usleep(1000);
+static double calibrateTsc() {
+  unsigned long long startTicks = 0, startNs = 0, endTicks = 0, endNs = 0;
+  readTscAndMonotonic(startTicks, startNs);
+  do {
+    readTscAndMonotonic(endTicks, endNs);
+  } while (endNs - startNs < RIFF_TSC_CALIBRATION_TIME);
+  return (double)(endNs - startNs) / (double)(endTicks - startTicks);
+}
+
+// Returns the duration of a TSC tick, reading it from the calibration file
+// (if any) when it was computed on the same CPU model.
+static double getTscNsPerTick() {
+  const char* fileName = getenv("RIFF_CLOCK_CALIBRATION_FILE");
+  std::string model = getCpuModel();
+  if (fileName) {
+    std::ifstream in(fileName);
+    std::string cachedModel;
+    double cachedNsPerTick = 0;
+    if (std::getline(in, cachedModel) && in >> cachedNsPerTick &&
+        cachedModel == model && cachedNsPerTick > 0) {
+      return cachedNsPerTick;
+    }
+  }
+  double r = calibrateTsc();
+  if (fileName) {
+    // Failing to cache the calibration is not an error.
+    std::ofstream out(fileName);
+    out.precision(std::numeric_limits<double>::digits10 + 2);
+    out << model << std::endl << r << std::endl;
+  }
+  return r;
+}
+
+// Must be called with clockMutex locked.
+static void initClock(ClockSource source) {
+  if (source == CLOCK_SOURCE_DEFAULT) {
+    const char* name = getenv("RIFF_CLOCK_SOURCE");
+    if (!name) {
+      source = isTscInvariant() ? CLOCK_SOURCE_TSC : CLOCK_SOURCE_MONOTONIC;
+    } else if (!strcmp(name, "tsc")) {
+      source = CLOCK_SOURCE_TSC;
+    } else if (!strcmp(name, "monotonic")) {
+      source = CLOCK_SOURCE_MONOTONIC;
+    } else if (!strcmp(name, "monotonic_coarse")) {
+      source = CLOCK_SOURCE_MONOTONIC_COARSE;
+    } else {
+      throw std::runtime_error("Unknown RIFF_CLOCK_SOURCE: " +
+                               std::string(name));
+    }
+  }
+  switch (source) {
+    case CLOCK_SOURCE_TSC: {
+      if (!isTscInvariant()) {
+        throw std::runtime_error("The TSC of this CPU is not invariant.");
+      }
+      nsPerTick = getTscNsPerTick();
+    } break;
+    case CLOCK_SOURCE_MONOTONIC: {
+      clockId = CLOCK_MONOTONIC;
+    } break;
+    case CLOCK_SOURCE_MONOTONIC_COARSE: {
+      clockId = CLOCK_MONOTONIC_COARSE;
+    } break;
+    default: {
+      throw std::runtime_error("Unknown clock source.");
+    }
+  }
+  clockSource = source;
+  clockInitialized.store(true, std::memory_order_release);
+}
+
+static void initClock() {
+  if (!clockInitialized.load(std::memory_order_acquire)) {
+    pthread_mutex_lock(&clockMutex);
+    if (!clockInitialized.load(std::memory_order_relaxed)) {
+      try {
+        initClock(CLOCK_SOURCE_DEFAULT);
+      } catch (...) {
+        pthread_mutex_unlock(&clockMutex);
+        throw;
+      }
+    }
+    pthread_mutex_unlock(&clockMutex);
+  }
+}
+
+void setClockSource(ClockSource source) {
+  pthread_mutex_lock(&clockMutex);
+  if (clockInitialized.load(std::memory_order_relaxed)) {
+    pthread_mutex_unlock(&clockMutex);
+    throw std::runtime_error(
+        "setClockSource() must be called before creating any Application "
+        "and before reading the clock.");
+  }
+  try {
+    initClock(source);
+  } catch (...) {
+    pthread_mutex_unlock(&clockMutex);
+    throw;
+  }
+  pthread_mutex_unlock(&clockMutex);
+}
+
+ClockSource getClockSource() {
+  initClock();
+  return clockSource;
+}
+
+unsigned long long getCurrentTicks() {
+  if (clockSource == CLOCK_SOURCE_TSC) {
+    return getticks();
+  }
+  return getMonotonicTimeNs(clockId);
+}
+
+double getNsPerTick() {
+  initClock();
+  return nsPerTick;
+}
+
+unsigned long long getCurrentTimeNs() {
+  initClock();
+  return getCurrentTicks() * nsPerTick;
+}
+
+thread_local ThreadDataCache threadDataCache[RIFF_THREAD_DATA_CACHE_SIZE];
+
+// Used to give each region a unique identifier (0 is never used).
+static std::atomic<unsigned long long> nextRegionId(1);
+
+// Identifies the shared memory segments ("RIFF").
+static const unsigned int sharedMemoryMagic = 0x46464952;
+
+// The shared memory segment of the application which uses it (at most one
+// per process), and its number of owners: the application and the threads
+// with a slot in it. The last one unmaps it.
+static SharedSegment* sharedSegment = NULL;
+static std::atomic<unsigned int> sharedSegmentRefs(0);
+
+static std::string getSharedSegmentName(pid_t pid) {
+  return "/dev/shm/riff-" + std::to_string(pid);
+}
+
+static SharedSegment* createSharedSegment() {
+  if (sharedSegmentRefs.load(std::memory_order_acquire)) {
+    throw std::runtime_error(
+        "Only one application per process can use the shared memory.");
+  }
+  std::string name = getSharedSegmentName(getpid());
+  // Left by a terminated process with the same pid.
+  unlink(name.c_str());
+  int fd = open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd == -1 || ftruncate(fd, sizeof(SharedSegment))) {
+    std::string error = strerror(errno);
+    if (fd != -1) {
+      close(fd);
+    }
+    throw std::runtime_error("Impossible to create " + name + ": " + error);
+  }
+  void* mem = mmap(NULL, sizeof(SharedSegment), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    throw std::runtime_error("Impossible to map " + name + ": " +
+                             strerror(errno));
+  }
+  SharedSegment* segment = new (mem) SharedSegment();
+  segment->version = RIFF_SHARED_MEMORY_VERSION;
+  segment->pid = getpid();
+  segment->nsPerTick = nsPerTick;
+  std::atomic_thread_fence(std::memory_order_release);
+  segment->magic = sharedMemoryMagic;
+  sharedSegment = segment;
+  sharedSegmentRefs.store(1, std::memory_order_release);
+  return segment;
+}
+
+static void releaseSharedSegment() {
+  if (sharedSegmentRefs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    munmap(sharedSegment, sizeof(SharedSegment));
+    sharedSegment = NULL;
+  }
+}
+
+// Assigns a slot of the segment to a new thread, reusing the ones of the
+// exited threads only if there are no free ones. Returns NULL if all the
+// slots are in use.
+static SharedThreadSlot* acquireSharedSlot(SharedSegment* segment) {
+  const unsigned int states[] = {SHARED_SLOT_FREE, SHARED_SLOT_EXITED};
+  for (unsigned int state : states) {
+    for (SharedThreadSlot& slot : segment->slots) {
+      unsigned int expected = state;
+      if (slot.state.load(std::memory_order_relaxed) == state &&
+          slot.state.compare_exchange_strong(expected, SHARED_SLOT_USED,
+                                             std::memory_order_acq_rel)) {
+        sharedSegmentRefs.fetch_add(1, std::memory_order_relaxed);
+        slot.reset();
+        return &slot;
+      }
+    }
+  }
+  segment->droppedThreads.fetch_add(1, std::memory_order_relaxed);
+  return NULL;
+}
+
+// The data registered by a thread in the regions it used.
+// When the thread terminates, it publishes its last counters and marks
+// the data as exited, so that the support thread can remove it.
+class ThreadRegistrations {
+ public:
+  std::vector<std::pair<unsigned long long, ThreadData*> > entries;
+
+  ~ThreadRegistrations() {
+    for (const auto& r : entries) {
+      ThreadData* tData = r.second;
+      // The support thread merges the handed off metrics quickly, and
+      // never waits for this thread while doing it.
+      while (tData->metrics && !tData->handOffMetrics()) {
+        sched_yield();
+      }
+      if (tData->lastEnd > tData->current.timestamp) {
+        tData->publish(tData->lastEnd);
+      }
+      tData->exited.store(true, std::memory_order_release);
+      tData->leaveSharedSlot();
+      tData->release();
+    }
+  }
+};
+
+static thread_local ThreadRegistrations threadRegistrations;
+
+unsigned long long getLatencyBucketMax(size_t bucket) {
+  if (bucket < (1ULL << RIFF_LATENCY_HISTOGRAM_PRECISION)) {
+    return bucket;
+  }
+  unsigned int shift = (bucket >> RIFF_LATENCY_HISTOGRAM_PRECISION) - 1;
+  unsigned long long mantissa =
+      (bucket & ((1ULL << RIFF_LATENCY_HISTOGRAM_PRECISION) - 1)) +
+      (1ULL << RIFF_LATENCY_HISTOGRAM_PRECISION);
+  return ((mantissa + 1) << shift) - 1;
+}
+
+// Computes the percentiles of the latencies counted in a histogram.
+static void computeLatencyPercentiles(
+    const std::vector<unsigned long long>& histogram,
+    LatencyPercentiles& percentiles) {
+  unsigned long long total = 0;
+  size_t last = 0;
+  for (size_t i = 0; i < histogram.size(); i++) {
+    if (histogram[i]) {
+      total += histogram[i];
+      last = i;
+    }
+  }
+  percentiles = LatencyPercentiles();
+  if (!total) {
+    return;
+  }
+  const double ranks[] = {0.5, 0.9, 0.99, 0.999};
+  double* values[] = {&percentiles.p50, &percentiles.p90, &percentiles.p99,
+                      &percentiles.p999};
+  size_t r = 0;
+  unsigned long long count = 0;
+  for (size_t i = 0; i <= last && r < 4; i++) {
+    count += histogram[i];
+    while (r < 4 && count >= std::ceil(ranks[r] * total)) {
+      *values[r++] = getLatencyBucketMax(i) * nsPerTick;
+    }
+  }
+  percentiles.max = getLatencyBucketMax(last) * nsPerTick;
+}
+
+// Returns true if the thread published something since the snapshot
+// 'last' was read.
+static inline bool isUpdated(const ThreadSnapshot& snapshot,
+                             const ThreadSnapshot& last) {
+  return snapshot.timestamp != last.timestamp &&
+         snapshot.numTasks != last.numTasks;
+}
+
+// Computes the sample of a thread from the counters it published since the
+// snapshot 'last' (which must have a timestamp). Returns the duration of the
+// sample (clock ticks).
+static double computeThreadSample(const ThreadSnapshot& snapshot,
+                                  const ThreadSnapshot& last,
+                                  double nsPerTick,
+                                  double consistencyThreshold,
+                                  ApplicationSample& sample) {
+  // Ratios between durations do not depend on their unit, so they are
+  // converted to nanoseconds only when needed.
+  double sampleTime = snapshot.timestamp - last.timestamp;
+  double latency = snapshot.latency - last.latency;
+  double idleTime = snapshot.idleTime - last.idleTime;
+  sample.numTasks = snapshot.numTasks - last.numTasks;
+  sample.throughput =
+      sample.numTasks /
+      (sampleTime * nsPerTick / 1000000000.0);  // From tasks/ns to tasks/sec
+  sample.loadPercentage = (latency / sampleTime) * 100.0;
+  sample.latency = latency * nsPerTick / sample.numTasks;
+  // Consistency check
+  // If the gap between real total time and the one estimated with
+  // latency and idle time is greater than a threshold, idleTime and
+  // latency are not reliable.
+  if (((std::abs(sampleTime - (latency + idleTime)) / sampleTime) * 100.0) >
+      consistencyThreshold) {
+    sample.inconsistent = true;
+  }
+  return sampleTime;
+}
+
+// Encoding of the messages (see RIFF_WIRE_VERSION). A message starts with
+// wireMagic and the version, followed by its fields in any order. Each field
+// starts with a key, (tag << 3) | WireType, followed by its value: a
+// varint, a little-endian double, or a length and as many bytes (e.g. a
+// nested structure). Varints are little-endian base 128. The fields equal to
+// 0 are not sent, and the numbers which are non-negative integers (e.g. the
+// counters) are sent as varints. The fields with an unknown tag are
+// skipped.
+static const unsigned char wireMagic[2] = {'R', 'F'};
+
+typedef enum WireType {
+  WIRE_VARINT = 0,
+  WIRE_FIXED64 = 1,
+  WIRE_BYTES = 2
+} WireType;
+
+// The tags of the fields of a Message, also used by the nested
+// RegionSample. The fields of the other nested structures are numbered from
+// 1, in declaration order. Never reuse or renumber them.
+typedef enum WireTag {
+  TAG_TYPE = 1,
+  TAG_PID = 2,
+  TAG_NAME = 3,
+  TAG_LABELS = 4,
+  TAG_EXECUTION_TIME = 5,
+  TAG_TOTAL_TASKS = 6,
+  TAG_SAMPLE = 7,
+  TAG_CONTRIBUTING_THREADS = 8,
+  TAG_ACTIVE_THREADS = 9,
+  TAG_NUM_STALLED = 10,
+  TAG_STALLED = 11,
+  TAG_LATENCY_PERCENTILES = 12,
+  TAG_SAMPLING_STATISTICS = 13,
+  TAG_PERFORMANCE_COUNTERS = 14,
+  TAG_SCHEDULING_STATISTICS = 15,
+  TAG_REGION = 16,
+  TAG_PHASE_ID = 17,
+  TAG_TOTAL_THREADS = 18,
+  TAG_NUM_METRIC_FIELDS = 19,
+  TAG_METRIC_VALUE = 20,
+  TAG_FIRST_NEW_NAMED_METRIC = 21,
+  TAG_NEW_NAMED_METRIC = 22,
+  TAG_NAMED_METRIC_UPDATE = 23,
+  TAG_PHASE = 24,
+  TAG_DROPPED_SAMPLES = 25,
+  TAG_FIRST_WINDOW = 26,
+  TAG_WINDOW = 27,
+  TAG_OVERWRITTEN_WINDOWS = 28
+} WireTag;
+
+// The buffer of an encoded message. It is a nanomsg message, grown as
+// needed, so that it is sent without being copied again (see send()).
+class WireBuffer {
+ private:
+  unsigned char* _data;
+  size_t _size;
+  size_t _capacity;
+
+  void reserve(size_t size) {
+    if (size <= _capacity) {
+      return;
+    }
+    size_t capacity = std::max(size, 2 * _capacity);
+    void* data = nn_reallocmsg(_data, capacity);
+    if (!data) {
+      throw std::runtime_error("Impossible to allocate the message.");
+    }
+    _data = static_cast<unsigned char*>(data);
+    _capacity = capacity;
+  }
+
+ public:
+  // 'capacity' is the expected size of the message (e.g. the size of the
+  // previous one of the same kind).
+  explicit WireBuffer(size_t capacity)
+      : _data(NULL), _size(0), _capacity(std::max(capacity, (size_t)64)) {
+    _data = static_cast<unsigned char*>(nn::allocmsg(_capacity, 0));
+  }
+
+  ~WireBuffer() {
+    if (_data) {
+      nn::freemsg(_data);
+    }
+  }
+
+  WireBuffer(const WireBuffer&) = delete;
+  WireBuffer& operator=(const WireBuffer&) = delete;
+
+  size_t size() const { return _size; }
+
+  unsigned char* data() { return _data; }
+
+  void push_back(unsigned char c) {
+    reserve(_size + 1);
+    _data[_size++] = c;
+  }
+
+  void append(const void* data, size_t length) {
+    reserve(_size + length);
+    memcpy(_data + _size, data, length);
+    _size += length;
+  }
+
+  // Sends the message, handing it over to nanomsg (unless it fails, e.g.
+  // with NN_DONTWAIT).
+  int send(nn::socket& socket, int flags) {
+    // Shrinking does not move it.
+    void* data = nn_reallocmsg(_data, _size);
+    if (!data) {
+      throw std::runtime_error("Impossible to allocate the message.");
+    }
+    _data = static_cast<unsigned char*>(data);
+    _capacity = _size;
+    int r = socket.send(&_data, NN_MSG, flags);
+    if (r >= 0) {
+      _data = NULL;
+    }
+    return r;
+  }
+};
+
+class WireWriter {
+ private:
+  WireBuffer& _buffer;
+
+  void appendVarint(unsigned long long value) {
+    while (value >= 0x80) {
+      _buffer.push_back((value & 0x7F) | 0x80);
+      value >>= 7;
+    }
+    _buffer.push_back(value);
+  }
+
+  void appendKey(unsigned int tag, WireType type) {
+    appendVarint((tag << 3) | type);
+  }
+
+ public:
+  explicit WireWriter(WireBuffer& buffer) : _buffer(buffer) {
+    ;
+  }
+
+  void writeHeader() {
+    for (unsigned char c : wireMagic) {
+      _buffer.push_back(c);
+    }
+    appendVarint(RIFF_WIRE_VERSION);
+  }
+
+  void writeVarint(unsigned int tag, unsigned long long value,
+                   bool always = false) {
+    if (value || always) {
+      appendKey(tag, WIRE_VARINT);
+      appendVarint(value);
+    }
+  }
+
+  void writeNumber(unsigned int tag, double value, bool always = false) {
+    if (value >= 0 && value < 9007199254740992.0 &&  // 2^53
+        value == (double)(unsigned long long)value) {
+      writeVarint(tag, (unsigned long long)value, always);
+      return;
+    }
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    appendKey(tag, WIRE_FIXED64);
+    for (size_t i = 0; i < sizeof(bits); i++) {
+      _buffer.push_back(bits >> (8 * i));
+    }
+  }
+
+  void writeString(unsigned int tag, const char* value) {
+    size_t length = strlen(value);
+    if (length) {
+      appendKey(tag, WIRE_BYTES);
+      appendVarint(length);
+      _buffer.append(value, length);
+    }
+  }
+
+  // Starts a nested structure, ended by endNested() with the returned
+  // position.
+  size_t beginNested() { return _buffer.size(); }
+
+  // Ends a nested structure. If 'always' is false and it is empty (all its
+  // fields are 0), it is not sent.
+  void endNested(unsigned int tag, size_t start, bool always = false) {
+    size_t length = _buffer.size() - start;
+    if (!length && !always) {
+      return;
+    }
+    // The key and the length are inserted before the structure.
+    size_t end = _buffer.size();
+    appendKey(tag, WIRE_BYTES);
+    appendVarint(length);
+    unsigned char* data = _buffer.data();
+    std::rotate(data + start, data + end, data + _buffer.size());
+  }
+};
+
+class WireReader {
+ private:
+  const unsigned char* _next;
+  const unsigned char* _end;
+  // Shared with the readers of the nested structures.
+  bool _failed;
+  bool* _error;
+
+  WireReader(const unsigned char* data, size_t size, bool* error)
+      : _next(data), _end(data + size), _failed(false), _error(error) {
+    ;
+  }
+
+  unsigned long long readVarint() {
+    unsigned long long value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+      if (_next >= _end) {
+        break;
+      }
+      unsigned char byte = *_next++;
+      value |= (unsigned long long)(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    *_error = true;
+    return 0;
+  }
+
+ public:
+  WireReader(const void* data, size_t size)
+      : _next(static_cast<const unsigned char*>(data)),
+        _end(_next + size),
+        _failed(false),
+        _error(&_failed) {
+    ;
+  }
+
+  bool failed() const { return *_error; }
+
+  // Checks the magic and the version.
+  bool readHeader() {
+    if ((size_t)(_end - _next) < sizeof(wireMagic) ||
+        memcmp(_next, wireMagic, sizeof(wireMagic))) {
+      return false;
+    }
+    _next += sizeof(wireMagic);
+    return readVarint() == RIFF_WIRE_VERSION && !failed();
+  }
+
+  // Reads the key of the next field. Returns false at the end.
+  bool next(unsigned int& tag, WireType& type) {
+    if (failed() || _next >= _end) {
+      return false;
+    }
+    unsigned long long key = readVarint();
+    tag = key >> 3;
+    type = (WireType)(key & 7);
+    return !failed();
+  }
+
+  void skip(WireType type) {
+    if (type == WIRE_VARINT) {
+      readVarint();
+    } else if (type == WIRE_FIXED64 && _end - _next >= 8) {
+      _next += 8;
+    } else if (type == WIRE_BYTES) {
+      unsigned long long length = readVarint();
+      if (length <= (unsigned long long)(_end - _next)) {
+        _next += length;
+      } else {
+        *_error = true;
+      }
+    } else {
+      *_error = true;
+    }
+  }
+
+  double readNumber(WireType type) {
+    if (type == WIRE_VARINT) {
+      return readVarint();
+    } else if (type == WIRE_FIXED64 && _end - _next >= 8) {
+      uint64_t bits = 0;
+      for (size_t i = 0; i < sizeof(bits); i++) {
+        bits |= (uint64_t)_next[i] << (8 * i);
+      }
+      _next += sizeof(bits);
+      double value;
+      memcpy(&value, &bits, sizeof(value));
+      return value;
+    }
+    skip(type);
+    return 0;
+  }
+
+  unsigned long long readInteger(WireType type) {
+    return type == WIRE_VARINT ? readVarint() : readNumber(type);
+  }
+
+  // Reads a nested structure.
+  WireReader readNested(WireType type) {
+    const unsigned char* start = _next;
+    skip(type);
+    if (type != WIRE_BYTES || failed()) {
+      return WireReader(start, 0, _error);
+    }
+    // Skips the length.
+    WireReader length(start, _next - start, _error);
+    length.readVarint();
+    return WireReader(length._next, _next - length._next, _error);
+  }
+
+  // Reads a string, truncated to maxLength characters.
+  void readString(WireType type, char* value, size_t maxLength) {
+    WireReader r = readNested(type);
+    size_t length = std::min((size_t)(r._end - r._next), maxLength);
+    memcpy(value, r._next, length);
+    value[length] = '\0';
+  }
+
+  std::string readString(WireType type) {
+    WireReader r = readNested(type);
+    return std::string(r._next, r._end);
+  }
+};
+
+// The numbers of the nested structures, in tag order from their first
+// number (the other fields are encoded explicitly).
+static double ApplicationSample::*const applicationSampleNumbers[] = {
+    &ApplicationSample::loadPercentage, &ApplicationSample::throughput,
+    &ApplicationSample::latency, &ApplicationSample::numTasks};
+static double LatencyPercentiles::*const latencyPercentilesNumbers[] = {
+    &LatencyPercentiles::p50, &LatencyPercentiles::p90,
+    &LatencyPercentiles::p99, &LatencyPercentiles::p999,
+    &LatencyPercentiles::max};
+static double SamplingStatistics::*const samplingStatisticsNumbers[] = {
+    &SamplingStatistics::samplingLength,
+    &SamplingStatistics::overheadPercentage};
+static double PerformanceCounters::*const performanceCountersNumbers[] = {
+    &PerformanceCounters::cycles,          &PerformanceCounters::instructions,
+    &PerformanceCounters::cacheReferences, &PerformanceCounters::cacheMisses,
+    &PerformanceCounters::branches,        &PerformanceCounters::branchMisses,
+    &PerformanceCounters::contextSwitches, &PerformanceCounters::pageFaults,
+    &PerformanceCounters::ipc,             &PerformanceCounters::cacheMissRate,
+    &PerformanceCounters::branchMissRate};
+static double SchedulingStatistics::*const schedulingStatisticsNumbers[] = {
+    &SchedulingStatistics::onCpuFraction,
+    &SchedulingStatistics::runnableFraction,
+    &SchedulingStatistics::blockedFraction,
+    &SchedulingStatistics::cpuTimeMs,
+    &SchedulingStatistics::voluntaryContextSwitches,
+    &SchedulingStatistics::involuntaryContextSwitches};
+static double PhaseStatistics::*const phaseStatisticsNumbers[] = {
+    &PhaseStatistics::durationMs, &PhaseStatistics::numTasks,
+    &PhaseStatistics::throughput, &PhaseStatistics::latency,
+    &PhaseStatistics::loadPercentage};
+
+template <typename T, size_t N>
+static void encodeNumbers(WireWriter& w, const T& obj, unsigned int firstTag,
+                          double T::*const (&numbers)[N]) {
+  for (size_t i = 0; i < N; i++) {
+    w.writeNumber(firstTag + i, obj.*numbers[i]);
+  }
+}
+
+// Decodes a number of a nested structure. Returns false if the field is not
+// one of them.
+template <typename T, size_t N>
+static bool decodeNumber(WireReader& r, unsigned int tag, WireType type,
+                         T& obj, unsigned int firstTag,
+                         double T::*const (&numbers)[N]) {
+  if (tag < firstTag || tag - firstTag >= N) {
+    return false;
+  }
+  obj.*numbers[tag - firstTag] = r.readNumber(type);
+  return true;
+}
+
+// Decodes a nested structure which only contains numbers.
+template <typename T, size_t N>
+static void decodeNumbers(WireReader r, T& obj,
+                          double T::*const (&numbers)[N]) {
+  unsigned int tag;
+  WireType type;
+  while (r.next(tag, type)) {
+    if (!decodeNumber(r, tag, type, obj, 1, numbers)) {
+      r.skip(type);
+    }
+  }
+}
+
+static void encodeApplicationSample(WireWriter& w, unsigned int tag,
+                                    const ApplicationSample& sample) {
+  size_t start = w.beginNested();
+  w.writeVarint(1, sample.inconsistent);
+  encodeNumbers(w, sample, 2, applicationSampleNumbers);
+  // The custom fields are positional, the trailing zeros are not sent.
+  size_t numCustomFields = RIFF_MAX_CUSTOM_FIELDS;
+  while (numCustomFields && !sample.customFields[numCustomFields - 1]) {
+    --numCustomFields;
+  }
+  for (size_t i = 0; i < numCustomFields; i++) {
+    w.writeNumber(6, sample.customFields[i], true);
+  }
+  w.endNested(tag, start);
+}
+
+static void decodeApplicationSample(WireReader r, ApplicationSample& sample) {
+  // The ones beyond our RIFF_MAX_CUSTOM_FIELDS are dropped.
+  size_t numCustomFields = 0;
+  unsigned int tag;
+  WireType type;
+  while (r.next(tag, type)) {
+    if (tag == 1) {
+      sample.inconsistent = r.readInteger(type);
+    } else if (tag == 6 && numCustomFields < RIFF_MAX_CUSTOM_FIELDS) {
+      sample.customFields[numCustomFields++] = r.readNumber(type);
+    } else if (!decodeNumber(r, tag, type, sample, 2,
+                             applicationSampleNumbers)) {
+      r.skip(type);
+    }
+  }
+}
+
+static void encodeRegionSample(WireWriter& w, const RegionSample& region) {
+  encodeApplicationSample(w, TAG_SAMPLE, region.sample);
+  w.writeVarint(TAG_CONTRIBUTING_THREADS, region.contributingThreads);
+  w.writeVarint(TAG_ACTIVE_THREADS, region.activeThreads);
+  w.writeVarint(TAG_NUM_STALLED, region.numStalled);
+  for (size_t i = 0; i < std::min(region.numStalled,
+                                  (unsigned int)RIFF_MAX_STALLED_THREADS);
+       i++) {
+    size_t start = w.beginNested();
+    w.writeVarint(1, region.stalled[i].threadId);
+    w.writeNumber(2, region.stalled[i].stallTimeMs);
+    w.endNested(TAG_STALLED, start, true);
+  }
+
+  size_t start = w.beginNested();
+  encodeNumbers(w, region.latencyPercentiles, 1, latencyPercentilesNumbers);
+  w.endNested(TAG_LATENCY_PERCENTILES, start);
+
+  start = w.beginNested();
+  encodeNumbers(w, region.samplingStatistics, 1, samplingStatisticsNumbers);
+  w.endNested(TAG_SAMPLING_STATISTICS, start);
+
+  const PerformanceCounters& pc = region.performanceCounters;
+  start = w.beginNested();
+  w.writeVarint(1, pc.hardware);
+  w.writeVarint(2, pc.software);
+  encodeNumbers(w, pc, 3, performanceCountersNumbers);
+  w.endNested(TAG_PERFORMANCE_COUNTERS, start);
+
+  const SchedulingStatistics& sched = region.schedulingStatistics;
+  start = w.beginNested();
+  w.writeVarint(1, sched.available);
+  encodeNumbers(w, sched, 2, schedulingStatisticsNumbers);
+  w.endNested(TAG_SCHEDULING_STATISTICS, start);
+}
+
+// Decodes a field of a RegionSample. Returns false if it is not one of them.
+static bool decodeRegionSampleField(WireReader& r, unsigned int tag,
+                                    WireType type, RegionSample& region,
+                                    size_t& numStalledRead) {
+  WireReader n = r;
+  switch (tag) {
+    case TAG_SAMPLE: {
+      decodeApplicationSample(r.readNested(type), region.sample);
+    } break;
+    case TAG_CONTRIBUTING_THREADS: {
+      region.contributingThreads = r.readInteger(type);
+    } break;
+    case TAG_ACTIVE_THREADS: {
+      region.activeThreads = r.readInteger(type);
+    } break;
+    case TAG_NUM_STALLED: {
+      region.numStalled = r.readInteger(type);
+    } break;
+    case TAG_STALLED: {
+      StalledThread st;
+      st.threadId = 0;
+      st.stallTimeMs = 0;
+      n = r.readNested(type);
+      while (n.next(tag, type)) {
+        if (tag == 1) {
+          st.threadId = n.readInteger(type);
+        } else if (tag == 2) {
+          st.stallTimeMs = n.readNumber(type);
+        } else {
+          n.skip(type);
+        }
+      }
+      if (numStalledRead < RIFF_MAX_STALLED_THREADS) {
+        region.stalled[numStalledRead++] = st;
+      }
+    } break;
+    case TAG_LATENCY_PERCENTILES: {
+      decodeNumbers(r.readNested(type), region.latencyPercentiles,
+                    latencyPercentilesNumbers);
+    } break;
+    case TAG_SAMPLING_STATISTICS: {
+      decodeNumbers(r.readNested(type), region.samplingStatistics,
+                    samplingStatisticsNumbers);
+    } break;
+    case TAG_PERFORMANCE_COUNTERS: {
+      PerformanceCounters& pc = region.performanceCounters;
+      n = r.readNested(type);
+      while (n.next(tag, type)) {
+        if (tag == 1) {
+          pc.hardware = n.readInteger(type);
+        } else if (tag == 2) {
+          pc.software = n.readInteger(type);
+        } else if (!decodeNumber(n, tag, type, pc, 3,
+                                 performanceCountersNumbers)) {
+          n.skip(type);
+        }
+      }
+    } break;
+    case TAG_SCHEDULING_STATISTICS: {
+      SchedulingStatistics& sched = region.schedulingStatistics;
+      n = r.readNested(type);
+      while (n.next(tag, type)) {
+        if (tag == 1) {
+          sched.available = n.readInteger(type);
+        } else if (!decodeNumber(n, tag, type, sched, 2,
+                                 schedulingStatisticsNumbers)) {
+          n.skip(type);
+        }
+      }
+    } break;
+    default: {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The fields not received are 0.
+static void clearRegionSample(RegionSample& region) {
+  region = RegionSample();
+  region.name[0] = '\0';
+  region.contributingThreads = 0;
+  region.activeThreads = 0;
+  region.numStalled = 0;
+}
+
+static void encodeMessage(const Message& msg, WireBuffer& buffer) {
+  WireWriter w(buffer);
+  w.writeHeader();
+  w.writeVarint(TAG_TYPE, msg.type);
+  w.writeVarint(TAG_PID, msg.pid);
+  if (msg.type == MESSAGE_TYPE_START) {
+    w.writeString(TAG_NAME, msg.name.c_str());
+    w.writeString(TAG_LABELS, msg.labels.c_str());
+  } else if (msg.type == MESSAGE_TYPE_STOP) {
+    w.writeVarint(TAG_EXECUTION_TIME, msg.executionTime);
+    w.writeVarint(TAG_TOTAL_TASKS, msg.totalTasks);
+  } else if (msg.type == MESSAGE_TYPE_SAMPLE_RES) {
+    encodeRegionSample(w, msg.sample);
+    w.writeVarint(TAG_PHASE_ID, msg.phaseId);
+    w.writeVarint(TAG_TOTAL_THREADS, msg.totalThreads);
+    for (const RegionSample& region : msg.regions) {
+      size_t start = w.beginNested();
+      w.writeString(TAG_NAME, region.name);
+      encodeRegionSample(w, region);
+      w.endNested(TAG_REGION, start, true);
+    }
+    w.writeVarint(TAG_NUM_METRIC_FIELDS, msg.numMetricFields);
+    for (double value : msg.metricValues) {
+      w.writeNumber(TAG_METRIC_VALUE, value, true);
+    }
+    w.writeVarint(TAG_FIRST_NEW_NAMED_METRIC, msg.firstNewNamedMetric);
+    for (const NamedMetricInfo& info : msg.newNamedMetrics) {
+      size_t start = w.beginNested();
+      w.writeString(1, info.name);
+      w.writeVarint(2, info.type);
+      w.endNested(TAG_NEW_NAMED_METRIC, start, true);
+    }
+    // The indexes are increasing: only the difference from the previous one
+    // is sent.
+    unsigned int lastIndex = 0;
+    for (const NamedMetricUpdate& update : msg.namedMetricUpdates) {
+      size_t start = w.beginNested();
+      w.writeVarint(1, update.index - lastIndex);
+      w.writeNumber(2, update.value);
+      w.endNested(TAG_NAMED_METRIC_UPDATE, start, true);
+      lastIndex = update.index;
+    }
+    for (const PhaseStatistics& phase : msg.phases) {
+      size_t start = w.beginNested();
+      w.writeVarint(1, phase.phaseId);
+      encodeNumbers(w, phase, 2, phaseStatisticsNumbers);
+      w.endNested(TAG_PHASE, start, true);
+    }
+    w.writeVarint(TAG_DROPPED_SAMPLES, msg.droppedSamples);
+    // The indexes of the windows follow the one of the first.
+    w.writeVarint(TAG_FIRST_WINDOW, msg.firstWindow);
+    for (const TimeSeriesWindow& window : msg.windows) {
+      size_t start = w.beginNested();
+      w.writeNumber(1, window.startMs);
+      w.writeNumber(2, window.durationMs);
+      encodeApplicationSample(w, 3, window.sample);
+      w.endNested(TAG_WINDOW, start, true);
+    }
+    w.writeVarint(TAG_OVERWRITTEN_WINDOWS, msg.overwrittenWindows);
+  }
+}
+
+// Returns false if the message is not valid (e.g. it has been encoded by an
+// incompatible version).
+static bool decodeMessage(const void* data, size_t size, Message& msg) {
+  msg = Message();
+  clearRegionSample(msg.sample);
+  WireReader r(data, size);
+  if (!r.readHeader()) {
+    return false;
+  }
+  size_t numStalledRead = 0;
+  unsigned int lastIndex = 0;
+  unsigned int tag;
+  WireType type;
+  while (r.next(tag, type)) {
+    WireReader n = r;
+    switch (tag) {
+      case TAG_TYPE: {
+        msg.type = (MessageType)r.readInteger(type);
+      } break;
+      case TAG_PID: {
+        msg.pid = r.readInteger(type);
+      } break;
+      case TAG_NAME: {
+        msg.name = r.readString(type);
+      } break;
+      case TAG_LABELS: {
+        msg.labels = r.readString(type);
+      } break;
+      case TAG_EXECUTION_TIME: {
+        msg.executionTime = r.readInteger(type);
+      } break;
+      case TAG_TOTAL_TASKS: {
+        msg.totalTasks = r.readInteger(type);
+      } break;
+      case TAG_PHASE_ID: {
+        msg.phaseId = r.readInteger(type);
+      } break;
+      case TAG_TOTAL_THREADS: {
+        msg.totalThreads = r.readInteger(type);
+      } break;
+      case TAG_REGION: {
+        msg.regions.push_back(RegionSample());
+        RegionSample& region = msg.regions.back();
+        clearRegionSample(region);
+        size_t regionStalledRead = 0;
+        n = r.readNested(type);
+        while (n.next(tag, type)) {
+          if (tag == TAG_NAME) {
+            n.readString(type, region.name, RIFF_MAX_REGION_NAME_LENGTH);
+          } else if (!decodeRegionSampleField(n, tag, type, region,
+                                              regionStalledRead)) {
+            n.skip(type);
+          }
+        }
+      } break;
+      case TAG_NUM_METRIC_FIELDS: {
+        msg.numMetricFields = r.readInteger(type);
+      } break;
+      case TAG_METRIC_VALUE: {
+        msg.metricValues.push_back(r.readNumber(type));
+      } break;
+      case TAG_FIRST_NEW_NAMED_METRIC: {
+        msg.firstNewNamedMetric = r.readInteger(type);
+      } break;
+      case TAG_NEW_NAMED_METRIC: {
+        NamedMetricInfo info;
+        info.name[0] = '\0';
+        info.type = NAMED_METRIC_COUNTER;
+        n = r.readNested(type);
+        while (n.next(tag, type)) {
+          if (tag == 1) {
+            n.readString(type, info.name, RIFF_MAX_NAMED_METRIC_NAME_LENGTH);
+          } else if (tag == 2) {
+            info.type = (NamedMetricType)n.readInteger(type);
           } else {
-            usleep((application->_configuration.samplingLengthMs -
-                    timeFromConsolidation) *
-                   1000);
+            n.skip(type);
           }
         }
-
-        ThreadData& toAdd = application->_threadData->at(i);
-        if (!*toAdd.consolidate) {
-          ApplicationSample& sample = toAdd.consolidatedSample;
-          if (sample.inconsistent) {
-            ++inconsistentSamples;
+        msg.newNamedMetrics.push_back(info);
+      } break;
+      case TAG_NAMED_METRIC_UPDATE: {
+        NamedMetricUpdate update;
+        update.index = lastIndex;
+        update.value = 0;
+        n = r.readNested(type);
+        while (n.next(tag, type)) {
+          if (tag == 1) {
+            update.index = lastIndex + n.readInteger(type);
+          } else if (tag == 2) {
+            update.value = n.readNumber(type);
           } else {
-            sample.latency /= sample.numTasks;
-            msg.payload.sample.loadPercentage += sample.loadPercentage;
-            msg.payload.sample.latency += sample.latency;
+            n.skip(type);
           }
-          msg.payload.sample.throughput += sample.throughput;
-          msg.payload.sample.numTasks += sample.numTasks;
-
-          ++updatedSamples;
-          for (size_t j = 0; j < RIFF_MAX_CUSTOM_FIELDS; j++) {
-            // TODO How to manage not-yet-stored custom values?
-            customVec[j].push_back(sample.customFields[j]);
+        }
+        msg.namedMetricUpdates.push_back(update);
+        lastIndex = update.index;
+      } break;
+      case TAG_PHASE: {
+        PhaseStatistics phase;
+        n = r.readNested(type);
+        while (n.next(tag, type)) {
+          if (tag == 1) {
+            phase.phaseId = n.readInteger(type);
+          } else if (!decodeNumber(n, tag, type, phase, 2,
+                                   phaseStatisticsNumbers)) {
+            n.skip(type);
           }
-          /**
-           * We need to reset the consolidated sample. Otherwise,
-           * when stop command is received, we could send
-           * again this sample even if it was not updated.
-           **/
-          toAdd.consolidatedSample = ApplicationSample();
         }
+        msg.phases.push_back(phase);
+      } break;
+      case TAG_DROPPED_SAMPLES: {
+        msg.droppedSamples = r.readInteger(type);
+      } break;
+      case TAG_FIRST_WINDOW: {
+        msg.firstWindow = r.readInteger(type);
+      } break;
+      case TAG_WINDOW: {
+        msg.windows.push_back(TimeSeriesWindow());
+        TimeSeriesWindow& window = msg.windows.back();
+        n = r.readNested(type);
+        while (n.next(tag, type)) {
+          if (tag == 1) {
+            window.startMs = n.readNumber(type);
+          } else if (tag == 2) {
+            window.durationMs = n.readNumber(type);
+          } else if (tag == 3) {
+            decodeApplicationSample(n.readNested(type), window.sample);
+          } else {
+            n.skip(type);
+          }
+        }
+      } break;
+      case TAG_OVERWRITTEN_WINDOWS: {
+        msg.overwrittenWindows = r.readInteger(type);
+      } break;
+      default: {
+        if (!decodeRegionSampleField(r, tag, type, msg.sample,
+                                     numStalledRead)) {
+          r.skip(type);
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < msg.windows.size(); i++) {
+    msg.windows[i].index = msg.firstWindow + i;
+  }
+  return !r.failed();
+}
+
+// Encodes a message directly in the nanomsg message which is sent.
+// 'sizeHint' is the expected size of the message, updated with its actual
+// size.
+static int sendMessage(nn::socket& socket, const Message& msg, int flags,
+                       size_t& sizeHint) {
+  WireBuffer buffer(sizeHint);
+  encodeMessage(msg, buffer);
+  sizeHint = buffer.size();
+  return buffer.send(socket, flags);
+}
+
+static int sendMessage(nn::socket& socket, const Message& msg, int flags) {
+  size_t sizeHint = 0;
+  return sendMessage(socket, msg, flags, sizeHint);
+}
+
+// Receives and decodes a message, in place in the nanomsg message. Returns
+// -1 if nothing has been received (with NN_DONTWAIT), 0 if the message is
+// not valid, or its size.
+static int receiveMessage(nn::socket& socket, Message& msg, int flags) {
+  void* buffer = NULL;
+  int r = socket.recv(&buffer, NN_MSG, flags);
+  if (r < 0) {
+    return r;
+  }
+  bool valid = decodeMessage(buffer, r, msg);
+  nn::freemsg(buffer);
+  return valid ? r : 0;
+}
+
+// Returns when a timeout (milliseconds) expires (CLOCK_MONOTONIC,
+// nanoseconds), or 0 if it is negative (i.e. it never expires).
+static unsigned long long getDeadline(double timeoutMs) {
+  if (timeoutMs < 0) {
+    return 0;
+  }
+  return getMonotonicTimeNs(CLOCK_MONOTONIC) + timeoutMs * 1000000.0;
+}
+
+// poll() until the deadline (see getDeadline()), even if interrupted by a
+// signal. Returns 0 if the deadline expired.
+static int pollUntil(struct pollfd* fds, nfds_t nfds,
+                     unsigned long long deadline) {
+  while (true) {
+    int timeoutMs = -1;
+    if (deadline) {
+      unsigned long long now = getMonotonicTimeNs(CLOCK_MONOTONIC);
+      if (now >= deadline) {
+        return poll(fds, nfds, 0);
+      }
+      timeoutMs = std::min((deadline - now + 999999) / 1000000,
+                           (unsigned long long)std::numeric_limits<int>::max());
+    }
+    int r = poll(fds, nfds, timeoutMs);
+    if (r > 0 || (r < 0 && errno != EINTR)) {
+      return r;
+    }
+  }
+}
+
+// Returns the file descriptor which is readable when the socket is readable
+// (NN_RCVFD) or writable (NN_SNDFD).
+static int getSocketFd(const nn::socket& socket, int option) {
+  int fd = -1;
+  size_t size = sizeof(fd);
+  const_cast<nn::socket&>(socket).getsockopt(NN_SOL_SOCKET, option, &fd,
+                                             &size);
+  return fd;
+}
+
+// Returns true if the socket has at least a peer (e.g. if a monitor is
+// attached to the application).
+static bool isConnected(nn::socket& socket) {
+  return socket.get_statistic(NN_STAT_CURRENT_CONNECTIONS) > 0;
+}
+
+// Sends a message, waiting until the deadline (see getDeadline()) for the
+// socket to be writable. Returns -1 if the deadline expired.
+static int sendMessageUntil(nn::socket& socket, const Message& msg,
+                            unsigned long long deadline, size_t& sizeHint) {
+  struct pollfd pfd;
+  pfd.fd = getSocketFd(socket, NN_SNDFD);
+  pfd.events = POLLIN;
+  int r;
+  while ((r = sendMessage(socket, msg, NN_DONTWAIT, sizeHint)) < 0) {
+    if (pollUntil(&pfd, 1, deadline) <= 0) {
+      return -1;
+    }
+  }
+  return r;
+}
+
+static int sendMessageUntil(nn::socket& socket, const Message& msg,
+                            unsigned long long deadline) {
+  size_t sizeHint = 0;
+  return sendMessageUntil(socket, msg, deadline, sizeHint);
+}
+
+// Receives a message as receiveMessage(), waiting for it until the deadline
+// (see getDeadline()). Returns -1 if the deadline expired. Not for the
+// respondents, whose recv() cancels the current survey.
+static int receiveMessageUntil(nn::socket& socket, Message& msg,
+                               unsigned long long deadline) {
+  struct pollfd pfd;
+  pfd.fd = getSocketFd(socket, NN_RCVFD);
+  pfd.events = POLLIN;
+  int r;
+  while ((r = receiveMessage(socket, msg, NN_DONTWAIT)) < 0) {
+    if (pollUntil(&pfd, 1, deadline) <= 0) {
+      return -1;
+    }
+  }
+  return r;
+}
+
+void* applicationSupportThread(void* data) {
+  ApplicationBase* application = static_cast<ApplicationBase*>(data);
+  // The configuration cannot change once the application started.
+  pthread_mutex_lock(&application->_mutex);
+  while (!application->_started && !application->_supportStop) {
+    pthread_cond_wait(&application->_supportCond, &application->_mutex);
+  }
+  pthread_mutex_unlock(&application->_mutex);
+  if (application->_configuration.timeSeriesIntervalMs) {
+    application->startTimeSeries();
+  }
+  if (application->_configuration.pushIntervalMs) {
+    application->pushSamples();
+  } else {
+    application->replySamples();
+  }
+  return NULL;
+}
+
+void ApplicationBase::consolidate(RegionBase& region,
+                                  unsigned long long deadline,
+                                  RegionSample& result,
+                                  double* metricValues) {
+  memset(result.name, 0, sizeof(result.name));
+  region._name.copy(result.name, RIFF_MAX_REGION_NAME_LENGTH);
+  ApplicationSample& total = result.sample;
+  total = ApplicationSample();  // Set sample to all zeros
+
+  result.performanceCounters = PerformanceCounters();
+  SchedulingStatistics& scheduling = result.schedulingStatistics;
+  scheduling = SchedulingStatistics();
+  size_t scheduledThreads = 0;
+
+  // Add the samples of all the threads.
+  size_t updatedSamples = 0, inconsistentSamples = 0, startedThreads = 0;
+  std::vector<ThreadData*> threads = region.getStartedThreads();
+  size_t numThreads = threads.size();
+  std::vector<double>* customVec = _customValues;
+  for (size_t j = 0; j < RIFF_MAX_CUSTOM_FIELDS; j++) {
+    customVec[j].clear();
+  }
+  std::vector<ThreadSnapshot> snapshots(numThreads);
+  std::vector<bool> exited(numThreads);
+  std::vector<StalledThread> stalled;
+  std::vector<unsigned long long> histogram(RIFF_LATENCY_HISTOGRAM_BUCKETS, 0);
+  double totalTime = 0, recordedPairs = 0;
+
+  // The sample of a thread is the difference between the counters it
+  // published last and the ones we read at the previous request. If some
+  // thread did not publish anything since then, we wait for it until
+  // the deadline expires.
+  unsigned long long now = getCurrentTicks();
+  while (true) {
+    size_t missing = 0;
+    for (size_t i = 0; i < numThreads; i++) {
+      // Read before the snapshot, so that the last counters published
+      // by an exited thread are in the snapshot.
+      exited[i] = threads[i]->exited.load(std::memory_order_acquire);
+      threads[i]->read(snapshots[i]);
+      if (!exited[i] && !isUpdated(snapshots[i], threads[i]->lastRead)) {
+        ++missing;
+      }
+    }
+    if (!missing || now >= deadline || _supportStop) {
+      break;
+    }
+    usleep(std::min(1000.0, (deadline - now) * nsPerTick / 1000.0));
+    now = getCurrentTicks();
+  }
+  // The time series is cut at the same counters, so that its windows since
+  // the previous sample add up to this one.
+  if (&region == _defaultRegion && _configuration.timeSeriesIntervalMs) {
+    cutWindow(threads, snapshots);
+  }
+
+  for (size_t i = 0; i < numThreads; i++) {
+    const ThreadSnapshot& snapshot = snapshots[i];
+    ThreadSnapshot& last = threads[i]->lastRead;
+    bool updated = isUpdated(snapshot, last);
+    if (exited[i] && !updated) {
+      continue;
+    }
+    ++startedThreads;
+    // Also for stalled threads, to tell whether they are blocked.
+    if (_configuration.schedulingStatistics && !exited[i] &&
+        threads[i]->addScheduling(scheduling)) {
+      ++scheduledThreads;
+    }
+    if (!updated) {
+      StalledThread st;
+      st.threadId = threads[i]->threadId;
+      unsigned long long lastActivity =
+          threads[i]->lastActivity.load(std::memory_order_relaxed);
+      st.stallTimeMs =
+          lastActivity < now ? (now - lastActivity) * nsPerTick / 1000000.0
+                             : 0;
+      stalled.push_back(st);
+      continue;
+    }
+    if (!last.timestamp) {
+      last.timestamp = snapshot.startTime;
+    }
+
+    ApplicationSample sample;
+    double sampleTime =
+        computeThreadSample(snapshot, last, nsPerTick,
+                            _configuration.consistencyThreshold, sample);
+    double recorded = snapshot.recordedPairs - last.recordedPairs;
+    if (&region == _defaultRegion) {
+      addPhaseCounters(snapshot, last);
+    }
+    last = snapshot;
+
+    if (sample.inconsistent) {
+      ++inconsistentSamples;
+    } else {
+      total.loadPercentage += sample.loadPercentage;
+      total.latency += sample.latency;
+    }
+    total.throughput += sample.throughput;
+    total.numTasks += sample.numTasks;
+    totalTime += sampleTime;
+    recordedPairs += recorded;
+
+    ++updatedSamples;
+    threads[i]->addPerfEvents(result.performanceCounters);
+    for (size_t j = 0; j < RIFF_MAX_CUSTOM_FIELDS; j++) {
+      customVec[j].push_back(snapshot.customFields[j]);
+    }
+
+    // The histogram is read without synchronization, so it may also count
+    // some tasks not yet published. They will not be counted again in the
+    // next sample.
+    unsigned long long* lastHistogram = threads[i]->lastReadHistogram;
+    for (size_t j = 0; j < RIFF_LATENCY_HISTOGRAM_BUCKETS; j++) {
+      unsigned long long count =
+          threads[i]->latencyHistogram[j].load(std::memory_order_relaxed);
+      histogram[j] += count - lastHistogram[j];
+      lastHistogram[j] = count;
+    }
+  }
+  computeLatencyPercentiles(histogram, result.latencyPercentiles);
+
+  // Merge the metrics handed off by the threads, including the ones which
+  // did not publish anything in time, and the exited ones (which handed
+  // off their last metrics before exiting).
+  if (_metricSchema) {
+    _metricSchema->init(region._metrics.data());
+    for (size_t i = 0; i < numThreads; i++) {
+      int state = METRICS_FULL;
+      if (threads[i]->metricsState.compare_exchange_strong(
+              state, METRICS_READING, std::memory_order_acquire)) {
+        _metricSchema->merge(region._metrics.data(),
+                             threads[i]->handedOffMetrics);
+        threads[i]->metricsState.store(METRICS_EMPTY,
+                                       std::memory_order_release);
+      }
+    }
+    _metricSchema->serialize(region._metrics.data(), metricValues);
+  }
+
+  PerformanceCounters& perf = result.performanceCounters;
+  if (perf.cycles) {
+    perf.ipc = perf.instructions / perf.cycles;
+  }
+  if (perf.cacheReferences) {
+    perf.cacheMissRate = perf.cacheMisses / perf.cacheReferences;
+  }
+  if (perf.branches) {
+    perf.branchMissRate = perf.branchMisses / perf.branches;
+  }
+
+  if (scheduledThreads) {
+    scheduling.available = true;
+    scheduling.onCpuFraction /= scheduledThreads;
+    scheduling.runnableFraction /= scheduledThreads;
+    scheduling.blockedFraction /= scheduledThreads;
+  }
+
+  SamplingStatistics& sampling = result.samplingStatistics;
+  sampling = SamplingStatistics();
+  if (recordedPairs) {
+    sampling.samplingLength = total.numTasks / recordedPairs;
+  }
+  if (totalTime) {
+    sampling.overheadPercentage =
+        (recordedPairs * _recordedPairCost +
+         total.numTasks * _skippedPairCost) /
+        totalTime * 100.0;
+  }
+
+  for (size_t i = 0; i < numThreads; i++) {
+    if (exited[i]) {
+      region.removeExitedThread(threads[i]);
+    }
+  }
+
+  // If at least one thread is progressing.
+  if (updatedSamples) {
+    // Threads which did not publish anything since the previous request
+    // (e.g. because they are executing a long task) are assumed to have
+    // the same throughput of the others.
+    if (_configuration.adjustThroughput && updatedSamples != startedThreads) {
+      total.throughput += (total.throughput / updatedSamples) *
+                          (startedThreads - updatedSamples);
+    }
+
+    // If we collected only inconsistent samples, we notify that latency and
+    // load are inconsistent.
+    if (inconsistentSamples == updatedSamples || _inconsistentSample) {
+      total.inconsistent = true;
+    } else {
+      total.loadPercentage /= (updatedSamples - inconsistentSamples);
+      total.latency /= (updatedSamples - inconsistentSamples);
+    }
+  }
+
+  // Aggregate custom values.
+  for (size_t i = 0; i < RIFF_MAX_CUSTOM_FIELDS; i++) {
+    if (_aggregator) {
+      total.customFields[i] = _aggregator->aggregate(i, customVec[i]);
+    }else{
+        // Check needed for a corner termination case
+        if(!customVec[i].empty()){
+            total.customFields[i] = customVec[i][0];
+        }
+    }
+  }
+
+  result.contributingThreads = updatedSamples;
+  result.activeThreads = startedThreads;
+  std::sort(stalled.begin(), stalled.end(),
+            [](const StalledThread& a, const StalledThread& b) {
+              return a.stallTimeMs > b.stallTimeMs;
+            });
+  result.numStalled = stalled.size();
+  for (size_t i = 0; i < stalled.size() && i < RIFF_MAX_STALLED_THREADS;
+       i++) {
+    result.stalled[i] = stalled[i];
+  }
+}
+
+RegionBase::RegionBase(ApplicationBase* application, const std::string& name,
+                       size_t numThreads, ulong samplingLength)
+    : _application(application),
+      _name(name),
+      _id(nextRegionId.fetch_add(1)),
+      _numThreads(numThreads),
+      _samplingLength(samplingLength),
+      _nextThreadId(numThreads),
+      _exitedTasks(0),
+      _exitedFirstBegin(std::numeric_limits<unsigned long long>::max()),
+      _exitedLastEnd(0) {
+  const MetricSchema* schema = application->_metricSchema;
+  if (schema) {
+    _metrics.resize((schema->size + sizeof(double) - 1) / sizeof(double));
+  }
+  pthread_mutex_init(&_mutex, NULL);
+  _threadData = new std::atomic<ThreadData*>[numThreads];
+  for (size_t i = 0; i < numThreads; i++) {
+    _threadData[i] = NULL;
+  }
+}
+
+RegionBase::~RegionBase() {
+  for (size_t i = 0; i < _numThreads; i++) {
+    ThreadData* tData = _threadData[i];
+    if (tData) {
+      tData->release();
+    }
+  }
+  delete[] _threadData;
+  for (ThreadData* tData : _registeredThreadData) {
+    tData->release();
+  }
+  pthread_mutex_destroy(&_mutex);
+}
+
+// The support thread waits on it with absolute CLOCK_MONOTONIC timeouts.
+static void initSupportCond(pthread_cond_t* cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static bool isRespondent(nn::socket& socket) {
+  int protocol = 0;
+  size_t size = sizeof(protocol);
+  socket.getsockopt(NN_SOL_SOCKET, NN_PROTOCOL, &protocol, &size);
+  return protocol == NN_RESPONDENT;
+}
+
+ApplicationBase::ApplicationBase(const std::string& channelName,
+                                 size_t numThreads, Aggregator* aggregator)
+    : _channel(new nn::socket(AF_SP, NN_PAIR)),
+      _channelRef(*_channel),
+      _respondent(false),
+      _started(false),
+      _aggregator(aggregator),
+      _numThreads(numThreads),
+      _defaultRegion(NULL),
+      _executionTime(0),
+      _totalTasks(0),
+      _phaseId(0),
+      _totalThreads(0),
+      _inconsistentSample(false),
+      _epoch(0),
+      _ticksPerNs(1.0 / getNsPerTick()),
+      _skippedPairCost(0),
+      _recordedPairCost(0),
+      _metricSchema(NULL),
+      _sentNamedMetrics(0),
+      _nextPhaseRecord(0),
+      _sharedSegment(NULL),
+      _sampleSize(0),
+      _nextWindow(0),
+      _sentWindows(0),
+      _timeSeriesStart(0),
+      _windowStart(0),
+      _windowEnd(0),
+      _stopFd(eventfd(0, EFD_CLOEXEC)),
+      _stopDeadline(0) {
+  if (_stopFd < 0) {
+    throw std::runtime_error("Impossible to create the eventfd.");
+  }
+  _chid = _channelRef.connect(channelName.c_str());
+  assert(_chid >= 0);
+  pthread_mutex_init(&_mutex, NULL);
+  initSupportCond(&_supportCond);
+  _supportStop = false;
+}
+
+ApplicationBase::ApplicationBase(nn::socket& socket, unsigned int chid,
+                                 size_t numThreads, Aggregator* aggregator)
+    : _channel(NULL),
+      _channelRef(socket),
+      _chid(chid),
+      _respondent(isRespondent(socket)),
+      _started(false),
+      _aggregator(aggregator),
+      _numThreads(numThreads),
+      _defaultRegion(NULL),
+      _executionTime(0),
+      _totalTasks(0),
+      _phaseId(0),
+      _totalThreads(0),
+      _inconsistentSample(false),
+      _epoch(0),
+      _ticksPerNs(1.0 / getNsPerTick()),
+      _skippedPairCost(0),
+      _recordedPairCost(0),
+      _metricSchema(NULL),
+      _sentNamedMetrics(0),
+      _nextPhaseRecord(0),
+      _sharedSegment(NULL),
+      _sampleSize(0),
+      _nextWindow(0),
+      _sentWindows(0),
+      _timeSeriesStart(0),
+      _windowStart(0),
+      _windowEnd(0),
+      _stopFd(eventfd(0, EFD_CLOEXEC)),
+      _stopDeadline(0) {
+  if (_stopFd < 0) {
+    throw std::runtime_error("Impossible to create the eventfd.");
+  }
+  pthread_mutex_init(&_mutex, NULL);
+  initSupportCond(&_supportCond);
+  _supportStop = false;
+}
+
+void ApplicationBase::start() {
+  _defaultRegion = createRegion("", _numThreads);
+  // Pthread Create must be the last thing we do in constructor
+  pthread_create(&_supportTid, NULL, applicationSupportThread, (void*)this);
+}
+
+ApplicationBase::~ApplicationBase() {
+  if (_channel) {
+    _channel->shutdown(_chid);
+    delete _channel;
+  }
+  delete _defaultRegion;
+  for (const auto& r : _regions) {
+    delete r.second;
+  }
+  if (_sharedSegment) {
+    // The monitors which already mapped it can still read it.
+    unlink(getSharedSegmentName(getpid()).c_str());
+    releaseSharedSegment();
+  }
+  close(_stopFd);
+  pthread_cond_destroy(&_supportCond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+ThreadData* ThreadData::allocate(unsigned int threadId, unsigned int refs,
+                                 const MetricSchema* metricSchema) {
+  // Each thread gets its own pages, so that the data of different threads
+  // never share a cache line and is allocated on the NUMA node of the
+  // thread which first touches it (i.e. this one). The two copies of the
+  // metrics are in different cache lines, since they are written by
+  // different threads.
+  static const long pageSize = sysconf(_SC_PAGESIZE);
+  size_t metricsSize = 0;
+  if (metricSchema) {
+    metricsSize = (metricSchema->size + LEVEL1_DCACHE_LINESIZE - 1) /
+                  LEVEL1_DCACHE_LINESIZE * LEVEL1_DCACHE_LINESIZE;
+  }
+  void* mem = NULL;
+  if (posix_memalign(&mem, std::max(pageSize, (long)LEVEL1_DCACHE_LINESIZE),
+                     sizeof(ThreadData) + 2 * metricsSize)) {
+    throw std::runtime_error("Impossible to allocate thread data.");
+  }
+  ThreadData* tData = new (mem) ThreadData();
+  tData->threadId = threadId;
+  tData->refs = refs;
+  tData->tid = syscall(SYS_gettid);
+  pthread_getcpuclockid(pthread_self(), &tData->cpuClock);
+  if (metricSchema) {
+    tData->metricSchema = metricSchema;
+    tData->metrics = static_cast<char*>(mem) + sizeof(ThreadData);
+    tData->handedOffMetrics = static_cast<char*>(tData->metrics) + metricsSize;
+    metricSchema->init(tData->metrics);
+    metricSchema->init(tData->handedOffMetrics);
+  }
+  // splitmix64, so that the random generators of the threads never start
+  // from the same (or a zero) state.
+  unsigned long long seed =
+      getCurrentTicks() ^ (unsigned long long)(uintptr_t)tData;
+  seed += 0x9E3779B97F4A7C15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+  seed ^= seed >> 31;
+  tData->randomState = seed ? seed : 1;
+  return tData;
+}
+
+bool ThreadData::handOffMetrics() {
+  int state = metricsState.load(std::memory_order_acquire);
+  if (state == METRICS_EMPTY) {
+    metricSchema->init(handedOffMetrics);
+  } else if (state != METRICS_FULL ||
+             !metricsState.compare_exchange_strong(
+                 state, METRICS_EMPTY, std::memory_order_acquire)) {
+    // The support thread is merging them.
+    return false;
+  }
+  // If still FULL, the support thread did not merge them yet, so we add
+  // the new ones.
+  metricSchema->merge(handedOffMetrics, metrics);
+  metricSchema->init(metrics);
+  metricsState.store(METRICS_FULL, std::memory_order_release);
+  return true;
+}
+
+void ThreadData::release() {
+  if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    leaveSharedSlot();
+    for (size_t i = 0; i < RIFF_NAMED_METRICS_CHUNKS; i++) {
+      delete[] namedValues[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < 2; i++) {
+      if (perfGroups[i] != -1) {
+        close(perfGroups[i]);
+      }
+    }
+    this->~ThreadData();
+    free(this);
+  }
+}
+
+void ThreadData::leaveSharedSlot() {
+  if (sharedSlot) {
+    sharedSlot->state.store(SHARED_SLOT_EXITED, std::memory_order_release);
+    sharedSlot = NULL;
+    releaseSharedSegment();
+  }
+}
+
+// The events counted when ApplicationConfiguration::perfCounters is set,
+// and the perf_event group (0 for hardware, 1 for software) of each one.
+static const struct {
+  unsigned int group;
+  unsigned int type;
+  unsigned long long config;
+} perfEvents[RIFF_PERF_EVENTS] = {
+    {0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {1, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {1, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}};
+
+// Returns the field of 'counters' counting an event of perfEvents.
+static double& getPerfEventCount(PerformanceCounters& counters,
+                                 size_t event) {
+  double* fields[RIFF_PERF_EVENTS] = {
+      &counters.cycles,          &counters.instructions,
+      &counters.cacheReferences, &counters.cacheMisses,
+      &counters.branches,        &counters.branchMisses,
+      &counters.contextSwitches, &counters.pageFaults};
+  return *fields[event];
+}
+
+// Opens an event counting the calling thread on any CPU. Returns -1 if it
+// is not available.
+static int openPerfEvent(unsigned int type, unsigned long long config,
+                         bool excludeKernel, int groupFd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_kernel = excludeKernel;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, groupFd,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+void ThreadData::openPerfEvents() {
+  for (unsigned int g = 0; g < 2; g++) {
+    // Context switches happen in the kernel, so software events are only
+    // counted in user space if we are not allowed to count them in the
+    // kernel. Hardware events are always only counted in user space.
+    bool excludeKernel = (g == 0);
+    for (size_t i = 0; i < RIFF_PERF_EVENTS; i++) {
+      if (perfEvents[i].group != g) {
+        continue;
+      }
+      int fd = openPerfEvent(perfEvents[i].type, perfEvents[i].config,
+                             excludeKernel, perfGroups[g]);
+      if (fd == -1 && !excludeKernel && perfGroups[g] == -1) {
+        excludeKernel = true;
+        fd = openPerfEvent(perfEvents[i].type, perfEvents[i].config,
+                           excludeKernel, perfGroups[g]);
+      }
+      if (fd == -1) {
+        // Not supported by this CPU (or no PMU at all).
+        continue;
+      }
+      if (perfGroups[g] == -1) {
+        perfGroups[g] = fd;
+      }
+      perfGroupEvents[g][perfGroupSizes[g]++] = i;
+    }
+  }
+}
+
+void ThreadData::addPerfEvents(PerformanceCounters& counters) {
+  for (unsigned int g = 0; g < 2; g++) {
+    if (perfGroups[g] == -1) {
+      continue;
+    }
+    // Number of events, time enabled, time running and then the values.
+    unsigned long long buffer[3 + RIFF_PERF_EVENTS];
+    ssize_t size = (3 + perfGroupSizes[g]) * sizeof(unsigned long long);
+    if (::read(perfGroups[g], buffer, size) != size) {
+      continue;
+    }
+    // If the PMU is shared with other groups, events are only counted
+    // for part of the time, so we scale them.
+    double scale = 1.0;
+    if (buffer[2] && buffer[2] < buffer[1]) {
+      scale = (double)buffer[1] / buffer[2];
+    }
+    for (size_t i = 0; i < perfGroupSizes[g]; i++) {
+      unsigned int event = perfGroupEvents[g][i];
+      double value = buffer[3 + i] * scale;
+      getPerfEventCount(counters, event) +=
+          std::max(0.0, value - lastReadPerfEvents[event]);
+      lastReadPerfEvents[event] = value;
+    }
+    (g ? counters.software : counters.hardware) = true;
+  }
+}
+
+bool ThreadData::readScheduling(double values[4]) const {
+  struct timespec cpuTime;
+  // Fails if the thread terminated.
+  if (clock_gettime(cpuClock, &cpuTime)) {
+    return false;
+  }
+  values[0] = cpuTime.tv_sec * 1000000000.0 + cpuTime.tv_nsec;
+  // Time on CPU, time waiting in a run queue and number of time slices.
+  std::string prefix = "/proc/self/task/" + std::to_string(tid) + "/";
+  std::ifstream schedstat(prefix + "schedstat");
+  double onCpu = 0;
+  if (!(schedstat >> onCpu >> values[1])) {
+    return false;
+  }
+  std::ifstream status(prefix + "status");
+  std::string line;
+  int found = 0;
+  while (found < 2 && std::getline(status, line)) {
+    if (!line.compare(0, 24, "voluntary_ctxt_switches:")) {
+      values[2] = atof(line.c_str() + 24);
+      ++found;
+    } else if (!line.compare(0, 27, "nonvoluntary_ctxt_switches:")) {
+      values[3] = atof(line.c_str() + 27);
+      ++found;
+    }
+  }
+  return found == 2;
+}
+
+void ThreadData::initScheduling() {
+  if (readScheduling(lastReadScheduling)) {
+    lastReadSchedulingTime = getMonotonicTimeNs(CLOCK_MONOTONIC);
+  }
+}
+
+bool ThreadData::addScheduling(SchedulingStatistics& statistics) {
+  double values[4];
+  if (!readScheduling(values)) {
+    return false;
+  }
+  unsigned long long now = getMonotonicTimeNs(CLOCK_MONOTONIC);
+  bool first = !lastReadSchedulingTime;
+  double elapsed = now - lastReadSchedulingTime;
+  double cpuTime = values[0] - lastReadScheduling[0];
+  double waitTime = values[1] - lastReadScheduling[1];
+  double voluntary = values[2] - lastReadScheduling[2];
+  double involuntary = values[3] - lastReadScheduling[3];
+  for (size_t i = 0; i < 4; i++) {
+    lastReadScheduling[i] = values[i];
+  }
+  lastReadSchedulingTime = now;
+  if (first || !elapsed) {
+    return false;
+  }
+  statistics.cpuTimeMs += cpuTime / 1000000.0;
+  statistics.voluntaryContextSwitches += voluntary;
+  statistics.involuntaryContextSwitches += involuntary;
+  // The counters are not read at the same time, so the fractions are
+  // clamped to [0, 1].
+  double onCpu = std::min(1.0, cpuTime / elapsed);
+  double runnable = std::min(1.0 - onCpu, waitTime / elapsed);
+  statistics.onCpuFraction += onCpu;
+  statistics.runnableFraction += runnable;
+  statistics.blockedFraction += 1.0 - onCpu - runnable;
+  return true;
+}
+
+std::atomic<double>* ThreadData::allocateNamedValues(size_t chunk) {
+  std::atomic<double>* values =
+      new std::atomic<double>[RIFF_NAMED_METRICS_CHUNK_SIZE];
+  for (size_t i = 0; i < RIFF_NAMED_METRICS_CHUNK_SIZE; i++) {
+    values[i].store(0, std::memory_order_relaxed);
+  }
+  namedValues[chunk].store(values, std::memory_order_release);
+  return values;
+}
+
+void ThreadData::addNamedValues(std::vector<double>& values) const {
+  for (size_t i = 0; i < RIFF_NAMED_METRICS_CHUNKS; i++) {
+    size_t first = i * RIFF_NAMED_METRICS_CHUNK_SIZE;
+    if (first >= values.size()) {
+      break;
+    }
+    const std::atomic<double>* chunk =
+        namedValues[i].load(std::memory_order_acquire);
+    if (!chunk) {
+      continue;
+    }
+    size_t last = std::min(values.size(),
+                           first + RIFF_NAMED_METRICS_CHUNK_SIZE);
+    for (size_t j = first; j < last; j++) {
+      values[j] += chunk[j - first].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+size_t ThreadData::getNumNamedValues() const {
+  for (size_t i = RIFF_NAMED_METRICS_CHUNKS; i > 0; i--) {
+    if (namedValues[i - 1].load(std::memory_order_acquire)) {
+      return i * RIFF_NAMED_METRICS_CHUNK_SIZE;
+    }
+  }
+  return 0;
+}
+
+void RegionBase::initThreadData(ThreadData* tData) {
+  if (_application->_configuration.perfCounters) {
+    tData->openPerfEvents();
+  }
+  if (_application->_configuration.schedulingStatistics) {
+    tData->initScheduling();
+  }
+  if (this == _application->_defaultRegion && _application->_sharedSegment) {
+    tData->sharedSlot = acquireSharedSlot(_application->_sharedSegment);
+  }
+  tData->samplingLength = _samplingLength;
+  tData->periodLength = _samplingLength;
+}
+
+ThreadData* RegionBase::allocateThreadData(unsigned int threadId) {
+  checkThreadId(threadId);
+  ThreadData* tData =
+      ThreadData::allocate(threadId, 1, _application->_metricSchema);
+  initThreadData(tData);
+  _threadData[threadId].store(tData, std::memory_order_release);
+  return tData;
+}
+
+ThreadData* RegionBase::registerThread() {
+  ThreadDataCache& cache =
+      threadDataCache[_id & (RIFF_THREAD_DATA_CACHE_SIZE - 1)];
+  // The thread may have already registered, but used other regions
+  // in the meanwhile.
+  for (const auto& r : threadRegistrations.entries) {
+    if (r.first == _id) {
+      cache.regionId = _id;
+      cache.data = r.second;
+      return r.second;
+    }
+  }
+  pthread_mutex_lock(&_mutex);
+  unsigned int threadId = _nextThreadId++;
+  pthread_mutex_unlock(&_mutex);
+  // Owned by both this object and the thread.
+  ThreadData* tData =
+      ThreadData::allocate(threadId, 2, _application->_metricSchema);
+  initThreadData(tData);
+  pthread_mutex_lock(&_mutex);
+  _registeredThreadData.push_back(tData);
+  pthread_mutex_unlock(&_mutex);
+  threadRegistrations.entries.push_back(std::make_pair(_id, tData));
+  cache.regionId = _id;
+  cache.data = tData;
+  return tData;
+}
+
+std::vector<ThreadData*> RegionBase::getStartedThreads() {
+  std::vector<ThreadData*> threads;
+  for (size_t i = 0; i < _numThreads; i++) {
+    ThreadData* tData = _threadData[i].load(std::memory_order_acquire);
+    if (tData && tData->lastActivity.load(std::memory_order_relaxed)) {
+      threads.push_back(tData);
+    }
+  }
+  pthread_mutex_lock(&_mutex);
+  for (ThreadData* tData : _registeredThreadData) {
+    if (tData->lastActivity.load(std::memory_order_relaxed)) {
+      threads.push_back(tData);
+    }
+  }
+  pthread_mutex_unlock(&_mutex);
+  return threads;
+}
+
+void RegionBase::removeExitedThread(ThreadData* tData) {
+  pthread_mutex_lock(&_mutex);
+  _registeredThreadData.erase(std::find(_registeredThreadData.begin(),
+                                        _registeredThreadData.end(), tData));
+  _exitedTasks += tData->totalTasks + tData->currentSample;
+  if (tData->firstBegin) {
+    _exitedFirstBegin = std::min(_exitedFirstBegin, tData->firstBegin);
+  }
+  _exitedLastEnd = std::max(_exitedLastEnd, tData->lastEnd);
+  size_t numNamedValues = tData->getNumNamedValues();
+  if (_exitedNamedValues.size() < numNamedValues) {
+    _exitedNamedValues.resize(numNamedValues, 0);
+  }
+  tData->addNamedValues(_exitedNamedValues);
+  pthread_mutex_unlock(&_mutex);
+  tData->release();
+}
+
+void RegionBase::removeExitedThreads() {
+  std::vector<ThreadData*> exited;
+  pthread_mutex_lock(&_mutex);
+  for (ThreadData* tData : _registeredThreadData) {
+    if (tData->exited.load(std::memory_order_acquire)) {
+      exited.push_back(tData);
+    }
+  }
+  pthread_mutex_unlock(&_mutex);
+  for (ThreadData* tData : exited) {
+    removeExitedThread(tData);
+  }
+}
+
+void RegionBase::addNamedValues(const std::vector<NamedMetricInfo>& metrics,
+                                std::vector<double>& values) {
+  for (size_t i = 0; i < _numThreads; i++) {
+    ThreadData* tData = _threadData[i].load(std::memory_order_acquire);
+    if (tData) {
+      tData->addNamedValues(values);
+    }
+  }
+  std::vector<ThreadData*> exited;
+  pthread_mutex_lock(&_mutex);
+  for (ThreadData* tData : _registeredThreadData) {
+    tData->addNamedValues(values);
+    if (tData->exited.load(std::memory_order_acquire) &&
+        !tData->lastActivity.load(std::memory_order_relaxed)) {
+      exited.push_back(tData);
+    }
+  }
+  for (size_t i = 0; i < values.size() && i < _exitedNamedValues.size();
+       i++) {
+    if (metrics[i].type == NAMED_METRIC_COUNTER) {
+      values[i] += _exitedNamedValues[i];
+    }
+  }
+  pthread_mutex_unlock(&_mutex);
+  for (ThreadData* tData : exited) {
+    removeExitedThread(tData);
+  }
+}
+
+void RegionBase::addTotals(unsigned long long& totalTasks,
+                           unsigned long long& firstBegin,
+                           unsigned long long& lastEnd) {
+  std::vector<ThreadData*> threads;
+  for (size_t i = 0; i < _numThreads; i++) {
+    if (_threadData[i]) {
+      threads.push_back(_threadData[i]);
+    }
+  }
+  // The registered threads are read under the lock, since the support
+  // thread frees the ones which terminated.
+  pthread_mutex_lock(&_mutex);
+  lastEnd = std::max(lastEnd, _exitedLastEnd);
+  firstBegin = std::min(firstBegin, _exitedFirstBegin);
+  totalTasks += _exitedTasks;
+  threads.insert(threads.end(), _registeredThreadData.begin(),
+                 _registeredThreadData.end());
+  for (ThreadData* tData : threads) {
+    ThreadData& td = *tData;
+    // If I was doing sampling, I could have spurious
+    // tasks that I didn't record. For this reason,
+    // I record them now.
+    td.totalTasks += td.currentSample;
+
+    totalTasks += td.totalTasks;
+    if (td.firstBegin < firstBegin) {
+      firstBegin = td.firstBegin;
+    }
+    if (td.lastEnd > lastEnd) {
+      lastEnd = td.lastEnd;
+    }
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+const std::string& RegionBase::getName() const { return _name; }
+
+RegionBase& ApplicationBase::getRegion(const std::string& name) {
+  if (name.empty() || name.size() > RIFF_MAX_REGION_NAME_LENGTH) {
+    throw std::runtime_error(
+        "Wrong region name specified (empty or longer than "
+        "RIFF_MAX_REGION_NAME_LENGTH).");
+  }
+  pthread_mutex_lock(&_mutex);
+  RegionBase*& region = _regions[name];
+  if (!region) {
+    region = createRegion(name, _numThreads);
+  }
+  pthread_mutex_unlock(&_mutex);
+  return *region;
+}
+
+size_t ApplicationBase::getNamedMetric(const std::string& name,
+                                       NamedMetricType type) {
+  if (name.empty() || name.size() > RIFF_MAX_NAMED_METRIC_NAME_LENGTH) {
+    throw std::runtime_error(
+        "Wrong metric name specified (empty or longer than "
+        "RIFF_MAX_NAMED_METRIC_NAME_LENGTH).");
+  }
+  pthread_mutex_lock(&_mutex);
+  std::map<std::string, size_t>::const_iterator it =
+      _namedMetricIndexes.find(name);
+  size_t index = _namedMetrics.size();
+  if (it != _namedMetricIndexes.end()) {
+    index = it->second;
+  } else if (index < RIFF_MAX_NAMED_METRICS) {
+    NamedMetricInfo info;
+    memset(info.name, 0, sizeof(info.name));
+    name.copy(info.name, RIFF_MAX_NAMED_METRIC_NAME_LENGTH);
+    info.type = type;
+    _namedMetrics.push_back(info);
+    _namedMetricIndexes[name] = index;
+  }
+  bool full = index >= RIFF_MAX_NAMED_METRICS;
+  bool wrongType = !full && _namedMetrics[index].type != type;
+  pthread_mutex_unlock(&_mutex);
+  if (full) {
+    throw std::runtime_error(
+        "Too many named metrics. Please increase RIFF_MAX_NAMED_METRICS "
+        "macro value.");
+  }
+  if (wrongType) {
+    throw std::runtime_error(
+        "A named metric with the same name but a different type exists.");
+  }
+  return index;
+}
+
+void ApplicationBase::collectNamedMetrics() {
+  pthread_mutex_lock(&_mutex);
+  _allNamedMetrics.assign(_namedMetrics.begin(), _namedMetrics.end());
+  pthread_mutex_unlock(&_mutex);
+  size_t numNamedMetrics = _allNamedMetrics.size();
+  _newNamedMetrics.assign(_allNamedMetrics.begin() + _sentNamedMetrics,
+                          _allNamedMetrics.end());
+  _sentNamedMetrics = numNamedMetrics;
+
+  _namedValues.assign(numNamedMetrics, 0);
+  _defaultRegion->addNamedValues(_allNamedMetrics, _namedValues);
+
+  // Only the values which changed since the previous sample are sent.
+  _sentNamedValues.resize(numNamedMetrics, 0);
+  _namedMetricUpdates.clear();
+  for (size_t i = 0; i < numNamedMetrics; i++) {
+    if (_namedValues[i] != _sentNamedValues[i]) {
+      NamedMetricUpdate update;
+      update.index = i;
+      update.value = _namedValues[i];
+      _namedMetricUpdates.push_back(update);
+      _sentNamedValues[i] = _namedValues[i];
+    }
+  }
+}
+
+void ApplicationBase::addPhaseCounters(const ThreadSnapshot& snapshot,
+                                       const ThreadSnapshot& last) {
+  if (snapshot.phaseId == last.phaseId) {
+    addPhaseCounters(snapshot.phaseId, snapshot.numTasks - last.numTasks,
+                     snapshot.latency - last.latency,
+                     snapshot.idleTime - last.idleTime, last.timestamp,
+                     snapshot.timestamp);
+    return;
+  }
+  // The thread started a new phase since the last read. If it started more
+  // than one, the counters of the intermediate ones are assigned to the
+  // first one.
+  addPhaseCounters(last.phaseId, snapshot.phaseStartTasks - last.numTasks,
+                   snapshot.phaseStartLatency - last.latency,
+                   snapshot.phaseStartIdleTime - last.idleTime,
+                   last.timestamp, snapshot.phaseStartTime);
+  addPhaseCounters(snapshot.phaseId,
+                   snapshot.numTasks - snapshot.phaseStartTasks,
+                   snapshot.latency - snapshot.phaseStartLatency,
+                   snapshot.idleTime - snapshot.phaseStartIdleTime,
+                   snapshot.phaseStartTime, snapshot.timestamp);
+}
+
+void ApplicationBase::addPhaseCounters(unsigned int phaseId, double numTasks,
+                                       double latency, double idleTime,
+                                       unsigned long long start,
+                                       unsigned long long end) {
+  if (!numTasks && !latency && !idleTime) {
+    return;
+  }
+  PhaseRecord* record = NULL;
+  for (PhaseRecord& r : _phaseHistory) {
+    if (r.phaseId == phaseId) {
+      record = &r;
+      break;
+    }
+  }
+  if (!record) {
+    PhaseRecord r;
+    r.phaseId = phaseId;
+    r.numTasks = 0;
+    r.latency = 0;
+    r.idleTime = 0;
+    r.start = start;
+    r.end = end;
+    if (_phaseHistory.size() < RIFF_MAX_PHASE_HISTORY) {
+      _phaseHistory.push_back(r);
+      record = &_phaseHistory.back();
+    } else {
+      // Replace the oldest one.
+      record = &_phaseHistory[_nextPhaseRecord];
+      *record = r;
+      _nextPhaseRecord = (_nextPhaseRecord + 1) % RIFF_MAX_PHASE_HISTORY;
+    }
+  }
+  record->numTasks += numTasks;
+  record->latency += latency;
+  record->idleTime += idleTime;
+  record->start = std::min(record->start, start);
+  record->end = std::max(record->end, end);
+  if (std::find(_updatedPhases.begin(), _updatedPhases.end(), phaseId) ==
+      _updatedPhases.end()) {
+    _updatedPhases.push_back(phaseId);
+  }
+}
+
+void ApplicationBase::collectPhaseStatistics() {
+  _updatedPhaseStatistics.clear();
+  for (const PhaseRecord& r : _phaseHistory) {
+    if (std::find(_updatedPhases.begin(), _updatedPhases.end(),
+                  r.phaseId) == _updatedPhases.end()) {
+      continue;
+    }
+    PhaseStatistics ps;
+    ps.phaseId = r.phaseId;
+    ps.durationMs = (r.end - r.start) * nsPerTick / 1000000.0;
+    ps.numTasks = r.numTasks;
+    if (ps.durationMs) {
+      ps.throughput = r.numTasks / (ps.durationMs / 1000.0);
+    }
+    if (r.numTasks) {
+      ps.latency = r.latency * nsPerTick / r.numTasks;
+    }
+    if (r.latency + r.idleTime) {
+      ps.loadPercentage = r.latency / (r.latency + r.idleTime) * 100.0;
+    }
+    _updatedPhaseStatistics.push_back(ps);
+  }
+  _updatedPhases.clear();
+}
+
+void ApplicationBase::startTimeSeries() {
+  _timeSeries.resize(std::max(_configuration.timeSeriesLength, 1u));
+  _timeSeriesStart = getCurrentTicks();
+  _windowStart = _timeSeriesStart;
+  _windowEnd = getMonotonicTimeNs(CLOCK_MONOTONIC) +
+               _configuration.timeSeriesIntervalMs * 1000000.0;
+}
+
+void ApplicationBase::cutWindow(const std::vector<ThreadData*>& threads,
+                                const std::vector<ThreadSnapshot>& snapshots) {
+  unsigned long long now = getCurrentTicks();
+  TimeSeriesWindow& window = _timeSeries[_nextWindow % _timeSeries.size()];
+  window = TimeSeriesWindow();
+  window.index = _nextWindow++;
+  window.startMs = (_windowStart - _timeSeriesStart) * nsPerTick / 1000000.0;
+  window.durationMs = (now - _windowStart) * nsPerTick / 1000000.0;
+  ApplicationSample& total = window.sample;
+  size_t updatedSamples = 0, inconsistentSamples = 0;
+  for (size_t i = 0; i < threads.size(); i++) {
+    const ThreadSnapshot& snapshot = snapshots[i];
+    ThreadSnapshot& last = threads[i]->lastWindowRead;
+    if (!isUpdated(snapshot, last)) {
+      continue;
+    }
+    if (!last.timestamp) {
+      last.timestamp = snapshot.startTime;
+    }
+    ApplicationSample sample;
+    computeThreadSample(snapshot, last, nsPerTick,
+                        _configuration.consistencyThreshold, sample);
+    last = snapshot;
+    if (sample.inconsistent) {
+      ++inconsistentSamples;
+    } else {
+      total.loadPercentage += sample.loadPercentage;
+      total.latency += sample.latency;
+    }
+    total.throughput += sample.throughput;
+    total.numTasks += sample.numTasks;
+    ++updatedSamples;
+  }
+  if (updatedSamples) {
+    if (inconsistentSamples == updatedSamples) {
+      total.inconsistent = true;
+    } else {
+      total.loadPercentage /= (updatedSamples - inconsistentSamples);
+      total.latency /= (updatedSamples - inconsistentSamples);
+    }
+  }
+  _windowStart = now;
+  _windowEnd = getMonotonicTimeNs(CLOCK_MONOTONIC) +
+               _configuration.timeSeriesIntervalMs * 1000000.0;
+}
+
+unsigned long long ApplicationBase::cutWindows() {
+  if (getMonotonicTimeNs(CLOCK_MONOTONIC) >= _windowEnd) {
+    std::vector<ThreadData*> threads = _defaultRegion->getStartedThreads();
+    std::vector<ThreadSnapshot> snapshots(threads.size());
+    for (size_t i = 0; i < threads.size(); i++) {
+      threads[i]->read(snapshots[i]);
+    }
+    cutWindow(threads, snapshots);
+  }
+  return _windowEnd;
+}
+
+void ApplicationBase::prepareSample(Message& msg) {
+  // Threads will start a new window at their next sampled begin().
+  _epoch.fetch_add(1, std::memory_order_relaxed);
+
+  // All the regions share the same deadline, so that the whole
+  // response is bounded by it.
+  unsigned long long deadline =
+      getCurrentTicks() +
+      _configuration.consolidationDeadlineMs * 1000000.0 / nsPerTick;
+  pthread_mutex_lock(&_mutex);
+  std::vector<RegionBase*> regions;
+  for (const auto& r : _regions) {
+    regions.push_back(r.second);
+  }
+  pthread_mutex_unlock(&_mutex);
+
+  // Serialized metrics of the default region and then of the others.
+  const MetricSchema* schema = _metricSchema;
+  size_t numMetricValues = schema ? 2 * schema->numFields : 0;
+  _metricValues.resize((1 + regions.size()) * numMetricValues);
+
+  RegionSample result;
+  consolidate(*_defaultRegion, deadline, result, _metricValues.data());
+  _regionSamples.resize(regions.size());
+  for (size_t i = 0; i < regions.size(); i++) {
+    consolidate(*regions[i], deadline, _regionSamples[i],
+                _metricValues.data() + (1 + i) * numMetricValues);
+  }
+
+  collectNamedMetrics();
+  collectPhaseStatistics();
+
+  msg.type = MESSAGE_TYPE_SAMPLE_RES;
+  msg.pid = getpid();
+  msg.sample = result;
+  msg.regions = _regionSamples;
+  msg.phaseId = _phaseId;
+  msg.totalThreads = _totalThreads;
+  msg.numMetricFields = schema ? schema->numFields : 0;
+  msg.metricValues = _metricValues;
+  msg.newNamedMetrics = _newNamedMetrics;
+  msg.firstNewNamedMetric = _sentNamedMetrics - _newNamedMetrics.size();
+  msg.namedMetricUpdates = _namedMetricUpdates;
+  msg.phases = _updatedPhaseStatistics;
+  msg.droppedSamples = 0;
+  // The windows cut since the previous sample which are still in the ring.
+  unsigned long long firstWindow = std::max(
+      _sentWindows,
+      _nextWindow - std::min(_nextWindow,
+                             (unsigned long long)_timeSeries.size()));
+  msg.firstWindow = firstWindow;
+  msg.overwrittenWindows = firstWindow - _sentWindows;
+  msg.windows.clear();
+  for (unsigned long long i = firstWindow; i < _nextWindow; i++) {
+    msg.windows.push_back(_timeSeries[i % _timeSeries.size()]);
+  }
+  _sentWindows = _nextWindow;
+  DEBUG(msg.sample.sample);
+}
+
+void ApplicationBase::replySamples() {
+  // A respondent can only send its totals as the answer to a survey.
+  bool stopSent = false;
+  bool timeSeries = _configuration.timeSeriesIntervalMs;
+  // Woken up by the requests and by terminate().
+  struct pollfd pfds[2];
+  pfds[0].fd = getSocketFd(_channelRef, NN_RCVFD);
+  pfds[0].events = POLLIN;
+  pfds[1].fd = _stopFd;
+  pfds[1].events = POLLIN;
+  nfds_t nfds = 2;
+  // True if a monitor attached and did not get any sample yet.
+  bool attached = false;
+  unsigned long long nextReap = 0;
+  while (!stopSent && (!_supportStop || _respondent)) {
+    if (_supportStop) {
+      // The respondent waits for the last survey until the termination
+      // timeout, unless no surveyor is connected anymore. The stop event
+      // stays readable, thus it is not polled anymore.
+      if (!isConnected(_channelRef) ||
+          (_stopDeadline &&
+           getMonotonicTimeNs(CLOCK_MONOTONIC) >= _stopDeadline)) {
+        break;
+      }
+      nfds = 1;
+    }
+    // Without requests, the registered threads which terminated are only
+    // freed here.
+    if (getMonotonicTimeNs(CLOCK_MONOTONIC) >= nextReap) {
+      reapExitedThreads();
+      nextReap = getDeadline(RIFF_REAP_INTERVAL_MS);
+    }
+    // The windows of the time series are cut while waiting for a request.
+    unsigned long long deadline =
+        timeSeries ? std::min(cutWindows(), nextReap) : nextReap;
+    if (_supportStop && _stopDeadline) {
+      deadline = std::min(deadline, _stopDeadline);
+    }
+    // A recv() would cancel the current survey if only woken up by
+    // terminate().
+    if (pollUntil(pfds, nfds, deadline) <= 0 ||
+        (_respondent && !(pfds[0].revents & POLLIN))) {
+      continue;
+    }
+    Message recvdMsg;
+    int res = receiveMessage(_channelRef, recvdMsg, NN_DONTWAIT);
+    // The surveys still queued (e.g. the ones sent before the application
+    // started) already expired: only the last one is answered, otherwise
+    // the tasks sampled for the others would be discarded by the monitor.
+    // Each recv() cancels the current survey, even if nothing is received.
+    while (_respondent && res >= 0 && poll(pfds, 1, 0) > 0) {
+      res = receiveMessage(_channelRef, recvdMsg, NN_DONTWAIT);
+    }
+    // Woken up by terminate(), cancelled by a recv() which found nothing
+    // (and thus can not be answered), or encoded by an incompatible
+    // version. On a bus (see MultiMonitor), the messages sent to the other
+    // applications are received too.
+    if (res <= 0 || !isForThisApplication(recvdMsg)) {
+      continue;
+    }
+    if (recvdMsg.type == MESSAGE_TYPE_INFO_REQ) {
+      notifyStart();
+      continue;
+    }
+    if (recvdMsg.type == MESSAGE_TYPE_ATTACH) {
+      // The monitor asks again until the application answers (e.g. while it
+      // is not started yet): nothing has been sampled since the first time.
+      if (attached) {
+        notifyStart();
+      } else {
+        attachMonitor();
       }
+      attached = true;
+      continue;
+    }
+    assert(recvdMsg.type == MESSAGE_TYPE_SAMPLE_REQ);
+    attached = false;
+    Message msg;
+    prepareSample(msg);
+    // Send message. If the monitor detached in the meantime, it is dropped.
+    if (!_supportStop) {
+      sendMessage(_channelRef, msg, NN_DONTWAIT, _sampleSize);
+    } else if (_respondent) {
+      notifyStop(0);
+      stopSent = true;
+    }
+  }
+}
 
-      // If at least one thread is progressing.
-      if (updatedSamples) {
-        if (application->_configuration.adjustThroughput &&
-            updatedSamples != numThreads) {
-          if (!application->_supportStop) {
-            throw std::runtime_error("FATAL ERROR: !_supportStop");
-          }
-          msg.payload.sample.throughput +=
-              (msg.payload.sample.throughput / updatedSamples) *
-              (numThreads - updatedSamples);
-        }
+void ApplicationBase::reapExitedThreads() {
+  // Otherwise their last counters still have to be sampled.
+  if (isConnected(_channelRef)) {
+    return;
+  }
+  pthread_mutex_lock(&_mutex);
+  std::vector<RegionBase*> regions;
+  for (const auto& r : _regions) {
+    regions.push_back(r.second);
+  }
+  pthread_mutex_unlock(&_mutex);
+  _defaultRegion->removeExitedThreads();
+  for (RegionBase* region : regions) {
+    region->removeExitedThreads();
+  }
+}
 
-        // If we collected only inconsistent samples, we notify that latency and
-        // load are inconsistent.
-        if (inconsistentSamples == updatedSamples ||
-            application->_inconsistentSample) {
-          msg.payload.sample.inconsistent = true;
-        } else {
-          msg.payload.sample.loadPercentage /=
-              (updatedSamples - inconsistentSamples);
-          msg.payload.sample.latency /= (updatedSamples - inconsistentSamples);
+void ApplicationBase::pushSamples() {
+  unsigned long long intervalNs = _configuration.pushIntervalMs * 1000000.0;
+  size_t queueLength = std::max(_configuration.pushQueueLength, 1u);
+  unsigned long long next = getMonotonicTimeNs(CLOCK_MONOTONIC);
+  bool timeSeries = _configuration.timeSeriesIntervalMs;
+  bool stop = false;
+  while (!stop) {
+    // If the previous sample took too long, the next one is not anticipated.
+    next = std::max(next + intervalNs, getMonotonicTimeNs(CLOCK_MONOTONIC));
+    pthread_mutex_lock(&_mutex);
+    while (!_supportStop) {
+      // The windows of the time series are cut while waiting.
+      unsigned long long deadline = timeSeries ? std::min(next, _windowEnd)
+                                               : next;
+      struct timespec ts;
+      ts.tv_sec = deadline / 1000000000ULL;
+      ts.tv_nsec = deadline % 1000000000ULL;
+      if (pthread_cond_timedwait(&_supportCond, &_mutex, &ts) == ETIMEDOUT) {
+        if (deadline == next) {
+          break;
         }
-      } else if (!application->_supportStop) {
-        throw std::runtime_error("FATAL ERROR: !_supportStop");
+        pthread_mutex_unlock(&_mutex);
+        cutWindows();
+        pthread_mutex_lock(&_mutex);
       }
+    }
+    stop = _supportStop;
+    pthread_mutex_unlock(&_mutex);
 
-      // Aggregate custom values.      
-      for (size_t i = 0; i < RIFF_MAX_CUSTOM_FIELDS; i++) {
-        if (application->_aggregator) {
-          msg.payload.sample.customFields[i] =
-            application->_aggregator->aggregate(i, customVec[i]);
-        }else{
-            // Check needed for a corner termination case
-            if(!customVec[i].empty()){
-                msg.payload.sample.customFields[i] = customVec[i][0];
-            }
+    // The sample requests are ignored.
+    Message recvdMsg;
+    int res;
+    bool attached = false;
+    while ((res = receiveMessage(_channelRef, recvdMsg, NN_DONTWAIT)) >= 0) {
+      if (!res || !isForThisApplication(recvdMsg)) {
+        continue;
+      }
+      if (recvdMsg.type == MESSAGE_TYPE_INFO_REQ) {
+        notifyStart();
+      } else if (recvdMsg.type == MESSAGE_TYPE_ATTACH) {
+        // The monitor asks again until the application answers.
+        if (attached) {
+          notifyStart();
+        } else {
+          attachMonitor();
         }
+        attached = true;
       }
+    }
+    // The first sample sent to a monitor which just attached covers a whole
+    // interval.
+    if (attached && !stop) {
+      continue;
+    }
 
-      msg.phaseId = application->_phaseId;
-      msg.totalThreads = application->_totalThreads;
-      DEBUG(msg.payload.sample);
-      // Send message
-      if (!application->_supportStop) {
-        application->_channelRef.send(&msg, sizeof(msg), 0);
+    // When terminating, the last sample covers the tasks computed since the
+    // previous one.
+    _pushQueue.push_back(Message());
+    prepareSample(_pushQueue.back());
+    if (_pushQueue.size() > queueLength) {
+      dropOldestSample();
+    }
+    // The monitor is only waited when terminating, if there is one.
+    bool wait = stop && isConnected(_channelRef);
+    while (!_pushQueue.empty()) {
+      int r = wait ? sendMessageUntil(_channelRef, _pushQueue.front(),
+                                      _stopDeadline, _sampleSize)
+                   : sendMessage(_channelRef, _pushQueue.front(),
+                                 NN_DONTWAIT, _sampleSize);
+      if (r < 0) {
+        break;
       }
-    } else if (res == -1) {
-      throw std::runtime_error("Received less bytes than expected.");
+      _pushQueue.pop_front();
     }
   }
-  return NULL;
 }
 
-Application::Application(const std::string& channelName, size_t numThreads,
-                         Aggregator* aggregator)
-    : _channel(new nn::socket(AF_SP, NN_PAIR)),
-      _channelRef(*_channel),
-      _started(false),
-      _aggregator(aggregator),
-      _executionTime(0),
-      _totalTasks(0),
-      _phaseId(0),
-      _totalThreads(0),
-      _inconsistentSample(false) {
-  _chid = _channelRef.connect(channelName.c_str());
-  assert(_chid >= 0);
-  pthread_mutex_init(&_mutex, NULL);
-  _supportStop = false;
-  _threadData = new std::vector<ThreadData>(numThreads);
-  // Pthread Create must be the last thing we do in constructor
-  pthread_create(&_supportTid, NULL, applicationSupportThread, (void*)this);
+void ApplicationBase::dropOldestSample() {
+  const Message& dropped = _pushQueue.front();
+  if (!dropped.newNamedMetrics.empty()) {
+    _sentNamedMetrics =
+        std::min(_sentNamedMetrics, (size_t)dropped.firstNewNamedMetric);
+  }
+  // Only the values which changed are sent.
+  std::fill(_sentNamedValues.begin(), _sentNamedValues.end(),
+            std::numeric_limits<double>::quiet_NaN());
+  for (const PhaseStatistics& phase : dropped.phases) {
+    if (std::find(_updatedPhases.begin(), _updatedPhases.end(),
+                  phase.phaseId) == _updatedPhases.end()) {
+      _updatedPhases.push_back(phase.phaseId);
+    }
+  }
+  // The last consolidated sample is never dropped. It gets the windows of
+  // the dropped one, as long as they fit in the ring.
+  Message& next = _pushQueue[1];
+  next.droppedSamples += dropped.droppedSamples + 1;
+  if (!dropped.windows.empty()) {
+    next.windows.insert(next.windows.begin(), dropped.windows.begin(),
+                        dropped.windows.end());
+    next.firstWindow = dropped.firstWindow;
+  }
+  next.overwrittenWindows += dropped.overwrittenWindows;
+  size_t excess = next.windows.size() -
+                  std::min(next.windows.size(), _timeSeries.size());
+  next.windows.erase(next.windows.begin(), next.windows.begin() + excess);
+  next.firstWindow += excess;
+  next.overwrittenWindows += excess;
+  _pushQueue.pop_front();
 }
 
-Application::Application(nn::socket& socket, unsigned int chid,
-                         size_t numThreads, Aggregator* aggregator)
-    : _channel(NULL),
-      _channelRef(socket),
-      _chid(chid),
-      _started(false),
-      _aggregator(aggregator),
-      _executionTime(0),
-      _totalTasks(0),
-      _phaseId(0),
-      _totalThreads(0),
-      _inconsistentSample(false) {
-  pthread_mutex_init(&_mutex, NULL);
-  _supportStop = false;
-  _threadData = new std::vector<ThreadData>(numThreads);
-  // Pthread Create must be the last thing we do in constructor
-  pthread_create(&_supportTid, NULL, applicationSupportThread, (void*)this);
+void ApplicationBase::notifyStart() {
+  Message msg;
+  msg.type = MESSAGE_TYPE_START;
+  msg.pid = getpid();
+  msg.name = _configuration.name;
+  msg.labels = _configuration.labels;
+  // A monitor attaching later asks for it again (see attachMonitor()).
+  sendMessage(_channelRef, msg, NN_DONTWAIT);
 }
 
-Application::~Application() {
-  if (_channel) {
-    _channel->shutdown(_chid);
-    delete _channel;
-  }
-  delete _threadData;
+void ApplicationBase::attachMonitor() {
+  // What has been sampled so far (and the samples still queued for a
+  // previous monitor) is discarded.
+  Message discarded;
+  prepareSample(discarded);
+  _pushQueue.clear();
+  _sentNamedMetrics = 0;
+  std::fill(_sentNamedValues.begin(), _sentNamedValues.end(),
+            std::numeric_limits<double>::quiet_NaN());
+  notifyStart();
 }
 
-void Application::notifyStart() {
+bool ApplicationBase::notifyStop(unsigned long long deadline) {
   Message msg;
-  msg.type = MESSAGE_TYPE_START;
-  msg.payload.pid = getpid();
-  msg.phaseId = _phaseId;
-  msg.totalThreads = _totalThreads;
-  int r = _channelRef.send(&msg, sizeof(msg), 0);
-  assert(r == sizeof(msg));
-  UNUSED(r);
+  msg.type = MESSAGE_TYPE_STOP;
+  msg.pid = getpid();
+  msg.executionTime = _executionTime;
+  msg.totalTasks = _totalTasks;
+  return sendMessageUntil(_channelRef, msg, deadline) > 0;
+}
+
+bool ApplicationBase::isForThisApplication(const Message& msg) {
+  static const pid_t pid = getpid();
+  return !msg.pid || msg.pid == pid;
 }
 
-ulong Application::updateSamplingLength(unsigned long long numTasks,
-                                        unsigned long long sampleTime) {
+void ApplicationBase::checkStart() {
+  // This awful double check is done to avoid locking the flag
+  // every time (this code is executed once per thread).
+  if (!_started) {
+    pthread_mutex_lock(&_mutex);
+    if (!_started) {
+      // A respondent can only answer the surveys.
+      if (!_respondent) {
+        notifyStart();
+      }
+      _started = true;
+      pthread_cond_broadcast(&_supportCond);
+    }
+    pthread_mutex_unlock(&_mutex);
+  }
+}
+
+ulong ApplicationBase::updateSamplingLength(double numTasks,
+                                            unsigned long long sampleTime) {
   if (numTasks) {
-    double latencyNs = sampleTime / numTasks;
+    double latencyNs = sampleTime * nsPerTick / numTasks;
     double latencyMs = latencyNs / 1000000.0;
     // If samplingLength == 1 we would have one begin()-end() pair every
     // latencyMs milliseconds
@@ -260,77 +2755,144 @@ ulong Application::updateSamplingLength(unsigned long long numTasks,
   }
 }
 
-void Application::setConfiguration(
-    const ApplicationConfiguration& configuration) {
-  _configuration = configuration;
+// Exponentially weighted moving average (0 if there are no previous values).
+static inline double movingAverage(double average, double value,
+                                   double weight) {
+  return average ? weight * value + (1 - weight) * average : value;
+}
+
+ulong ApplicationBase::controlSamplingLength(ThreadData& tData,
+                                             unsigned long long now) {
+  double weight = _configuration.samplingSmoothing;
+  double tasks = tData.current.numTasks - tData.periodTasks;
+  if (tData.periodStart && tasks) {
+    tData.taskInterval = movingAverage(
+        tData.taskInterval, (now - tData.periodStart) / tasks, weight);
+  }
+  tData.periodStart = now;
+  tData.periodTasks = tData.current.numTasks;
+  // The thread is going to start a new window. The first one is not
+  // considered, since it started with the first begin() call.
+  if (_epoch.load(std::memory_order_relaxed) != tData.epoch && tData.epoch) {
+    tData.epochInterval =
+        movingAverage(tData.epochInterval, now - tData.windowStart, weight);
+  }
+  if (!tData.taskInterval) {
+    return tData.samplingLength;
+  }
+
+  // With sampling length L, each period of L tasks lasts L * taskInterval
+  // and costs L skipped pairs plus the recording of one of them, so the
+  // overhead is within the budget if
+  // recordedPairCost / L + skippedPairCost <= budget * taskInterval.
+  double available =
+      _configuration.maxOverheadPercentage / 100.0 * tData.taskInterval -
+      _skippedPairCost;
+  double samplingLength = std::numeric_limits<unsigned int>::max();
+  if (available > 0) {
+    samplingLength = std::ceil(_recordedPairCost / available);
+  }
+  if (_configuration.minSamplesPerWindow && tData.epochInterval) {
+    samplingLength = std::min(samplingLength,
+                              std::floor(tData.epochInterval /
+                                         tData.taskInterval /
+                                         _configuration.minSamplesPerWindow));
+  }
+  return std::min(std::max(samplingLength, 1.0),
+                  (double)std::numeric_limits<unsigned int>::max());
 }
 
-void Application::storeCustomValue(size_t index, double value,
-                                   unsigned int threadId) {
-  if (threadId > _threadData->size()) {
+void ApplicationBase::setConfiguration(
+    const ApplicationConfiguration& configuration) {
+  if (configuration.name.size() > RIFF_MAX_APPLICATION_NAME_LENGTH ||
+      configuration.labels.size() > RIFF_MAX_APPLICATION_LABELS_LENGTH) {
     throw std::runtime_error(
-        "Wrong threadId specified (greater than number of threads).");
+        "Application name or labels too long (see "
+        "RIFF_MAX_APPLICATION_NAME_LENGTH and "
+        "RIFF_MAX_APPLICATION_LABELS_LENGTH).");
   }
-  if (index < RIFF_MAX_CUSTOM_FIELDS) {
-    ThreadData& tData = _threadData->at(threadId);
-    tData.sample.customFields[index] = value;
-  } else {
+  if (_respondent && configuration.pushIntervalMs) {
     throw std::runtime_error(
-        "Custom value index out of bound. Please "
-        "increase RIFF_MAX_CUSTOM_FIELDS macro value.");
+        "The samples can not be pushed to a SurveyMonitor.");
+  }
+  _configuration = configuration;
+  if (_configuration.sharedMemory && !_sharedSegment) {
+    _sharedSegment = createSharedSegment();
+    _sharedSegment->phaseId.store(_phaseId, std::memory_order_relaxed);
+  }
+  if (_sharedSegment) {
+    _sharedSegment->consistencyThreshold.store(
+        _configuration.consistencyThreshold, std::memory_order_relaxed);
   }
 }
 
-void Application::setTotalThreads(unsigned int totalThreads) {
+void ApplicationBase::setTotalThreads(unsigned int totalThreads) {
   _totalThreads = totalThreads;
 }
 
-void Application::setPhaseId(unsigned int phaseId, unsigned int totalThreads) {
+void ApplicationBase::setPhaseId(unsigned int phaseId,
+                                 unsigned int totalThreads) {
   _phaseId = phaseId;
+  if (_sharedSegment) {
+    _sharedSegment->phaseId.store(phaseId, std::memory_order_relaxed);
+  }
   setTotalThreads(totalThreads);
 }
 
-void Application::terminate() {
-  unsigned long long lastEnd = 0,
-                     firstBegin =
-                         std::numeric_limits<unsigned long long>::max();
-  for (ThreadData& td : *_threadData) {
-    // If I was doing sampling, I could have spurious
-    // tasks that I didn't record. For this reason,
-    // I record them now.
-    td.totalTasks += td.currentSample;
-
-    _totalTasks += td.totalTasks;
-    if (td.firstBegin < firstBegin) {
-      firstBegin = td.firstBegin;
-    }
-    if (td.lastEnd > lastEnd) {
-      lastEnd = td.lastEnd;
-    }
+void ApplicationBase::terminate() {
+  // Before waiting for the support thread (which, if it answers a
+  // SurveyMonitor, waits for the next survey).
+  if (_sharedSegment) {
+    _sharedSegment->terminated.store(true, std::memory_order_release);
   }
-  _executionTime = (lastEnd - firstBegin) / 1000000.0;  // Must be in ms
+  unsigned long long lastEnd = 0;
+  unsigned long long firstBegin =
+      std::numeric_limits<unsigned long long>::max();
+  _totalTasks = 0;
+  _defaultRegion->addTotals(_totalTasks, firstBegin, lastEnd);
+  pthread_mutex_lock(&_mutex);
+  for (const auto& r : _regions) {
+    r.second->addTotals(_totalTasks, firstBegin, lastEnd);
+  }
+  pthread_mutex_unlock(&_mutex);
+  _executionTime = (lastEnd - firstBegin) * nsPerTick / 1000000.0;  // In ms
 
+  pthread_mutex_lock(&_mutex);
+  _stopDeadline = getDeadline(_configuration.terminationTimeoutMs);
   _supportStop = true;
+  pthread_cond_broadcast(&_supportCond);
+  pthread_mutex_unlock(&_mutex);
+  uint64_t wakeUp = 1;
+  ssize_t r = write(_stopFd, &wakeUp, sizeof(wakeUp));
+  assert(r == sizeof(wakeUp));
+  UNUSED(r);
   pthread_join(_supportTid, NULL);
+  // The support thread answered the last survey with the totals, or gave up.
+  if (_respondent) {
+    return;
+  }
 
-  Message msg;
-  msg.type = MESSAGE_TYPE_STOP;
-  msg.payload.summary.time = _executionTime;
-  msg.payload.summary.totalTasks = _totalTasks;
-  int r = _channelRef.send(&msg, sizeof(msg), 0);
-  assert(r == sizeof(msg));
+  // Nobody to wait for if no monitor is attached.
+  if (!isConnected(_channelRef) || !notifyStop(_stopDeadline)) {
+    return;
+  }
   // Wait for ack before leaving (otherwise if object is destroyed
-  // the monitor could never receive the stop).
-  r = _channelRef.recv(&msg, sizeof(msg), 0);
-  assert(r == sizeof(msg));
-  UNUSED(r);
+  // the monitor could never receive the stop). The requests sent by the
+  // monitor in the meantime are discarded.
+  Message msg;
+  int res;
+  while ((res = receiveMessageUntil(_channelRef, msg, _stopDeadline)) >= 0 &&
+         (!res || msg.type != MESSAGE_TYPE_STOPACK ||
+          !isForThisApplication(msg))) {
+    ;
+  }
 }
 
-ulong Application::getExecutionTime() { return _executionTime; }
+ulong ApplicationBase::getExecutionTime() { return _executionTime; }
 
-unsigned long long Application::getTotalTasks() { return _totalTasks; }
+unsigned long long ApplicationBase::getTotalTasks() { return _totalTasks; }
 
-void Application::markInconsistentSamples() { _inconsistentSample = true; }
+void ApplicationBase::markInconsistentSamples() { _inconsistentSample = true; }
 
 Monitor::Monitor(const std::string& channelName)
     : _channel(new nn::socket(AF_SP, NN_PAIR)),
@@ -338,7 +2900,15 @@ Monitor::Monitor(const std::string& channelName)
       _executionTime(0),
       _totalTasks(0),
       _lastPhaseId(0),
-      _lastTotalThreads(0) {
+      _lastTotalThreads(0),
+      _lastContributingThreads(0),
+      _lastActiveThreads(0),
+      _lastNumMetricFields(0),
+      _nextPhase(0),
+      _droppedSamples(0),
+      _overwrittenWindows(0),
+      _requestPending(false),
+      _stopAcked(false) {
   _chid = _channelRef.bind(channelName.c_str());
   assert(_chid >= 0);
 }
@@ -350,50 +2920,223 @@ Monitor::Monitor(nn::socket& socket, unsigned int chid)
       _executionTime(0),
       _totalTasks(0),
       _lastPhaseId(0),
-      _lastTotalThreads(0) {
+      _lastTotalThreads(0),
+      _lastContributingThreads(0),
+      _lastActiveThreads(0),
+      _lastNumMetricFields(0),
+      _nextPhase(0),
+      _droppedSamples(0),
+      _overwrittenWindows(0),
+      _requestPending(false),
+      _stopAcked(false) {
   ;
 }
 
 Monitor::~Monitor() {
+  // The acknowledgement is lost if the application did not receive it
+  // before the socket is closed (NN_LINGER does not work, see
+  // https://github.com/nanomsg/nanomsg/issues/799): the application is
+  // waited until it disconnects.
+  unsigned long long deadline = getDeadline(RIFF_STOPACK_LINGER_MS);
+  while (_stopAcked &&
+         _channelRef.get_statistic(NN_STAT_CURRENT_CONNECTIONS) &&
+         getMonotonicTimeNs(CLOCK_MONOTONIC) < deadline) {
+    usleep(1000);
+  }
   if (_channel) {
     _channel->shutdown(_chid);
     delete _channel;
   }
 }
 
+// Receives a message from the application, waiting for it until the
+// deadline (see getDeadline()). Returns false if it expired.
+static bool receiveFromApplication(nn::socket& socket, Message& msg,
+                                   unsigned long long deadline) {
+  int r = receiveMessageUntil(socket, msg, deadline);
+  if (!r) {
+    throw std::runtime_error(
+        "Message encoded by an incompatible version of riff.");
+  }
+  return r > 0;
+}
+
 pid_t Monitor::waitStart() {
-  Message m;
-  int r = _channelRef.recv(&m, sizeof(m), 0);
-  assert(r == sizeof(m));
-  UNUSED(r);
-  assert(m.type == MESSAGE_TYPE_START);
-  return m.payload.pid;
+  // The application may have announced itself before the monitor attached
+  // (and thus to nobody): it is asked to do it again as soon as it is
+  // connected, and then periodically, since the request may have been
+  // received by a previous application which was going away.
+  struct pollfd pfds[2];
+  pfds[0].fd = getSocketFd(_channelRef, NN_RCVFD);
+  pfds[0].events = POLLIN;
+  pfds[1].fd = getSocketFd(_channelRef, NN_SNDFD);
+  pfds[1].events = POLLIN;
+  Message attach;
+  attach.type = MESSAGE_TYPE_ATTACH;
+  bool sendAttach = true;
+  unsigned long long nextAttach = 0;
+  _requestPending = false;
+  while (true) {
+    if (sendAttach && sendMessage(_channelRef, attach, NN_DONTWAIT) > 0) {
+      sendAttach = false;
+      nextAttach = getDeadline(RIFF_ATTACH_RETRY_MS);
+    }
+    Message m;
+    int r = receiveMessage(_channelRef, m, NN_DONTWAIT);
+    if (!r) {
+      throw std::runtime_error(
+          "Message encoded by an incompatible version of riff.");
+    } else if (r < 0) {
+      // Waits to be connected, and then for the answer.
+      if (!pollUntil(pfds, sendAttach ? 2 : 1, sendAttach ? 0 : nextAttach)) {
+        sendAttach = true;
+      }
+    } else if (m.type == MESSAGE_TYPE_START) {
+      _stopAcked = false;
+      return m.pid;
+    } else if (m.type == MESSAGE_TYPE_STOP) {
+      // An application which terminated before being attached.
+      acknowledgeStop(m);
+    }
+  }
 }
 
 bool Monitor::getSample(ApplicationSample& sample) {
+  return tryGetSample(sample, -1) == SAMPLE_STATUS_RECEIVED;
+}
+
+bool Monitor::nextSample(ApplicationSample& sample) {
+  return tryNextSample(sample, -1) == SAMPLE_STATUS_RECEIVED;
+}
+
+SampleStatus Monitor::tryGetSample(ApplicationSample& sample,
+                                   double timeoutMs) {
+  unsigned long long deadline = getDeadline(timeoutMs);
+  // Otherwise, the sample requested by a previous call is still coming.
+  if (!_requestPending) {
+    Message m;
+    m.type = MESSAGE_TYPE_SAMPLE_REQ;
+    if (sendMessageUntil(_channelRef, m, deadline) < 0) {
+      return SAMPLE_STATUS_TIMEOUT;
+    }
+    _requestPending = true;
+  }
+  return receiveSample(sample, deadline);
+}
+
+SampleStatus Monitor::tryNextSample(ApplicationSample& sample,
+                                    double timeoutMs) {
+  return receiveSample(sample, getDeadline(timeoutMs));
+}
+
+std::future<bool> Monitor::getSampleAsync(ApplicationSample& sample) {
+  return std::async(std::launch::async,
+                    [this, &sample]() { return getSample(sample); });
+}
+
+int Monitor::getFd() const { return getSocketFd(_channelRef, NN_RCVFD); }
+
+void Monitor::acknowledgeStop(const Message& stop) {
+  // If the application is not waiting for it anymore, it is dropped.
+  Message ack;
+  ack.type = MESSAGE_TYPE_STOPACK;
+  ack.pid = stop.pid;
+  _stopAcked = sendMessage(_channelRef, ack, NN_DONTWAIT) > 0;
+}
+
+SampleStatus Monitor::receiveSample(ApplicationSample& sample,
+                                    unsigned long long deadline) {
+  // The application announces itself again when asked by waitStart().
   Message m;
-  m.type = MESSAGE_TYPE_SAMPLE_REQ;
-  int r = _channelRef.send(&m, sizeof(m), 0);
-  assert(r == sizeof(m));
-  r = _channelRef.recv(&m, sizeof(m), 0);
-  assert(r == sizeof(m));
-  UNUSED(r);
+  do {
+    if (!receiveFromApplication(_channelRef, m, deadline)) {
+      return SAMPLE_STATUS_TIMEOUT;
+    }
+  } while (m.type == MESSAGE_TYPE_START);
+  // A terminated application does not answer the pending request.
+  _requestPending = false;
+  _stopAcked = false;
   if (m.type == MESSAGE_TYPE_SAMPLE_RES) {
-    sample = m.payload.sample;
+    _lastRegions.swap(m.regions);
+    _lastNumMetricFields = m.numMetricFields;
+    _lastMetrics.swap(m.metricValues);
+    // Metrics of the application and then of each region.
+    _lastMetrics.resize((1 + _lastRegions.size()) * 2 * _lastNumMetricFields);
+    for (size_t i = 0; i < m.newNamedMetrics.size(); i++) {
+      const NamedMetricInfo& info = m.newNamedMetrics[i];
+      // After a dropped sample, the application sends again the metrics
+      // registered since the first one we did not receive.
+      if (m.firstNewNamedMetric + i != _namedMetrics.size()) {
+        continue;
+      }
+      NamedMetric metric;
+      metric.name = info.name;
+      metric.type = info.type;
+      metric.value = 0;
+      _namedMetrics.push_back(metric);
+      _namedMetricTotals.push_back(0);
+    }
+    // Counters not updated in this sample did not change.
+    for (NamedMetric& metric : _namedMetrics) {
+      if (metric.type == NAMED_METRIC_COUNTER) {
+        metric.value = 0;
+      }
+    }
+    for (const NamedMetricUpdate& update : m.namedMetricUpdates) {
+      if (update.index >= _namedMetrics.size()) {
+        continue;
+      }
+      NamedMetric& metric = _namedMetrics[update.index];
+      if (metric.type == NAMED_METRIC_COUNTER) {
+        metric.value = update.value - _namedMetricTotals[update.index];
+      } else {
+        metric.value = update.value;
+      }
+      _namedMetricTotals[update.index] = update.value;
+    }
+    for (const PhaseStatistics& phase : m.phases) {
+      bool found = false;
+      for (PhaseStatistics& p : _phases) {
+        if (p.phaseId == phase.phaseId) {
+          p = phase;
+          found = true;
+          break;
+        }
+      }
+      if (found) {
+        continue;
+      }
+      if (_phases.size() < RIFF_MAX_PHASE_HISTORY) {
+        _phases.push_back(phase);
+      } else {
+        // Replace the oldest one.
+        _phases[_nextPhase] = phase;
+        _nextPhase = (_nextPhase + 1) % RIFF_MAX_PHASE_HISTORY;
+      }
+    }
+
+    const RegionSample& s = m.sample;
+    sample = s.sample;
+    _droppedSamples += m.droppedSamples;
+    _lastWindows.swap(m.windows);
+    _overwrittenWindows += m.overwrittenWindows;
     _lastPhaseId = m.phaseId;
     _lastTotalThreads = m.totalThreads;
-    return true;
+    _lastContributingThreads = s.contributingThreads;
+    _lastActiveThreads = s.activeThreads;
+    unsigned int numStalled =
+        std::min(s.numStalled, (unsigned int)RIFF_MAX_STALLED_THREADS);
+    _lastStalledThreads.assign(s.stalled, s.stalled + numStalled);
+    _lastLatencyPercentiles = s.latencyPercentiles;
+    _lastSamplingStatistics = s.samplingStatistics;
+    _lastPerformanceCounters = s.performanceCounters;
+    _lastSchedulingStatistics = s.schedulingStatistics;
+    return SAMPLE_STATUS_RECEIVED;
   } else if (m.type == MESSAGE_TYPE_STOP) {
-    _executionTime = m.payload.summary.time;
-    _totalTasks = m.payload.summary.totalTasks;
-    // Send ack.
-    m.type = MESSAGE_TYPE_STOPACK;
-    r = _channelRef.send(&m, sizeof(m), 0);
-    assert(r == sizeof(m));
-    sleep(1);  // To be sure application receives the ACK (we cannot use linger
-               // since it doesn't work
-               // https://github.com/nanomsg/nanomsg/issues/799)
-    return false;
+    _executionTime = m.executionTime;
+    _totalTasks = m.totalTasks;
+    acknowledgeStop(m);
+    return SAMPLE_STATUS_TERMINATED;
   } else {
     throw runtime_error("Unexpected message type.");
   }
@@ -403,8 +3146,349 @@ unsigned int Monitor::getPhaseId() const { return _lastPhaseId; }
 
 unsigned int Monitor::getTotalThreads() const { return _lastTotalThreads; }
 
+unsigned int Monitor::getContributingThreads() const {
+  return _lastContributingThreads;
+}
+
+unsigned int Monitor::getActiveThreads() const { return _lastActiveThreads; }
+
+const std::vector<StalledThread>& Monitor::getStalledThreads() const {
+  return _lastStalledThreads;
+}
+
+const LatencyPercentiles& Monitor::getLatencyPercentiles() const {
+  return _lastLatencyPercentiles;
+}
+
+const SamplingStatistics& Monitor::getSamplingStatistics() const {
+  return _lastSamplingStatistics;
+}
+
+const PerformanceCounters& Monitor::getPerformanceCounters() const {
+  return _lastPerformanceCounters;
+}
+
+const SchedulingStatistics& Monitor::getSchedulingStatistics() const {
+  return _lastSchedulingStatistics;
+}
+
+bool Monitor::getPhaseStatistics(unsigned int phaseId,
+                                 PhaseStatistics& statistics) const {
+  for (const PhaseStatistics& p : _phases) {
+    if (p.phaseId == phaseId) {
+      statistics = p;
+      return true;
+    }
+  }
+  return false;
+}
+
+unsigned long long Monitor::getDroppedSamples() const {
+  return _droppedSamples;
+}
+
+const std::vector<TimeSeriesWindow>& Monitor::getTimeSeries() const {
+  return _lastWindows;
+}
+
+unsigned long long Monitor::getOverwrittenWindows() const {
+  return _overwrittenWindows;
+}
+
+const std::vector<RegionSample>& Monitor::getRegionSamples() const {
+  return _lastRegions;
+}
+
+const std::vector<NamedMetric>& Monitor::getNamedMetrics() const {
+  return _namedMetrics;
+}
+
+double Monitor::getNamedMetric(const std::string& name) const {
+  for (const NamedMetric& metric : _namedMetrics) {
+    if (metric.name == name) {
+      return metric.value;
+    }
+  }
+  throw std::runtime_error("Named metric not received.");
+}
+
+const double* Monitor::getMetricValues(size_t index,
+                                       const MetricSchema* schema) const {
+  if (schema->numFields != _lastNumMetricFields) {
+    throw std::runtime_error(
+        "The metric schema is not the one of the application.");
+  }
+  if (index > _lastRegions.size()) {
+    throw std::runtime_error("Region index out of bound.");
+  }
+  return _lastMetrics.data() + index * 2 * schema->numFields;
+}
+
 ulong Monitor::getExecutionTime() { return _executionTime; }
 
 unsigned long long Monitor::getTotalTasks() { return _totalTasks; }
 
+SharedMonitor::SharedMonitor(pid_t pid)
+    : _segment(NULL),
+      _lastRead(RIFF_SHARED_MEMORY_SLOTS),
+      _generations(RIFF_SHARED_MEMORY_SLOTS, 0),
+      _terminated(false) {
+  std::string name = getSharedSegmentName(pid);
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::runtime_error("Impossible to open " + name + ": " +
+                             strerror(errno) +
+                             " (is ApplicationConfiguration::sharedMemory "
+                             "set?)");
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size != sizeof(SharedSegment)) {
+    close(fd);
+    throw std::runtime_error(name +
+                             " has been created by a different version of "
+                             "riff.");
+  }
+  void* mem = mmap(NULL, sizeof(SharedSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    throw std::runtime_error("Impossible to map " + name + ": " +
+                             strerror(errno));
+  }
+  _segment = static_cast<const SharedSegment*>(mem);
+  if (_segment->magic != sharedMemoryMagic ||
+      _segment->version != RIFF_SHARED_MEMORY_VERSION) {
+    munmap(mem, sizeof(SharedSegment));
+    throw std::runtime_error(name +
+                             " has been created by a different version of "
+                             "riff.");
+  }
+}
+
+SharedMonitor::~SharedMonitor() {
+  munmap(const_cast<SharedSegment*>(_segment), sizeof(SharedSegment));
+}
+
+bool SharedMonitor::getSample(ApplicationSample& sample) {
+  if (_terminated) {
+    return false;
+  }
+  // Read before the counters, so that the last ones published are read
+  // once more after the termination.
+  bool terminated = _segment->terminated.load(std::memory_order_acquire);
+  double consistencyThreshold =
+      _segment->consistencyThreshold.load(std::memory_order_relaxed);
+  sample = ApplicationSample();
+  unsigned int updatedSamples = 0, inconsistentSamples = 0;
+  for (size_t i = 0; i < RIFF_SHARED_MEMORY_SLOTS; i++) {
+    const SharedThreadSlot& slot = _segment->slots[i];
+    if (slot.state.load(std::memory_order_acquire) == SHARED_SLOT_FREE) {
+      continue;
+    }
+    ThreadSnapshot snapshot;
+    unsigned long generation;
+    slot.read(snapshot, generation);
+    ThreadSnapshot& last = _lastRead[i];
+    if (generation != _generations[i]) {
+      // A new thread.
+      last = ThreadSnapshot();
+      _generations[i] = generation;
+    }
+    if (!snapshot.timestamp || !isUpdated(snapshot, last)) {
+      continue;
+    }
+    if (!last.timestamp) {
+      last.timestamp = snapshot.startTime;
+    }
+    ApplicationSample s;
+    computeThreadSample(snapshot, last, _segment->nsPerTick,
+                        consistencyThreshold, s);
+    last = snapshot;
+    if (s.inconsistent) {
+      ++inconsistentSamples;
+    } else {
+      sample.loadPercentage += s.loadPercentage;
+      sample.latency += s.latency;
+    }
+    sample.throughput += s.throughput;
+    sample.numTasks += s.numTasks;
+    ++updatedSamples;
+  }
+  if (updatedSamples) {
+    if (inconsistentSamples == updatedSamples) {
+      sample.inconsistent = true;
+    } else {
+      sample.loadPercentage /= (updatedSamples - inconsistentSamples);
+      sample.latency /= (updatedSamples - inconsistentSamples);
+    }
+  }
+  _terminated = terminated;
+  return true;
+}
+
+unsigned int SharedMonitor::getPhaseId() const {
+  return _segment->phaseId.load(std::memory_order_relaxed);
+}
+
+MultiMonitor::MultiMonitor(const std::string& channelName)
+    : _channel(AF_SP, NN_BUS) {
+  _chid = _channel.bind(channelName.c_str());
+  assert(_chid >= 0);
+}
+
+MultiMonitor::~MultiMonitor() {
+  _channel.shutdown(_chid);
+}
+
+void MultiMonitor::send(MessageType type, pid_t pid) {
+  Message m;
+  m.type = type;
+  m.pid = pid;
+  // If the applications are not reading, the message is dropped.
+  sendMessage(_channel, m, NN_DONTWAIT);
+}
+
+int MultiMonitor::getFd() const { return getSocketFd(_channel, NN_RCVFD); }
+
+void MultiMonitor::requestSamples() {
+  send(MESSAGE_TYPE_SAMPLE_REQ, 0);
+}
+
+void MultiMonitor::collect(std::vector<MultiSample>& samples,
+                           std::vector<MonitoredApplication>& terminated) {
+  samples.clear();
+  terminated.clear();
+  Message m;
+  int r;
+  while ((r = receiveMessage(_channel, m, NN_DONTWAIT)) >= 0) {
+    // Encoded by an incompatible version.
+    if (!r) {
+      continue;
+    }
+    bool known = _applications.count(m.pid);
+    MonitoredApplication& application = _applications[m.pid];
+    application.pid = m.pid;
+    if (m.type == MESSAGE_TYPE_START) {
+      application.name = m.name;
+      application.labels = m.labels;
+    } else if (m.type == MESSAGE_TYPE_SAMPLE_RES) {
+      // The application started before we were connected, and thus its
+      // start message was lost.
+      if (!known) {
+        send(MESSAGE_TYPE_INFO_REQ, m.pid);
+      }
+      MultiSample sample;
+      sample.pid = m.pid;
+      sample.sample = m.sample.sample;
+      sample.phaseId = m.phaseId;
+      sample.activeThreads = m.sample.activeThreads;
+      sample.latencyPercentiles = m.sample.latencyPercentiles;
+      samples.push_back(sample);
+    } else if (m.type == MESSAGE_TYPE_STOP) {
+      application.executionTime = m.executionTime;
+      application.totalTasks = m.totalTasks;
+      terminated.push_back(application);
+      _applications.erase(m.pid);
+      // The socket is not closed right after, so the application receives
+      // it.
+      send(MESSAGE_TYPE_STOPACK, m.pid);
+    }
+  }
+}
+
+const std::map<pid_t, MonitoredApplication>& MultiMonitor::getApplications()
+    const {
+  return _applications;
+}
+
+SurveyMonitor::SurveyMonitor(const std::string& channelName,
+                             unsigned int deadlineMs)
+    : _channel(AF_SP, NN_SURVEYOR) {
+  int deadline = deadlineMs;
+  _channel.setsockopt(NN_SURVEYOR, NN_SURVEYOR_DEADLINE, &deadline,
+                      sizeof(deadline));
+  _chid = _channel.bind(channelName.c_str());
+  assert(_chid >= 0);
+}
+
+SurveyMonitor::~SurveyMonitor() {
+  _channel.shutdown(_chid);
+}
+
+void SurveyMonitor::survey(JobSample& job) {
+  job = JobSample();
+  Message m;
+  m.type = MESSAGE_TYPE_SAMPLE_REQ;
+  if (sendMessage(_channel, m, 0) <= 0) {
+    throw std::runtime_error("Impossible to send the survey.");
+  }
+
+  std::set<pid_t> answered;
+  unsigned int inconsistentSamples = 0;
+  int r;
+  while (true) {
+    try {
+      r = receiveMessage(_channel, m, 0);
+    } catch (const nn::exception& e) {
+      if (e.num() == ETIMEDOUT) {
+        break;
+      }
+      throw;
+    }
+    // Encoded by an incompatible version.
+    if (!r) {
+      continue;
+    }
+    answered.insert(m.pid);
+    if (m.type == MESSAGE_TYPE_STOP) {
+      MonitoredApplication application;
+      application.pid = m.pid;
+      application.executionTime = m.executionTime;
+      application.totalTasks = m.totalTasks;
+      job.terminated.push_back(application);
+      _applications.erase(m.pid);
+    } else if (m.type == MESSAGE_TYPE_SAMPLE_RES) {
+      _applications[m.pid].pid = m.pid;
+      MultiSample sample;
+      sample.pid = m.pid;
+      sample.sample = m.sample.sample;
+      sample.phaseId = m.phaseId;
+      sample.activeThreads = m.sample.activeThreads;
+      sample.latencyPercentiles = m.sample.latencyPercentiles;
+      job.samples.push_back(sample);
+
+      const ApplicationSample& s = sample.sample;
+      if (s.inconsistent) {
+        ++inconsistentSamples;
+      } else {
+        job.sample.loadPercentage += s.loadPercentage;
+        job.sample.latency += s.latency;
+      }
+      job.sample.throughput += s.throughput;
+      job.sample.numTasks += s.numTasks;
+      for (size_t i = 0; i < RIFF_MAX_CUSTOM_FIELDS; i++) {
+        job.sample.customFields[i] += s.customFields[i];
+      }
+    }
+  }
+  size_t updatedSamples = job.samples.size();
+  if (updatedSamples) {
+    if (inconsistentSamples == updatedSamples) {
+      job.sample.inconsistent = true;
+    } else {
+      job.sample.loadPercentage /= (updatedSamples - inconsistentSamples);
+      job.sample.latency /= (updatedSamples - inconsistentSamples);
+    }
+  }
+  for (const auto& a : _applications) {
+    if (!answered.count(a.first)) {
+      job.missing.push_back(a.first);
+    }
+  }
+}
+
+const std::map<pid_t, MonitoredApplication>& SurveyMonitor::getApplications()
+    const {
+  return _applications;
+}
+
 }  // namespace riff
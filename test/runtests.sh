@@ -2,13 +2,16 @@
 GREEN='\033[0;32m'
 RED='\033[0;31m'
 NC='\033[0m' # No Color
+# Run without a second process.
+STANDALONE="test4 test30 test31"
 
 
-for TESTNAME in test1 test2 test3 test4 test5 test6
+for TESTNAME in test1 test2 test3 test4 test5 test6 test7 test8 test9 test10 test11 test12 test13 test14 test15 test16 test17 test18 test19 test20 test21 test22 test23 test24 test25 test26 test27 test28 test29 test30 test31
 do
-# Ugly, but we need to run the application before the monitor.
-    if [[ $TESTNAME != "test4" ]]; then
-        sleep 3 && eval ./$TESTNAME 1 &>/dev/null &
+# The monitor attaches to the application whenever they start. The
+# standalone tests have no monitor.
+    if [[ " $STANDALONE " != *" $TESTNAME "* ]]; then
+        eval ./$TESTNAME 1 &>/dev/null &
     fi
     OUT=$(eval ./$TESTNAME 0 2>&1)
     RESULT=$?
@@ -0,0 +1,76 @@
+/**
+ * Test: Checks the correctness of the latency percentiles.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 3000
+// Percentage of the tasks computed with SLOW_LATENCY. Well above 10, so
+// that p90 is not affected by occasional preemptions of the busy wait.
+#define SLOW_PERCENTAGE 30
+// Samples with less tasks are not checked.
+#define MIN_TASKS 100
+
+// In microseconds
+#define LATENCY 1000
+#define SLOW_LATENCY 5000
+#define MONITORING_INTERVAL 1000000
+
+// In percentage
+#define MAX_LATENCY_DIFFERENCE 20
+
+static bool checkPercentile(const char* name, double actual, double expected){
+    if(actual < expected ||
+       (actual - expected) / expected * 100.0 > MAX_LATENCY_DIFFERENCE){
+        std::cerr << "Expected " << name << ": " << expected << " Actual: " << actual << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            const riff::LatencyPercentiles& lp = mon.getLatencyPercentiles();
+            std::cout << "Received sample: " << sample << " " << lp << std::endl;
+            if(lp.p50 > lp.p90 || lp.p90 > lp.p99 || lp.p99 > lp.p999 || lp.p999 > lp.max){
+                std::cerr << "Percentiles not sorted." << std::endl;
+                return -1;
+            }
+            if(sample.numTasks >= MIN_TASKS &&
+               (!checkPercentile("p50", lp.p50, LATENCY*1000.0) ||
+                !checkPercentile("p90", lp.p90, SLOW_LATENCY*1000.0))){
+                return -1;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+    }else{
+        riff::Application app(CHNAME);
+        // Randomly chosen, so that the tasks with SLOW_LATENCY are not
+        // aliased with the adaptive sampling.
+        srand(1);
+        for(size_t i = 0; i < ITERATIONS; i++){
+            unsigned long latency = (rand() % 100 < SLOW_PERCENTAGE) ? SLOW_LATENCY : LATENCY;
+            app.begin(0);
+            unsigned long start = riff::getCurrentTimeNs();
+            do{;}while(riff::getCurrentTimeNs() - start < latency*1000.0);
+            app.end(0);
+        }
+        app.terminate();
+    }
+    return 0;
+}
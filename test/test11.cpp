@@ -0,0 +1,73 @@
+/**
+ * Test: Checks the correctness of an application with a fixed sampling
+ * length, a single thread and no custom fields.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 2000
+#define SAMPLING_LENGTH 4
+#ifndef TOLERANCE
+#define TOLERANCE 0.1 // Between 0 and 1
+#endif
+
+// In microseconds
+#define IDLE_TIME 1000
+#define LATENCY 1000
+#define MONITORING_INTERVAL 1000000
+
+typedef riff::BasicApplication<riff::ApplicationPolicy<false, SAMPLING_LENGTH, false, false> > LeanApplication;
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            std::cout << "Received sample: " << sample << std::endl;
+            double expectedLatency = LATENCY*1000; // To nanoseconds
+            double expectedUtilization = ((double)LATENCY / ((double) (IDLE_TIME + LATENCY))) * 100;
+            if(abs(expectedLatency - sample.latency)/(double) expectedLatency > TOLERANCE){
+                std::cerr << "Expected latency: " << expectedLatency <<
+                             " Actual latency: " << sample.latency << std::endl;
+                return -1;
+            }
+            if(abs(expectedUtilization - sample.loadPercentage)/(double) expectedUtilization > TOLERANCE){
+                std::cerr << "Expected utilization: " << expectedUtilization <<
+                             " Actual utilization: " << sample.loadPercentage << std::endl;
+                return -1;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+        if(mon.getTotalTasks() != ITERATIONS){
+            std::cerr << "Expected tasks: " << ITERATIONS <<
+                         " Actual tasks: " << mon.getTotalTasks() << std::endl;
+            return -1;
+        }
+    }else{
+        LeanApplication app(CHNAME);
+        for(size_t i = 0; i < ITERATIONS; i++){
+            busyWait(IDLE_TIME);
+            app.begin();
+            busyWait(LATENCY);
+            app.end();
+        }
+        app.terminate();
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * Test: Checks the correctness of the samples when iterations are delimited
+ * with next() and when batches are recorded with endBatch().
+ */
+#include <riff/riff.hpp>
+
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 2000
+#define BATCH_SIZE 8
+#define TOLERANCE 0.1 // Between 0 and 1
+
+// In microseconds
+#define IDLE_TIME 1000
+#define LATENCY 1000
+#define MONITORING_INTERVAL 1000000
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+static bool checkValue(const char* name, double actual, double expected){
+    if(fabs(expected - actual) / expected > TOLERANCE){
+        std::cerr << "Expected " << name << ": " << expected <<
+                     " Actual " << name << ": " << actual << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            const std::vector<riff::RegionSample>& regions = mon.getRegionSamples();
+            if(regions.size() != 1){
+                std::cerr << "Expected 1 region, got " << regions.size() << std::endl;
+                return -1;
+            }
+            const riff::ApplicationSample& loop = regions[0].sample;
+            std::cout << "Received sample: " << sample << std::endl;
+            std::cout << "Region " << regions[0].name << ": " << loop << std::endl;
+            if(sample.inconsistent || loop.inconsistent){
+                usleep(MONITORING_INTERVAL);
+                continue;
+            }
+            // Batches: the tasks share the time of the batch.
+            if(!checkValue("batch latency", sample.latency, LATENCY*1000.0 / BATCH_SIZE) ||
+               !checkValue("batch utilization", sample.loadPercentage,
+                           (double) LATENCY / (IDLE_TIME + LATENCY) * 100)){
+                return -1;
+            }
+            // Iterations delimited by next(): no idle time between them.
+            if(!checkValue("loop latency", loop.latency, (IDLE_TIME + LATENCY)*1000.0) ||
+               !checkValue("loop utilization", loop.loadPercentage, 100) ||
+               !checkValue("throughput ratio", sample.throughput / loop.throughput, BATCH_SIZE)){
+                return -1;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::Region& loop = app.region("loop");
+        loop.begin();
+        for(size_t i = 0; i < ITERATIONS; i++){
+            busyWait(IDLE_TIME);
+            unsigned long long start = riff::getCurrentTimeNs();
+            busyWait(LATENCY);
+            app.endBatch(BATCH_SIZE, riff::getCurrentTimeNs() - start);
+            loop.next();
+        }
+        loop.end();
+        app.terminate();
+    }
+    return 0;
+}
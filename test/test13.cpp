@@ -0,0 +1,94 @@
+/**
+ * Test: Checks the conversion of the clock ticks to nanoseconds.
+ */
+#include <riff/riff.hpp>
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 2000
+#define TOLERANCE 0.1 // Between 0 and 1
+// Maximum difference between the durations measured with getCurrentTimeNs()
+// and with clock_gettime() (Between 0 and 1).
+#define CLOCK_TOLERANCE 0.01
+
+// In microseconds
+#define IDLE_TIME 1000
+#define LATENCY 1000
+#define CLOCK_CHECK_TIME 100000
+#define MONITORING_INTERVAL 1000000
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+static unsigned long long getMonotonicTimeNs(){
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            std::cout << "Received sample: " << sample << std::endl;
+            double expectedLatency = LATENCY*1000; // To nanoseconds
+            double expectedThroughput = 1000000.0 / (IDLE_TIME + LATENCY);
+            if(!sample.inconsistent &&
+               fabs(expectedLatency - sample.latency)/expectedLatency > TOLERANCE){
+                std::cerr << "Expected latency: " << expectedLatency <<
+                             " Actual latency: " << sample.latency << std::endl;
+                return -1;
+            }
+            if(fabs(expectedThroughput - sample.throughput)/expectedThroughput > TOLERANCE){
+                std::cerr << "Expected throughput: " << expectedThroughput <<
+                             " Actual throughput: " << sample.throughput << std::endl;
+                return -1;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+    }else{
+        riff::Application app(CHNAME);
+        std::cout << "Clock source: " << riff::getClockSource() <<
+                     " Ns per tick: " << riff::getNsPerTick() << std::endl;
+        try{
+            riff::setClockSource(riff::CLOCK_SOURCE_MONOTONIC);
+            std::cerr << "The clock source changed after its use." << std::endl;
+            return -1;
+        }catch(const std::runtime_error& e){
+            ;
+        }
+        unsigned long long startNs = riff::getCurrentTimeNs();
+        unsigned long long startMonotonic = getMonotonicTimeNs();
+        usleep(CLOCK_CHECK_TIME);
+        double elapsed = riff::getCurrentTimeNs() - startNs;
+        double elapsedMonotonic = getMonotonicTimeNs() - startMonotonic;
+        if(fabs(elapsed - elapsedMonotonic)/elapsedMonotonic > CLOCK_TOLERANCE){
+            std::cerr << "Expected elapsed time: " << elapsedMonotonic <<
+                         " Actual elapsed time: " << elapsed << std::endl;
+            return -1;
+        }
+        for(size_t i = 0; i < ITERATIONS; i++){
+            busyWait(IDLE_TIME);
+            app.begin();
+            busyWait(LATENCY);
+            app.end();
+        }
+        app.terminate();
+    }
+    return 0;
+}
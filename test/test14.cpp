@@ -0,0 +1,125 @@
+/**
+ * Test: Checks that the sampling keeps the overhead within the budget
+ * specified in the configuration, both with short and long tasks. The
+ * overhead is both the one reported in the samples and the one measured by
+ * timing the short tasks with and without the instrumentation.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define SHORT_ITERATIONS 1000000
+#define ROUNDS 20
+#define ROUND_ITERATIONS 25000
+#define LONG_ITERATIONS 3000
+#define MAX_OVERHEAD_PERCENTAGE 0.5
+#define TOLERANCE 0.2 // Between 0 and 1
+// The calls skipped in the middle of the tasks cost more than in the loop
+// where the application measures them, so the overhead of the short tasks
+// can exceed the budget. It is still far from the one of recording all the
+// calls (a few percent).
+#define MAX_MEASURED_OVERHEAD_PERCENTAGE 2.0
+// Index of the custom field with the ratio between the times of the short
+// tasks with and without the instrumentation.
+#define TIME_RATIO_FIELD 0
+
+// In microseconds
+#define SHORT_LATENCY 2
+#define LONG_LATENCY 1000
+#define MONITORING_INTERVAL 1000000
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+// Returns the time (ns) spent computing short tasks, instrumented if app
+// is not NULL.
+static double runShortTasks(riff::Application* app, size_t iterations){
+    unsigned long long start = riff::getCurrentTimeNs();
+    for(size_t i = 0; i < iterations; i++){
+        if(app){
+            app->begin();
+        }
+        busyWait(SHORT_LATENCY);
+        if(app){
+            app->end();
+        }
+    }
+    return riff::getCurrentTimeNs() - start;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        bool sampledShort = false, notSampledLong = false;
+        double timeRatio = 0;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            const riff::SamplingStatistics& ss = mon.getSamplingStatistics();
+            std::cout << "Received sample: " << sample << " " << ss << std::endl;
+            if(ss.overheadPercentage > MAX_OVERHEAD_PERCENTAGE * (1 + TOLERANCE)){
+                std::cerr << "Overhead above the budget." << std::endl;
+                return -1;
+            }
+            if(sample.latency < SHORT_LATENCY * 1000 * 10 && ss.samplingLength > 1){
+                sampledShort = true;
+            }
+            if(sample.latency > LONG_LATENCY * 1000 * 0.9 && ss.samplingLength == 1){
+                notSampledLong = true;
+            }
+            if(sample.customFields[TIME_RATIO_FIELD]){
+                timeRatio = sample.customFields[TIME_RATIO_FIELD];
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+        if(!sampledShort || !notSampledLong){
+            std::cerr << "Short tasks must be sampled, long ones not." << std::endl;
+            return -1;
+        }
+        if(!timeRatio){
+            std::cerr << "Times of the short tasks not received." << std::endl;
+            return -1;
+        }
+        double overhead = (timeRatio - 1) * 100.0;
+        std::cout << "Measured overhead: " << overhead << "%" << std::endl;
+        if(overhead > MAX_MEASURED_OVERHEAD_PERCENTAGE){
+            std::cerr << "Measured overhead too high." << std::endl;
+            return -1;
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.maxOverheadPercentage = MAX_OVERHEAD_PERCENTAGE;
+        app.setConfiguration(conf);
+        // Lets the sampling length converge.
+        runShortTasks(&app, SHORT_ITERATIONS);
+        // Consecutive rounds run in the same conditions, and the median
+        // discards the ones disturbed by the rest of the system.
+        std::vector<double> ratios;
+        for(size_t r = 0; r < ROUNDS; r++){
+            double baseline = runShortTasks(NULL, ROUND_ITERATIONS);
+            ratios.push_back(runShortTasks(&app, ROUND_ITERATIONS) / baseline);
+        }
+        std::sort(ratios.begin(), ratios.end());
+        // Received by the monitor with the samples of the long tasks.
+        app.storeCustomValue(TIME_RATIO_FIELD, ratios[ROUNDS / 2]);
+        for(size_t i = 0; i < LONG_ITERATIONS; i++){
+            app.begin();
+            busyWait(LONG_LATENCY);
+            app.end();
+        }
+        app.terminate();
+    }
+    return 0;
+}
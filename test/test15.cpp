@@ -0,0 +1,72 @@
+/**
+ * Test: Checks that random sampling correctly estimates the latency when
+ * the tasks follow a periodic pattern aligned with the sampling length.
+ */
+#include <riff/riff.hpp>
+
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 40000
+#define SAMPLING_LENGTH 4
+// One task every PERIOD is slow. With deterministic sampling, always the
+// same task of the period would be measured.
+#define PERIOD 8
+#define TOLERANCE 0.2 // Between 0 and 1
+
+// In microseconds
+#define LATENCY 100
+#define SLOW_LATENCY 1000
+#define MONITORING_INTERVAL 2000000
+
+// Adaptive, so that the sampling length is chosen at runtime, but starting
+// from SAMPLING_LENGTH and never updated (samplingLengthMs is 0).
+typedef riff::BasicApplication<riff::ApplicationPolicy<true, SAMPLING_LENGTH> > SampledApplication;
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            std::cout << "Received sample: " << sample << " " << mon.getSamplingStatistics() << std::endl;
+            double expectedLatency = (LATENCY * (PERIOD - 1) + SLOW_LATENCY) * 1000.0 / PERIOD;
+            if(sample.inconsistent ||
+               fabs(expectedLatency - sample.latency) / expectedLatency > TOLERANCE){
+                std::cerr << "Expected latency: " << expectedLatency <<
+                             " Actual latency: " << sample.latency << std::endl;
+                return -1;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+    }else{
+        SampledApplication app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.samplingLengthMs = 0;
+        conf.randomSampling = true;
+        // The estimates of random sampling have a higher variance.
+        conf.consistencyThreshold = 30;
+        app.setConfiguration(conf);
+        for(size_t i = 0; i < ITERATIONS; i++){
+            app.begin();
+            busyWait(i % PERIOD ? LATENCY : SLOW_LATENCY);
+            app.end();
+        }
+        app.terminate();
+    }
+    return 0;
+}
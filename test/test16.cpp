@@ -0,0 +1,111 @@
+/**
+ * Test: Checks that the values stored in typed metrics by several threads
+ * are reduced and merged without losing any of them.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <thread>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 3000
+#define NUM_THREADS 2
+#define TOLERANCE 0.01 // Between 0 and 1
+
+// In microseconds
+#define LATENCY 1000
+#define MONITORING_INTERVAL 500000
+
+struct TestMetrics{
+    riff::Metric<riff::METRIC_SUM> tasks;
+    riff::Metric<riff::METRIC_MEAN> mean;
+    riff::Metric<riff::METRIC_MIN> min;
+    riff::Metric<riff::METRIC_MAX> max;
+    riff::Metric<riff::METRIC_LAST> last;
+
+    template<typename Visitor> void visit(Visitor& v){
+        v(tasks); v(mean); v(min); v(max); v(last);
+    }
+};
+
+typedef riff::BasicApplication<riff::ApplicationPolicy<true, RIFF_DEFAULT_SAMPLING_LENGTH, true, false, TestMetrics> > MetricsApplication;
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        double storedTasks = 0, tasks = 0;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            TestMetrics metrics;
+            mon.getMetrics(metrics);
+            std::cout << "Received sample: " << sample << " Tasks metric: " <<
+                         metrics.tasks.get() << std::endl;
+            storedTasks += metrics.tasks.get();
+            tasks += sample.numTasks;
+            if(metrics.tasks.getCount() && std::abs(metrics.mean.get() - 10) > 0.1){
+                std::cerr << "Expected mean: 10 Actual mean: " << metrics.mean.get() << std::endl;
+                return -1;
+            }
+            if(metrics.last.getCount() && metrics.last.get() != 42){
+                std::cerr << "Expected last: 42 Actual last: " << metrics.last.get() << std::endl;
+                return -1;
+            }
+            if(metrics.min.get() > metrics.max.get() ||
+               metrics.min.getCount() != metrics.tasks.getCount()){
+                std::cerr << "Wrong min/max: " << metrics.min.get() << " " <<
+                             metrics.max.get() << std::endl;
+                return -1;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+        // Each task stores one value, and the values stored after the last
+        // sample are not received (as the tasks).
+        double expected = tasks;
+        if(std::abs(expected - storedTasks) / expected > TOLERANCE){
+            std::cerr << "Expected tasks: " << expected << " Actual tasks: " <<
+                         storedTasks << std::endl;
+            return -1;
+        }
+    }else{
+        MetricsApplication app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.samplingLengthMs = 0;
+        app.setConfiguration(conf);
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < NUM_THREADS; t++){
+            threads.push_back(std::thread([&app, t](){
+                MetricsApplication::ThreadHandle handle = app.getThreadHandle();
+                TestMetrics& metrics = handle.metrics();
+                for(size_t i = 0; i < ITERATIONS; i++){
+                    handle.begin();
+                    busyWait(LATENCY);
+                    handle.end();
+                    metrics.tasks.store(1);
+                    metrics.mean.store(i % 2 ? 5 : 15);
+                    metrics.min.store(t*ITERATIONS + i);
+                    metrics.max.store(t*ITERATIONS + i);
+                    metrics.last.store(42);
+                }
+            }));
+        }
+        for(std::thread& t : threads){
+            t.join();
+        }
+        app.terminate();
+    }
+    return 0;
+}
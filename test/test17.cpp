@@ -0,0 +1,111 @@
+/**
+ * Test: Checks the named counters and gauges, including the ones
+ * registered while the application is running and the ones updated by
+ * threads which never call begin() and terminate.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <thread>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 3000
+#define NUM_THREADS 2
+#define BYTES_PER_TASK 10
+#define LATE_INCREMENTS 1000
+#define TOLERANCE 0.01 // Between 0 and 1
+
+// In microseconds
+#define LATENCY 1000
+#define LATE_REGISTRATION 1000000
+#define MONITORING_INTERVAL 500000
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        double bytes = 0, late = 0, tasks = 0;
+        bool fullQueue = false;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            std::cout << "Received sample: " << sample.numTasks << " tasks";
+            tasks += sample.numTasks;
+            for(const riff::NamedMetric& m : mon.getNamedMetrics()){
+                std::cout << " " << m.name << ": " << m.value;
+                if(m.name == "bytes_in"){
+                    bytes += m.value;
+                }else if(m.name == "late"){
+                    late += m.value;
+                }else if(m.name == "queue_len"){
+                    // Each worker reports its own queue (1 + its index).
+                    if(m.value != 0 && m.value != 1 && m.value != 2 && m.value != 3){
+                        std::cerr << std::endl << "Wrong queue_len: " << m.value << std::endl;
+                        return -1;
+                    }
+                    fullQueue = fullQueue || m.value == 3;
+                }
+            }
+            std::cout << std::endl;
+            usleep(MONITORING_INTERVAL);
+        }
+        // The tasks computed after the last sample are not received.
+        double expected = tasks*BYTES_PER_TASK;
+        if(std::abs(expected - bytes) / expected > TOLERANCE){
+            std::cerr << "Expected bytes_in: " << expected << " Actual: " << bytes << std::endl;
+            return -1;
+        }
+        if(late != LATE_INCREMENTS){
+            std::cerr << "Expected late: " << LATE_INCREMENTS << " Actual: " << late << std::endl;
+            return -1;
+        }
+        if(!fullQueue){
+            std::cerr << "The gauges of the two workers were never summed." << std::endl;
+            return -1;
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.samplingLengthMs = 0;
+        app.setConfiguration(conf);
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < NUM_THREADS; t++){
+            threads.push_back(std::thread([&app, t](){
+                riff::Application::Counter bytes = app.counter("bytes_in");
+                riff::Application::Gauge queue = app.gauge("queue_len");
+                for(size_t i = 0; i < ITERATIONS; i++){
+                    app.begin();
+                    busyWait(LATENCY);
+                    app.end();
+                    bytes.add(BYTES_PER_TASK);
+                    queue.set(1 + t);
+                }
+            }));
+        }
+        // Like a plugin loaded later, whose thread never calls begin().
+        threads.push_back(std::thread([&app](){
+            usleep(LATE_REGISTRATION);
+            riff::Application::Counter late = app.counter("late");
+            for(size_t i = 0; i < LATE_INCREMENTS; i++){
+                late.add();
+            }
+        }));
+        for(std::thread& t : threads){
+            t.join();
+        }
+        app.terminate();
+    }
+    return 0;
+}
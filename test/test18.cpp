@@ -0,0 +1,75 @@
+/**
+ * Test: Checks the performance counters of the threads. Inside virtual
+ * machines without a virtual PMU only the software events are available.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 2000
+// Each task touches a new page, causing a page fault.
+#define PAGE_SIZE 4096
+#define TOLERANCE 0.1 // Between 0 and 1
+
+// In microseconds
+#define LATENCY 1000
+#define MONITORING_INTERVAL 1000000
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            const riff::PerformanceCounters& pc = mon.getPerformanceCounters();
+            std::cout << "Received sample: " << sample << " " << pc << std::endl;
+            if(!sample.numTasks){
+                usleep(MONITORING_INTERVAL);
+                continue;
+            }
+            if(!pc.software){
+                std::cerr << "Software events not available." << std::endl;
+                return -1;
+            }
+            // Each task sleeps, so it leaves the CPU at least once. The
+            // events are read slightly after the tasks are published, so a
+            // few of them may be counted in the next sample.
+            double expected = sample.numTasks*(1 - TOLERANCE);
+            if(pc.contextSwitches < expected || pc.pageFaults < expected){
+                std::cerr << "Expected at least " << expected <<
+                             " context switches and page faults." << std::endl;
+                return -1;
+            }
+            if(pc.hardware && (pc.ipc <= 0 || pc.cacheMissRate > 1 || pc.branchMissRate > 1)){
+                std::cerr << "Wrong hardware events." << std::endl;
+                return -1;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.perfCounters = true;
+        conf.samplingLengthMs = 0;
+        app.setConfiguration(conf);
+        char* memory = new char[(ITERATIONS + 1)*PAGE_SIZE];
+        for(size_t i = 0; i < ITERATIONS; i++){
+            app.begin();
+            memory[i*PAGE_SIZE] = 1;
+            usleep(LATENCY);
+            app.end();
+        }
+        app.terminate();
+        delete[] memory;
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * Test: Checks the scheduling statistics of a thread which alternates
+ * computing and sleeping for the same time.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 2000
+#define TOLERANCE 0.1 // Between 0 and 1
+
+// In microseconds
+#define LATENCY 1000
+#define IDLE_TIME 1000
+#define MONITORING_INTERVAL 1000000
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            const riff::SchedulingStatistics& ss = mon.getSchedulingStatistics();
+            std::cout << "Received sample: " << sample << " " << ss << std::endl;
+            if(!sample.numTasks){
+                usleep(MONITORING_INTERVAL);
+                continue;
+            }
+            if(!ss.available){
+                std::cerr << "Scheduling statistics not available." << std::endl;
+                return -1;
+            }
+            double sum = ss.onCpuFraction + ss.runnableFraction + ss.blockedFraction;
+            if(std::abs(sum - 1) > 0.001){
+                std::cerr << "The fractions do not sum to 1." << std::endl;
+                return -1;
+            }
+            // The thread is never blocked while computing a task, and
+            // always blocked outside them (sleeping takes a bit longer than
+            // requested, so it is not exactly half of the time).
+            double expected = sample.loadPercentage / 100.0;
+            if(!sample.inconsistent &&
+               (std::abs(ss.onCpuFraction + ss.runnableFraction - expected) > TOLERANCE ||
+                std::abs(ss.blockedFraction - (1 - expected)) > TOLERANCE)){
+                std::cerr << "Expected on CPU fraction around " << expected << std::endl;
+                return -1;
+            }
+            // The thread leaves the CPU at each sleep.
+            if(ss.voluntaryContextSwitches < sample.numTasks*(1 - TOLERANCE)){
+                std::cerr << "Expected at least " << sample.numTasks <<
+                             " voluntary context switches." << std::endl;
+                return -1;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.schedulingStatistics = true;
+        app.setConfiguration(conf);
+        for(size_t i = 0; i < ITERATIONS; i++){
+            app.begin();
+            busyWait(LATENCY);
+            app.end();
+            usleep(IDLE_TIME);
+        }
+        app.terminate();
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * Test: Checks that the tasks are assigned to the right phase, and the
+ * statistics of the phases queried after they ended.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define NUM_PHASES 3
+#define MONITORING_INTERVAL 500000
+
+// In percentage. The busy wait takes a bit longer than requested.
+#define MAX_LATENCY_DIFFERENCE 25
+
+// Latency (microseconds) and number of tasks of each phase. The last one
+// makes sure that the second one ended before the application terminates.
+static const unsigned long latencies[NUM_PHASES] = {200, 2000, 1000};
+static const unsigned long tasks[NUM_PHASES] = {5000, 1000, 1500};
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            std::cout << "Received sample: " << sample << " Phase: " << mon.getPhaseId() << std::endl;
+            usleep(MONITORING_INTERVAL);
+        }
+        for(unsigned int phase = 0; phase < NUM_PHASES - 1; phase++){
+            riff::PhaseStatistics ps;
+            if(!mon.getPhaseStatistics(phase, ps)){
+                std::cerr << "No statistics for phase " << phase << std::endl;
+                return -1;
+            }
+            std::cout << ps << std::endl;
+            // All the tasks are recorded, so none of them is extrapolated.
+            if(ps.numTasks != tasks[phase]){
+                std::cerr << "Expected tasks: " << tasks[phase] << std::endl;
+                return -1;
+            }
+            double expectedLatency = latencies[phase]*1000.0;
+            if(ps.latency < expectedLatency ||
+               (ps.latency - expectedLatency) / expectedLatency * 100.0 > MAX_LATENCY_DIFFERENCE){
+                std::cerr << "Expected latency: " << expectedLatency << std::endl;
+                return -1;
+            }
+            // A single thread, always busy.
+            double expectedDurationMs = ps.numTasks * ps.latency / 1000000.0;
+            if(std::abs(ps.durationMs - expectedDurationMs) / expectedDurationMs * 100.0 > MAX_LATENCY_DIFFERENCE){
+                std::cerr << "Expected duration: " << expectedDurationMs << std::endl;
+                return -1;
+            }
+        }
+        riff::PhaseStatistics ps;
+        if(mon.getPhaseStatistics(NUM_PHASES, ps)){
+            std::cerr << "Statistics for a phase never started." << std::endl;
+            return -1;
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.samplingLengthMs = 0;
+        app.setConfiguration(conf);
+        for(unsigned int phase = 0; phase < NUM_PHASES; phase++){
+            app.setPhaseId(phase);
+            for(size_t i = 0; i < tasks[phase]; i++){
+                app.begin();
+                busyWait(latencies[phase]);
+                app.end();
+            }
+        }
+        app.terminate();
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+/**
+ * Test: Polls the samples at high frequency from the shared memory segment
+ * of the application, checking that no task is lost.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <thread>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 2000
+#define NUM_THREADS 2
+// Less samples would mean that polling is not cheap.
+#define MIN_SAMPLES 100
+
+// In microseconds
+#define LATENCY 1000
+#define POLLING_INTERVAL 1000
+
+// In percentage. The busy wait takes a bit longer than requested.
+#define MAX_LATENCY_DIFFERENCE 25
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        pid_t pid = mon.waitStart();
+        riff::SharedMonitor shm(pid);
+        riff::ApplicationSample sample, total;
+        size_t samples = 0, consistentSamples = 0;
+        while(shm.getSample(sample)){
+            total.numTasks += sample.numTasks;
+            if(sample.numTasks && !sample.inconsistent){
+                total.latency += sample.latency;
+                ++consistentSamples;
+            }
+            ++samples;
+            usleep(POLLING_INTERVAL);
+        }
+        std::cout << "Received " << samples << " samples, tasks: " << total.numTasks << std::endl;
+        // Receives the termination.
+        while(mon.getSample(sample)){;}
+        // All the tasks are recorded, so none of them is extrapolated.
+        if(total.numTasks != ITERATIONS*NUM_THREADS){
+            std::cerr << "Expected tasks: " << ITERATIONS*NUM_THREADS << std::endl;
+            return -1;
+        }
+        if(samples < MIN_SAMPLES){
+            std::cerr << "Expected at least " << MIN_SAMPLES << " samples." << std::endl;
+            return -1;
+        }
+        double latency = total.latency / consistentSamples;
+        double expectedLatency = LATENCY*1000.0;
+        if(latency < expectedLatency ||
+           (latency - expectedLatency) / expectedLatency * 100.0 > MAX_LATENCY_DIFFERENCE){
+            std::cerr << "Expected latency: " << expectedLatency << " Actual: " << latency << std::endl;
+            return -1;
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.samplingLengthMs = 0;
+        conf.sharedMemory = true;
+        app.setConfiguration(conf);
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < NUM_THREADS; t++){
+            threads.push_back(std::thread([&app](){
+                for(size_t i = 0; i < ITERATIONS; i++){
+                    app.begin();
+                    busyWait(LATENCY);
+                    app.end();
+                }
+            }));
+        }
+        for(std::thread& t : threads){
+            t.join();
+        }
+        app.terminate();
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * Test: Checks the samples pushed by the application, including the ones
+ * pushed while the monitor is too slow to get them.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 3000
+#define QUEUE_LENGTH 4
+#define LATE_INCREMENTS 7
+// Samples received before and after stalling the monitor.
+#define FAST_SAMPLES 100
+#define TOLERANCE 0.2 // Between 0 and 1
+
+// In milliseconds
+#define PUSH_INTERVAL 1
+#define MONITOR_STALL 2000
+
+// In microseconds
+#define LATENCY 1000
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        double tasks = 0, late = 0;
+        size_t samples = 0;
+        while(mon.nextSample(sample)){
+            tasks += sample.numTasks;
+            for(const riff::NamedMetric& m : mon.getNamedMetrics()){
+                if(m.name == "late"){
+                    late += m.value;
+                }
+            }
+            if(++samples == FAST_SAMPLES){
+                // Way more samples than the ones which can be queued.
+                usleep(MONITOR_STALL*1000);
+            }
+        }
+        std::cout << "Received: " << samples << " Dropped: " << mon.getDroppedSamples() <<
+                     " Tasks: " << tasks << " Late: " << late << std::endl;
+        if(!mon.getDroppedSamples()){
+            std::cerr << "No samples dropped." << std::endl;
+            return -1;
+        }
+        if(tasks >= ITERATIONS){
+            std::cerr << "The dropped samples have been received." << std::endl;
+            return -1;
+        }
+        // One sample every PUSH_INTERVAL, dropped or not.
+        double expected = mon.getExecutionTime() / PUSH_INTERVAL;
+        double pushed = samples + mon.getDroppedSamples();
+        if(std::abs(pushed - expected) / expected > TOLERANCE){
+            std::cerr << "Expected samples: " << expected << std::endl;
+            return -1;
+        }
+        // Registered while the monitor was stalled, so its name was likely
+        // in a dropped sample.
+        if(late != LATE_INCREMENTS){
+            std::cerr << "Expected late: " << LATE_INCREMENTS << std::endl;
+            return -1;
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.samplingLengthMs = 0;
+        conf.pushIntervalMs = PUSH_INTERVAL;
+        conf.pushQueueLength = QUEUE_LENGTH;
+        app.setConfiguration(conf);
+        for(size_t i = 0; i < ITERATIONS; i++){
+            app.begin();
+            busyWait(LATENCY);
+            app.end();
+            if(i == ITERATIONS / 2){
+                app.counter("late").add(LATE_INCREMENTS);
+            }
+        }
+        app.terminate();
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+/**
+ * Test: Monitors several applications with a single MultiMonitor, without
+ * ever blocking on any of them.
+ */
+#include <riff/riff.hpp>
+
+#include <poll.h>
+#include <set>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define NUM_APPLICATIONS 3
+#define ITERATIONS 2000
+
+// In microseconds
+#define LATENCY 1000
+// In milliseconds
+#define MONITORING_INTERVAL 100
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::MultiMonitor mon(CHNAME);
+        std::map<pid_t, double> tasks;
+        std::vector<riff::MonitoredApplication> terminated;
+        struct pollfd pfd;
+        pfd.fd = mon.getFd();
+        pfd.events = POLLIN;
+        unsigned long long nextRequest = 0;
+        while(terminated.size() < NUM_APPLICATIONS){
+            unsigned long long now = riff::getCurrentTimeNs() / 1000000;
+            if(now >= nextRequest){
+                mon.requestSamples();
+                nextRequest = now + MONITORING_INTERVAL;
+            }
+            poll(&pfd, 1, MONITORING_INTERVAL);
+            std::vector<riff::MultiSample> samples;
+            std::vector<riff::MonitoredApplication> t;
+            mon.collect(samples, t);
+            for(const riff::MultiSample& s : samples){
+                std::cout << "Received sample from " << s.pid << ": " << s.sample << std::endl;
+                tasks[s.pid] += s.sample.numTasks;
+            }
+            terminated.insert(terminated.end(), t.begin(), t.end());
+        }
+        if(!mon.getApplications().empty()){
+            std::cerr << "Terminated applications still running." << std::endl;
+            return -1;
+        }
+        std::set<std::string> names;
+        for(const riff::MonitoredApplication& a : terminated){
+            std::cout << a.pid << " " << a.name << " " << a.labels << " " << a.totalTasks << std::endl;
+            if(a.name.compare(0, 3, "app") || a.labels != "rank=" + a.name.substr(3)){
+                std::cerr << "Wrong name or labels." << std::endl;
+                return -1;
+            }
+            names.insert(a.name);
+            if(a.totalTasks != ITERATIONS){
+                std::cerr << "Expected tasks: " << ITERATIONS << std::endl;
+                return -1;
+            }
+            // The tasks after the last sample are not received.
+            if(!tasks[a.pid] || tasks[a.pid] > ITERATIONS){
+                std::cerr << "Wrong sampled tasks: " << tasks[a.pid] << std::endl;
+                return -1;
+            }
+        }
+        if(names.size() != NUM_APPLICATIONS){
+            std::cerr << "Duplicated applications." << std::endl;
+            return -1;
+        }
+    }else{
+        for(size_t i = 0; i < NUM_APPLICATIONS; i++){
+            if(fork() == 0){
+                nn::socket socket(AF_SP, NN_BUS);
+                riff::Application app(socket, socket.connect(CHNAME));
+                riff::ApplicationConfiguration conf;
+                conf.name = "app" + std::to_string(i);
+                conf.labels = "rank=" + std::to_string(i);
+                conf.samplingLengthMs = 0;
+                app.setConfiguration(conf);
+                for(size_t j = 0; j < ITERATIONS; j++){
+                    app.begin();
+                    busyWait(LATENCY);
+                    app.end();
+                }
+                app.terminate();
+                return 0;
+            }
+        }
+        for(size_t i = 0; i < NUM_APPLICATIONS; i++){
+            wait(NULL);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+/**
+ * Test: Samples several ranks with a SurveyMonitor over TCP, checking the
+ * aggregation of their samples and the ranks which do not answer in time
+ * (one of them is stopped for a while).
+ */
+#include <riff/riff.hpp>
+
+#include <set>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+#define CHNAME "tcp://127.0.0.1:35555"
+
+#define NUM_RANKS 3
+#define ITERATIONS 2000
+
+// In microseconds
+#define LATENCY 1000
+#define STOP_TIME 1000000
+// In milliseconds
+#define MONITORING_INTERVAL 100
+#define DEADLINE 100
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::SurveyMonitor mon(CHNAME, DEADLINE);
+        std::map<pid_t, double> tasks;
+        std::set<pid_t> missing;
+        std::vector<riff::MonitoredApplication> terminated;
+        size_t fullSurveys = 0;
+        while(terminated.size() < NUM_RANKS){
+            usleep(MONITORING_INTERVAL*1000);
+            riff::JobSample job;
+            mon.survey(job);
+            std::cout << "Job sample: " << job.sample << " Ranks: " <<
+                         job.samples.size() << " Missing: " <<
+                         job.missing.size() << std::endl;
+            double numTasks = 0, throughput = 0;
+            for(const riff::MultiSample& s : job.samples){
+                numTasks += s.sample.numTasks;
+                throughput += s.sample.throughput;
+                tasks[s.pid] += s.sample.numTasks;
+            }
+            if(job.sample.numTasks != numTasks ||
+               std::abs(job.sample.throughput - throughput) > 1e-6*throughput){
+                std::cerr << "Wrong aggregation." << std::endl;
+                return -1;
+            }
+            if(job.samples.size() == NUM_RANKS){
+                ++fullSurveys;
+            }
+            missing.insert(job.missing.begin(), job.missing.end());
+            terminated.insert(terminated.end(), job.terminated.begin(), job.terminated.end());
+        }
+        if(!mon.getApplications().empty()){
+            std::cerr << "Terminated ranks still running." << std::endl;
+            return -1;
+        }
+        if(!fullSurveys){
+            std::cerr << "The ranks never answered the same survey." << std::endl;
+            return -1;
+        }
+        // Only the stopped rank.
+        if(missing.size() != 1){
+            std::cerr << "Expected 1 missing rank, actual: " << missing.size() << std::endl;
+            return -1;
+        }
+        for(const riff::MonitoredApplication& a : terminated){
+            std::cout << a.pid << " " << a.totalTasks << " " << tasks[a.pid] << std::endl;
+            if(a.totalTasks != ITERATIONS){
+                std::cerr << "Expected tasks: " << ITERATIONS << std::endl;
+                return -1;
+            }
+            // The tasks after the last sample are not received.
+            if(!tasks[a.pid] || tasks[a.pid] > ITERATIONS){
+                std::cerr << "Wrong sampled tasks: " << tasks[a.pid] << std::endl;
+                return -1;
+            }
+        }
+    }else{
+        pid_t stopped = 0;
+        for(size_t i = 0; i < NUM_RANKS; i++){
+            pid_t pid = fork();
+            if(pid == 0){
+                nn::socket socket(AF_SP, NN_RESPONDENT);
+                riff::Application app(socket, socket.connect(CHNAME));
+                riff::ApplicationConfiguration conf;
+                conf.samplingLengthMs = 0;
+                app.setConfiguration(conf);
+                for(size_t j = 0; j < ITERATIONS; j++){
+                    if(i == 0 && j == ITERATIONS / 2){
+                        raise(SIGSTOP);
+                    }
+                    app.begin();
+                    busyWait(LATENCY);
+                    app.end();
+                }
+                app.terminate();
+                return 0;
+            }
+            if(i == 0){
+                stopped = pid;
+            }
+        }
+        int status;
+        waitpid(stopped, &status, WUNTRACED);
+        usleep(STOP_TIME);
+        kill(stopped, SIGCONT);
+        for(size_t i = 0; i < NUM_RANKS; i++){
+            wait(NULL);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * Test: Checks that the monitor decodes the messages encoded by another
+ * version of riff: the unknown fields and the custom fields beyond
+ * RIFF_MAX_CUSTOM_FIELDS are skipped, and the messages of an incompatible
+ * version are rejected. The application side encodes them by hand.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define NUM_CUSTOM_FIELDS (RIFF_MAX_CUSTOM_FIELDS + 4)
+#define NUM_TASKS 1000
+#define THROUGHPUT 2000
+#define LATENCY 1500.5
+#define PHASE_ID 3
+#define TOTAL_TASKS 5000
+#define EXECUTION_TIME 1234
+
+// Tags of the fields (see riff.cpp).
+#define TAG_TYPE 1
+#define TAG_PID 2
+#define TAG_EXECUTION_TIME 5
+#define TAG_TOTAL_TASKS 6
+#define TAG_SAMPLE 7
+#define TAG_PHASE_ID 17
+// Not known by this version.
+#define TAG_UNKNOWN 100
+
+typedef std::vector<unsigned char> Buffer;
+
+static void varint(Buffer& b, unsigned long long value){
+    while(value >= 0x80){
+        b.push_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    b.push_back(value);
+}
+
+static void header(Buffer& b, unsigned int version, riff::MessageType type){
+    b.push_back('R');
+    b.push_back('F');
+    varint(b, version);
+    varint(b, TAG_TYPE << 3);
+    varint(b, type);
+    varint(b, TAG_PID << 3);
+    varint(b, getpid());
+}
+
+static void fixed64(Buffer& b, unsigned int tag, double value){
+    unsigned long long bits;
+    memcpy(&bits, &value, sizeof(bits));
+    varint(b, tag << 3 | 1);
+    for(size_t i = 0; i < 8; i++){
+        b.push_back(bits >> (8*i));
+    }
+}
+
+static void nested(Buffer& b, unsigned int tag, const Buffer& content){
+    varint(b, tag << 3 | 2);
+    varint(b, content.size());
+    b.insert(b.end(), content.begin(), content.end());
+}
+
+// Unknown fields of each wire type.
+static void unknownFields(Buffer& b){
+    varint(b, TAG_UNKNOWN << 3);
+    varint(b, 123456789);
+    fixed64(b, TAG_UNKNOWN + 1, 3.14);
+    Buffer content(10, 'x');
+    nested(b, TAG_UNKNOWN + 2, content);
+}
+
+// Waits for a message of the monitor, skipping the ones it sends while
+// attaching.
+static void waitRequest(nn::socket& socket, riff::MessageType type){
+    while(true){
+        void* buffer = NULL;
+        int r = socket.recv(&buffer, NN_MSG, 0);
+        const unsigned char* b = (const unsigned char*) buffer;
+        // Magic, version and type, all of them on a single byte.
+        if(r < 5 || memcmp(b, "RF", 2) || b[3] != TAG_TYPE << 3){
+            std::cerr << "Wrong request." << std::endl;
+            exit(-1);
+        }
+        riff::MessageType received = (riff::MessageType) b[4];
+        nn::freemsg(buffer);
+        if(received == type){
+            return;
+        }else if(received != riff::MESSAGE_TYPE_ATTACH){
+            std::cerr << "Unexpected request: " << received << std::endl;
+            exit(-1);
+        }
+    }
+}
+
+static bool check(const char* name, double actual, double expected){
+    if(actual != expected){
+        std::cerr << "Expected " << name << ": " << expected << " Actual: " << actual << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        try{
+            mon.waitStart();
+            std::cerr << "Incompatible version accepted." << std::endl;
+            return -1;
+        }catch(const std::runtime_error& e){
+            std::cout << "Rejected: " << e.what() << std::endl;
+        }
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        if(!mon.getSample(sample)){
+            std::cerr << "No sample received." << std::endl;
+            return -1;
+        }
+        std::cout << "Received sample: " << sample << std::endl;
+        if(!check("numTasks", sample.numTasks, NUM_TASKS) ||
+           !check("throughput", sample.throughput, THROUGHPUT) ||
+           !check("latency", sample.latency, LATENCY) ||
+           !check("phaseId", mon.getPhaseId(), PHASE_ID)){
+            return -1;
+        }
+        for(size_t i = 0; i < RIFF_MAX_CUSTOM_FIELDS; i++){
+            if(!check("customField", sample.customFields[i], i + 1)){
+                return -1;
+            }
+        }
+        if(mon.getSample(sample)){
+            std::cerr << "Stop not received." << std::endl;
+            return -1;
+        }
+        if(!check("totalTasks", mon.getTotalTasks(), TOTAL_TASKS) ||
+           !check("executionTime", mon.getExecutionTime(), EXECUTION_TIME)){
+            return -1;
+        }
+    }else{
+        nn::socket socket(AF_SP, NN_PAIR);
+        socket.connect(CHNAME);
+        Buffer b;
+        header(b, RIFF_WIRE_VERSION + 1, riff::MESSAGE_TYPE_START);
+        socket.send(b.data(), b.size(), 0);
+
+        b.clear();
+        header(b, RIFF_WIRE_VERSION, riff::MESSAGE_TYPE_START);
+        unknownFields(b);
+        socket.send(b.data(), b.size(), 0);
+
+        waitRequest(socket, riff::MESSAGE_TYPE_SAMPLE_REQ);
+        Buffer s;
+        varint(s, 3 << 3); // Throughput, as a varint.
+        varint(s, THROUGHPUT);
+        fixed64(s, 4, LATENCY);
+        fixed64(s, 5, NUM_TASKS); // An integer, as a double.
+        unknownFields(s);
+        for(size_t i = 0; i < NUM_CUSTOM_FIELDS; i++){
+            varint(s, 6 << 3);
+            varint(s, i + 1);
+        }
+        b.clear();
+        header(b, RIFF_WIRE_VERSION, riff::MESSAGE_TYPE_SAMPLE_RES);
+        unknownFields(b);
+        nested(b, TAG_SAMPLE, s);
+        varint(b, TAG_PHASE_ID << 3);
+        varint(b, PHASE_ID);
+        socket.send(b.data(), b.size(), 0);
+
+        waitRequest(socket, riff::MESSAGE_TYPE_SAMPLE_REQ);
+        b.clear();
+        header(b, RIFF_WIRE_VERSION, riff::MESSAGE_TYPE_STOP);
+        varint(b, TAG_TOTAL_TASKS << 3);
+        varint(b, TOTAL_TASKS);
+        unknownFields(b);
+        varint(b, TAG_EXECUTION_TIME << 3);
+        varint(b, EXECUTION_TIME);
+        socket.send(b.data(), b.size(), 0);
+        waitRequest(socket, riff::MESSAGE_TYPE_STOPACK);
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+/**
+ * Test: Checks the time series of an application: its windows are
+ * contiguous, add up to the samples they are received with, and the ones
+ * overwritten while the monitor is not getting the samples are reported.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <thread>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 3000
+#define NUM_THREADS 2
+#define WINDOW_INTERVAL 10 // In milliseconds
+#define TIME_SERIES_LENGTH 64
+#define SLOW_SAMPLE 3
+
+// In microseconds
+#define LATENCY 1000
+#define MONITORING_INTERVAL 200000
+#define SLOW_MONITORING_INTERVAL 1500000
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        unsigned long long nextWindow = 0, overwritten = 0;
+        size_t samples = 0, windows = 0, completeSamples = 0;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            const std::vector<riff::TimeSeriesWindow>& series = mon.getTimeSeries();
+            unsigned long long newOverwritten = mon.getOverwrittenWindows() - overwritten;
+            overwritten = mon.getOverwrittenWindows();
+            std::cout << "Received sample: " << sample.numTasks << " tasks, " <<
+                         series.size() << " windows, " << newOverwritten <<
+                         " overwritten" << std::endl;
+            if(series.empty() || series.size() > TIME_SERIES_LENGTH){
+                std::cerr << "Wrong number of windows: " << series.size() << std::endl;
+                return -1;
+            }
+            // The windows cut before the monitor attached are not sent.
+            if(!samples){
+                nextWindow = series[0].index;
+            }
+            // The overwritten windows are the gap since the previous sample.
+            if(series[0].index != nextWindow + newOverwritten){
+                std::cerr << "Expected window: " << nextWindow + newOverwritten <<
+                             " Actual: " << series[0].index << std::endl;
+                return -1;
+            }
+            double tasks = 0;
+            for(size_t i = 0; i < series.size(); i++){
+                if(series[i].index != series[0].index + i ||
+                   (i && series[i].startMs < series[i - 1].startMs)){
+                    std::cerr << "Windows not contiguous: " << series[i] << std::endl;
+                    return -1;
+                }
+                tasks += series[i].sample.numTasks;
+            }
+            nextWindow = series.back().index + 1;
+            if(!newOverwritten){
+                if(tasks != sample.numTasks){
+                    std::cerr << "Expected tasks in the windows: " << sample.numTasks <<
+                                 " Actual: " << tasks << std::endl;
+                    return -1;
+                }
+                ++completeSamples;
+                windows += series.size();
+            }
+            ++samples;
+            usleep(samples == SLOW_SAMPLE ? SLOW_MONITORING_INTERVAL : MONITORING_INTERVAL);
+        }
+        if(!overwritten){
+            std::cerr << "No overwritten windows." << std::endl;
+            return -1;
+        }
+        // A window every WINDOW_INTERVAL, plus the one cut by the sample.
+        double expected = MONITORING_INTERVAL / 1000.0 / WINDOW_INTERVAL;
+        if(!completeSamples || (double) windows / completeSamples < expected / 2){
+            std::cerr << "Expected about " << expected << " windows per sample." << std::endl;
+            return -1;
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.samplingLengthMs = 0;
+        conf.timeSeriesIntervalMs = WINDOW_INTERVAL;
+        conf.timeSeriesLength = TIME_SERIES_LENGTH;
+        app.setConfiguration(conf);
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < NUM_THREADS; t++){
+            threads.push_back(std::thread([&app](){
+                for(size_t i = 0; i < ITERATIONS; i++){
+                    app.begin();
+                    busyWait(LATENCY);
+                    app.end();
+                }
+            }));
+        }
+        for(std::thread& t : threads){
+            t.join();
+        }
+        app.terminate();
+    }
+    return 0;
+}
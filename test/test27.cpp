@@ -0,0 +1,100 @@
+/**
+ * Test: Checks the non-blocking monitor API on a sequence of short-lived
+ * applications: the samples are received with tryGetSample() and poll() on
+ * getFd(), and the termination of each application is received without
+ * delaying the monitoring of the next one.
+ */
+#include <riff/riff.hpp>
+
+#include <poll.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define NUM_APPLICATIONS 5
+#define ITERATIONS 200
+// In milliseconds
+#define MAX_SAMPLE_WAIT 1000
+#define MAX_STOP_TIME 100
+
+// In microseconds
+#define LATENCY 1000
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        struct pollfd pfd;
+        pfd.fd = mon.getFd();
+        pfd.events = POLLIN;
+        unsigned long long timeouts = 0;
+        for(size_t a = 0; a < NUM_APPLICATIONS; a++){
+            pid_t pid = mon.waitStart();
+            riff::ApplicationSample sample;
+            double tasks = 0;
+            std::future<bool> first = mon.getSampleAsync(sample);
+            riff::SampleStatus status = riff::SAMPLE_STATUS_TERMINATED;
+            if(first.get()){
+                tasks += sample.numTasks;
+                status = riff::SAMPLE_STATUS_RECEIVED;
+            }
+            while(status != riff::SAMPLE_STATUS_TERMINATED){
+                unsigned long long start = riff::getCurrentTimeNs();
+                status = mon.tryGetSample(sample, 0);
+                double elapsedMs = (riff::getCurrentTimeNs() - start) / 1000000.0;
+                if(status == riff::SAMPLE_STATUS_RECEIVED){
+                    tasks += sample.numTasks;
+                }else if(status == riff::SAMPLE_STATUS_TIMEOUT){
+                    ++timeouts;
+                    if(poll(&pfd, 1, MAX_SAMPLE_WAIT) <= 0){
+                        std::cerr << "Nothing received from " << pid << std::endl;
+                        return -1;
+                    }
+                }else if(elapsedMs > MAX_STOP_TIME){
+                    std::cerr << "Termination received in " << elapsedMs << "ms" << std::endl;
+                    return -1;
+                }
+            }
+            std::cout << "Application " << pid << ": " << tasks << " tasks sampled, " <<
+                         mon.getTotalTasks() << " total" << std::endl;
+            if(mon.getTotalTasks() != ITERATIONS || tasks > mon.getTotalTasks()){
+                std::cerr << "Expected total tasks: " << ITERATIONS << std::endl;
+                return -1;
+            }
+        }
+        if(!timeouts){
+            std::cerr << "tryGetSample(0) never returned before the sample." << std::endl;
+            return -1;
+        }
+    }else{
+        for(size_t a = 0; a < NUM_APPLICATIONS; a++){
+            pid_t pid = fork();
+            if(!pid){
+                riff::Application app(CHNAME);
+                riff::ApplicationConfiguration conf;
+                conf.samplingLengthMs = 0;
+                app.setConfiguration(conf);
+                for(size_t i = 0; i < ITERATIONS; i++){
+                    app.begin();
+                    busyWait(LATENCY);
+                    app.end();
+                }
+                app.terminate();
+                return 0;
+            }
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return 0;
+}
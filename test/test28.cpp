@@ -0,0 +1,77 @@
+/**
+ * Test: Checks that an application runs without a monitor, and that the
+ * monitors can attach to it and detach from it at any time: the first
+ * sample of each monitor only covers the time since it attached.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 3000
+#define MONITORS 2
+
+// In microseconds
+#define LATENCY 1000
+#define UNMONITORED_TIME 1000000
+#define MONITORING_INTERVAL 200000
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        double expected = MONITORING_INTERVAL / LATENCY;
+        for(size_t m = 0; m < MONITORS; m++){
+            // Without a monitor, and after the previous one detached.
+            usleep(UNMONITORED_TIME);
+            riff::Monitor mon(CHNAME);
+            mon.waitStart();
+            riff::ApplicationSample sample;
+            usleep(MONITORING_INTERVAL);
+            if(!mon.getSample(sample)){
+                std::cerr << "Application terminated." << std::endl;
+                return -1;
+            }
+            std::cout << "Monitor " << m << ": " << sample.numTasks << " tasks" << std::endl;
+            // Not the tasks computed before attaching.
+            if(sample.numTasks < expected / 2 || sample.numTasks > expected * 2){
+                std::cerr << "Expected about " << expected << " tasks." << std::endl;
+                return -1;
+            }
+            if(m != MONITORS - 1){
+                continue;
+            }
+            // The last one also gets the termination.
+            while(mon.getSample(sample)){
+                usleep(MONITORING_INTERVAL);
+            }
+            if(mon.getTotalTasks() != ITERATIONS){
+                std::cerr << "Expected total tasks: " << ITERATIONS << " Actual: " <<
+                             mon.getTotalTasks() << std::endl;
+                return -1;
+            }
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::ApplicationConfiguration conf;
+        conf.samplingLengthMs = 0;
+        app.setConfiguration(conf);
+        for(size_t i = 0; i < ITERATIONS; i++){
+            app.begin();
+            busyWait(LATENCY);
+            app.end();
+        }
+        app.terminate();
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+/**
+ * Test: Checks the thread handles: threads identified by the user and
+ * threads registered by the application call begin()/end() on their own
+ * handle, and all their tasks are counted in the samples and in the total.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <thread>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 1000
+#define NUM_THREADS 4
+#define NUM_REGISTERED_THREADS 2
+
+// In microseconds
+#define LATENCY 1000
+#define MONITORING_INTERVAL 200000
+
+static void busyWait(unsigned long us){
+    unsigned long start = riff::getCurrentTimeNs();
+    do{;}while(riff::getCurrentTimeNs() - start < us*1000.0);
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    size_t totalThreads = NUM_THREADS + NUM_REGISTERED_THREADS;
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        double tasks = 0;
+        size_t samples = 0;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            std::cout << "Received sample: " << sample.numTasks << " tasks" << std::endl;
+            tasks += sample.numTasks;
+            if(sample.numTasks){
+                ++samples;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+        if(!samples){
+            std::cerr << "No tasks in the samples." << std::endl;
+            return -1;
+        }
+        if(mon.getTotalTasks() != ITERATIONS * totalThreads ||
+           tasks > mon.getTotalTasks()){
+            std::cerr << "Expected total tasks: " << ITERATIONS * totalThreads <<
+                         " Actual: " << mon.getTotalTasks() << std::endl;
+            return -1;
+        }
+    }else{
+        riff::Application app(CHNAME, NUM_THREADS);
+        riff::ApplicationConfiguration conf;
+        conf.samplingLengthMs = 0;
+        app.setConfiguration(conf);
+        try{
+            app.getThreadHandle(NUM_THREADS);
+            std::cerr << "Wrong threadId accepted." << std::endl;
+            return -1;
+        }catch(const std::runtime_error&){
+            ;
+        }
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < totalThreads; t++){
+            threads.push_back(std::thread([&app, t](){
+                riff::ThreadHandle handle = t < NUM_THREADS ?
+                                            app.getThreadHandle(t) :
+                                            app.getThreadHandle();
+                for(size_t i = 0; i < ITERATIONS; i++){
+                    handle.begin();
+                    busyWait(LATENCY);
+                    handle.end();
+                }
+            }));
+        }
+        for(std::thread& t : threads){
+            t.join();
+        }
+        app.terminate();
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+/**
+ * Test: Checks that an application without a monitor frees the data of
+ * the registered threads which terminated, and still counts their tasks
+ * in its totals.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <thread>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define BATCHES 10
+#define THREADS_PER_BATCH 1000
+// In microseconds
+#define BATCH_INTERVAL 500000
+// In megabytes. Without freeing them, each thread keeps some kilobytes.
+#define MAX_MEMORY_GROWTH 64
+
+// Returns the resident memory of this process (megabytes).
+static double getResidentMemory(){
+    FILE* f = fopen("/proc/self/statm", "r");
+    unsigned long size = 0, resident = 0;
+    if(!f || fscanf(f, "%lu %lu", &size, &resident) != 2){
+        std::cerr << "Impossible to read the resident memory." << std::endl;
+        exit(-1);
+    }
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+int main(int argc, char** argv){
+    riff::Application app(CHNAME);
+    double initialMemory = 0;
+    for(size_t b = 0; b < BATCHES; b++){
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < THREADS_PER_BATCH; t++){
+            // Each one terminates right after its only task.
+            threads.push_back(std::thread([&app](){
+                app.begin();
+                app.end();
+            }));
+        }
+        for(std::thread& t : threads){
+            t.join();
+        }
+        usleep(BATCH_INTERVAL);
+        double memory = getResidentMemory();
+        std::cout << "Batch " << b << ": " << memory << "MB" << std::endl;
+        if(!b){
+            initialMemory = memory;
+        }else if(memory - initialMemory > MAX_MEMORY_GROWTH){
+            std::cerr << "The terminated threads are not freed." << std::endl;
+            return -1;
+        }
+    }
+    app.terminate();
+    if(app.getTotalTasks() != BATCHES * THREADS_PER_BATCH){
+        std::cerr << "Expected total tasks: " << BATCHES * THREADS_PER_BATCH <<
+                     " Actual: " << app.getTotalTasks() << std::endl;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * Test: Checks that an application answering a SurveyMonitor terminates
+ * without a surveyor, and waits for the last survey at most the termination
+ * timeout when the surveyor does not send it.
+ */
+#include <riff/riff.hpp>
+
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+// In milliseconds
+#define TERMINATION_TIMEOUT 500
+#define MARGIN 2000
+// In microseconds
+#define CONNECTION_TIME 200000
+
+// Returns the time (milliseconds) taken by terminate().
+static double run(double terminationTimeoutMs){
+    nn::socket socket(AF_SP, NN_RESPONDENT);
+    riff::Application app(socket, socket.connect(CHNAME));
+    riff::ApplicationConfiguration conf;
+    conf.terminationTimeoutMs = terminationTimeoutMs;
+    app.setConfiguration(conf);
+    app.begin();
+    app.end();
+    usleep(CONNECTION_TIME);
+    unsigned long long start = riff::getCurrentTimeNs();
+    app.terminate();
+    return (riff::getCurrentTimeNs() - start) / 1000000.0;
+}
+
+int main(int argc, char** argv){
+    // Without surveyor, terminate() does not wait for the default timeout.
+    double ms = run(riff::ApplicationConfiguration().terminationTimeoutMs);
+    std::cout << "Without surveyor: " << ms << "ms" << std::endl;
+    if(ms > MARGIN){
+        std::cerr << "terminate() waited without surveyor." << std::endl;
+        return -1;
+    }
+    // The surveyor never sends the last survey.
+    nn::socket surveyor(AF_SP, NN_SURVEYOR);
+    surveyor.bind(CHNAME);
+    ms = run(TERMINATION_TIMEOUT);
+    std::cout << "Without survey: " << ms << "ms" << std::endl;
+    if(ms < TERMINATION_TIMEOUT || ms > TERMINATION_TIMEOUT + MARGIN){
+        std::cerr << "terminate() did not wait for the termination timeout." <<
+                     std::endl;
+        return -1;
+    }
+    return 0;
+}
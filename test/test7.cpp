@@ -0,0 +1,89 @@
+/**
+ * Test: Checks that a sample is returned within the consolidation deadline
+ * when a thread is stalled, and that the stalled thread is reported.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <omp.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 4000
+#define NUM_THREADS 2
+#define STALLED_THREAD 1
+#define DEADLINE_MS 50
+
+// In microseconds
+#define LATENCY 1000
+#define STALL_TIME 3000000
+#define MONITORING_INTERVAL 1000000
+
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        usleep(MONITORING_INTERVAL);
+        bool first = true;
+        unsigned long long start = riff::getCurrentTimeNs();
+        while(mon.getSample(sample)){
+            double elapsedMs = (riff::getCurrentTimeNs() - start) / 1000000.0;
+            std::cout << "Received sample: " << sample << " in " << elapsedMs << "ms" << std::endl;
+            if(first){
+                // The stalled thread is inside a STALL_TIME long task.
+                if(elapsedMs > 10*DEADLINE_MS){
+                    std::cerr << "Sample received after " << elapsedMs << "ms." << std::endl;
+                    return -1;
+                }
+                if(mon.getActiveThreads() != NUM_THREADS ||
+                   mon.getContributingThreads() != NUM_THREADS - 1){
+                    std::cerr << "Expected " << NUM_THREADS - 1 << "/" << NUM_THREADS <<
+                                 " contributing threads. Actual: " << mon.getContributingThreads() <<
+                                 "/" << mon.getActiveThreads() << std::endl;
+                    return -1;
+                }
+                const std::vector<riff::StalledThread>& stalled = mon.getStalledThreads();
+                if(stalled.size() != 1 || stalled[0].threadId != STALLED_THREAD ||
+                   stalled[0].stallTimeMs < MONITORING_INTERVAL / 2000.0){
+                    std::cerr << "Stalled thread not reported." << std::endl;
+                    return -1;
+                }
+                first = false;
+            }
+            usleep(MONITORING_INTERVAL);
+            start = riff::getCurrentTimeNs();
+        }
+    }else{
+        omp_set_num_threads(NUM_THREADS);
+        riff::Application app(CHNAME, NUM_THREADS);
+        riff::ApplicationConfiguration conf;
+        conf.consolidationDeadlineMs = DEADLINE_MS;
+        app.setConfiguration(conf);
+#pragma omp parallel
+        {
+            int threadId = omp_get_thread_num();
+            for(size_t i = 0; i < ITERATIONS; i++){
+                app.begin(threadId);
+                if(threadId == STALLED_THREAD && i == 0){
+                    usleep(STALL_TIME);
+                }else{
+                    usleep(LATENCY);
+                }
+                app.end(threadId);
+                if(threadId == STALLED_THREAD && i == 100){
+                    break;
+                }
+            }
+        }
+        app.terminate();
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * Test: Checks the correctness of the library when threads register
+ * themselves and the number of threads changes over time.
+ */
+#include <riff/riff.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <thread>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define FIRST_THREADS 4
+#define SECOND_THREADS 2
+#define ITERATIONS 2000
+
+// In microseconds
+#define LATENCY 1000
+#define MONITORING_INTERVAL 500000
+
+static void work(riff::Application* app){
+    for(size_t i = 0; i < ITERATIONS; i++){
+        app->begin();
+        usleep(LATENCY);
+        app->end();
+    }
+}
+
+static void runThreads(riff::Application* app, size_t numThreads){
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < numThreads; i++){
+        threads.push_back(std::thread(work, app));
+    }
+    for(std::thread& t : threads){
+        t.join();
+    }
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        bool first = true, shrunk = false;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            std::cout << "Received sample: " << sample << " Threads: " <<
+                         mon.getContributingThreads() << "/" << mon.getActiveThreads() << std::endl;
+            if(first){
+                if(mon.getActiveThreads() != FIRST_THREADS ||
+                   mon.getContributingThreads() != FIRST_THREADS){
+                    std::cerr << "Expected " << FIRST_THREADS << " threads." << std::endl;
+                    return -1;
+                }
+                first = false;
+            }
+            if(mon.getActiveThreads() == SECOND_THREADS &&
+               mon.getContributingThreads() == SECOND_THREADS){
+                shrunk = true;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+        if(!shrunk){
+            std::cerr << "Exited threads still active." << std::endl;
+            return -1;
+        }
+    }else{
+        riff::Application app(CHNAME, 0);
+        runThreads(&app, FIRST_THREADS);
+        runThreads(&app, SECOND_THREADS);
+        app.terminate();
+        std::cout << "Total tasks: " << app.getTotalTasks() << std::endl;
+        if(app.getTotalTasks() != (FIRST_THREADS + SECOND_THREADS) * ITERATIONS){
+            std::cerr << "Wrong number of tasks." << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+/**
+ * Test: Checks the correctness of the samples of named regions.
+ */
+#include <riff/riff.hpp>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define CHNAME "ipc:///tmp/demo.ipc"
+
+#define ITERATIONS 1000
+
+// In microseconds
+#define INGEST_LATENCY 1000
+#define TRANSFORM_LATENCY 3000
+#define MONITORING_INTERVAL 500000
+
+// In percentage
+#define MAX_THROUGHPUT_DIFFERENCE 20
+
+static bool checkRegion(const riff::RegionSample& region, const char* name){
+    std::cout << "Region " << region.name << ": " << region.sample << std::endl;
+    if(strcmp(region.name, name)){
+        std::cerr << "Expected region " << name << std::endl;
+        return false;
+    }
+    if(region.contributingThreads != 1 || region.activeThreads != 1){
+        std::cerr << "Expected one thread." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        std::cerr << "Usage: " << argv[0] << " [0(Monitor) or 1(Application)]" << std::endl;
+        return -1;
+    }
+    if(atoi(argv[1]) == 0){
+        riff::Monitor mon(CHNAME);
+        mon.waitStart();
+        riff::ApplicationSample sample;
+        size_t comparedLatencies = 0;
+        usleep(MONITORING_INTERVAL);
+        while(mon.getSample(sample)){
+            const std::vector<riff::RegionSample>& regions = mon.getRegionSamples();
+            if(regions.size() != 2){
+                std::cerr << "Expected 2 regions, got " << regions.size() << std::endl;
+                return -1;
+            }
+            // The default region is not used.
+            if(mon.getActiveThreads() || sample.numTasks){
+                std::cerr << "Unexpected tasks in the default region." << std::endl;
+                return -1;
+            }
+            if(!checkRegion(regions[0], "ingest") ||
+               !checkRegion(regions[1], "transform")){
+                return -1;
+            }
+            const riff::ApplicationSample& ingest = regions[0].sample;
+            const riff::ApplicationSample& transform = regions[1].sample;
+            // Latencies are not reliable in inconsistent samples.
+            if(!ingest.inconsistent && !transform.inconsistent){
+                if(ingest.latency >= transform.latency){
+                    std::cerr << "Wrong latencies." << std::endl;
+                    return -1;
+                }
+                ++comparedLatencies;
+            }
+            if(fabs(ingest.throughput - transform.throughput) / transform.throughput * 100.0 >
+               MAX_THROUGHPUT_DIFFERENCE){
+                std::cerr << "Wrong throughputs." << std::endl;
+                return -1;
+            }
+            usleep(MONITORING_INTERVAL);
+        }
+        if(!comparedLatencies){
+            std::cerr << "No consistent samples to compare the latencies." << std::endl;
+            return -1;
+        }
+    }else{
+        riff::Application app(CHNAME);
+        riff::Region& ingest = app.region("ingest");
+        riff::Region& transform = app.region("transform");
+        for(size_t i = 0; i < ITERATIONS; i++){
+            ingest.begin(0);
+            usleep(INGEST_LATENCY);
+            ingest.end(0);
+            transform.begin();
+            usleep(TRANSFORM_LATENCY);
+            transform.end();
+        }
+        app.terminate();
+        std::cout << "Total tasks: " << app.getTotalTasks() << std::endl;
+        if(app.getTotalTasks() != 2 * ITERATIONS){
+            std::cerr << "Wrong number of tasks." << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}